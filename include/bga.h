@@ -0,0 +1,61 @@
+#ifndef BGA_H
+#define BGA_H
+
+#include <stdint.h>
+
+/*
+ * Bochs Graphics Adapter (VBE DISPI), as implemented by Bochs and QEMU's
+ * standard VGA. Registers are reached through an index port and a data port.
+ * The virtual screen can be taller than the visible one, and the Y offset
+ * register selects which rows are scanned out, so flipping between pages is
+ * a single register write.
+ */
+
+#define BGA_INDEX_PORT 0x01CE
+#define BGA_DATA_PORT 0x01CF
+
+// Register indices
+#define BGA_INDEX_ID 0x0
+#define BGA_INDEX_XRES 0x1
+#define BGA_INDEX_YRES 0x2
+#define BGA_INDEX_BPP 0x3
+#define BGA_INDEX_ENABLE 0x4
+#define BGA_INDEX_BANK 0x5
+#define BGA_INDEX_VIRT_WIDTH 0x6
+#define BGA_INDEX_VIRT_HEIGHT 0x7
+#define BGA_INDEX_X_OFFSET 0x8
+#define BGA_INDEX_Y_OFFSET 0x9
+#define BGA_INDEX_VIDEO_MEMORY_64K 0xA
+
+// Enable register bits
+#define BGA_DISABLED 0x00
+#define BGA_ENABLED 0x01
+#define BGA_LFB_ENABLED 0x40
+#define BGA_NOCLEARMEM 0x80
+
+// Known adapter versions
+#define BGA_ID_MIN 0xB0C0
+#define BGA_ID_MAX 0xB0C5
+
+// Detect the adapter, returns its version (0xB0C0 - 0xB0C5) or 0 if absent
+uint16_t bga_detect(void);
+
+// Physical address of the linear framebuffer (PCI BAR 0), 0 if not found
+uint32_t bga_framebuffer_addr(void);
+
+// Size of the video memory in bytes
+uint32_t bga_vram_size(void);
+
+// Set a mode with a linear framebuffer. The virtual width is the visible
+// width, the adapter derives the virtual height from the video memory size
+// Returns: 0 = success, -1 = mode rejected by the adapter
+int8_t bga_set_mode(uint16_t width, uint16_t height, uint8_t bpp);
+
+// Virtual resolution actually in effect
+uint16_t bga_virtual_width(void);
+uint16_t bga_virtual_height(void);
+
+// First virtual row scanned out
+void bga_set_y_offset(uint16_t y);
+
+#endif
@@ -5,6 +5,7 @@
 #define DF_INT_VECTOR 8  /* Double Fault */
 #define GP_INT_VECTOR 13 /* General Protection */
 #define KBD_INT_VECTOR 0x21
+#define MOUSE_INT_VECTOR 0x2C
 
 // External links to ISRs defined in isr.asm file
 extern void isr_ud();
@@ -14,4 +15,7 @@ extern void isr_gp();
 // External ASM ISR handler for keyboard interrupts
 extern void isr_keyboard();
 
+// External ASM ISR handler for PS/2 mouse interrupts
+extern void isr_mouse();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include "video.h"
+#include <stdint.h>
+
+/*
+ * Rectangular surfaces composited onto the screen, e.g. a log pane, a HUD
+ * and a game view. Each surface has a back store in the pixel format of the
+ * draw target, a z-order and a list of rects damaged since the last
+ * composite. compositor_present() copies only the damaged parts that no
+ * surface above covers, so drawing into one surface never redraws another.
+ * Screen areas no visible surface covers show the background color.
+ */
+
+// Damaged rects kept per surface, more are merged
+#define COMPOSITOR_DAMAGE_RECTS 16
+
+struct compositor_surface {
+  // Position on screen, the surface may hang over the right and bottom edge
+  video_rect_t rect;
+
+  // Surfaces with a higher z are drawn on top, equal ones in the order
+  // they were added
+  int16_t z;
+  bool visible;
+
+  // Back store, grows when the surface is set up again larger. Pixels are
+  // in the layout with key 'format' (see pixel_format_key())
+  uint8_t *pixels;
+  uint32_t pitch;
+  uint32_t capacity;
+  uint32_t format;
+
+  // Surface coordinates damaged since the last composite
+  video_rect_t damage[COMPOSITOR_DAMAGE_RECTS];
+  uint8_t damage_count;
+
+  // Next surface up
+  struct compositor_surface *next;
+};
+
+typedef struct compositor_surface compositor_surface_t;
+
+// Set up a surface at ('x', 'y') and add it on top of the surfaces with the
+// same 'z'. Its store starts out black, in the current pixel format. Calling
+// it again for a surface already added moves and resizes it, e.g. after the
+// pixel format changed; the store has to be drawn again then
+// Returns: 0 = success, -1 = empty size or out of memory
+int8_t compositor_add(compositor_surface_t *surface, uint16_t x, uint16_t y,
+                      uint16_t w, uint16_t h, int16_t z);
+
+// Take a surface off the screen, the area under it is composited again
+void compositor_remove(compositor_surface_t *surface);
+
+// Draw into a surface with the usual video functions until compositor_end().
+// Coordinates are relative to the surface and clipped to it, and whatever
+// is drawn is recorded as its damage. Surfaces may be drawn while drawing
+// another, up to 4 deep counting other off-screen drawing like text bitmaps
+// Returns: 0 = success, -1 = pixel format changed since compositor_add(),
+// or nested too deep
+int8_t compositor_begin(compositor_surface_t *surface);
+void compositor_end(void);
+
+// Record damage for pixels of a surface changed without the video functions
+void compositor_damage(compositor_surface_t *surface, uint16_t x, uint16_t y,
+                       uint16_t w, uint16_t h);
+
+// Move a surface, change its z-order or hide it. The screen areas involved
+// are composited again, the store is kept
+void compositor_move(compositor_surface_t *surface, uint16_t x, uint16_t y);
+void compositor_set_z(compositor_surface_t *surface, int16_t z);
+void compositor_show(compositor_surface_t *surface, bool visible);
+
+// Color of the screen where no surface is shown
+void compositor_set_background(color_t color);
+
+// Copy the visible damage of every surface to the screen and present it.
+// Called while a surface is being drawn, it waits for the outermost
+// compositor_end(), so a half drawn frame is never shown
+void compositor_present(void);
+
+#endif
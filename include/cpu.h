@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+
+// CPUID leaf 1 EDX feature bits
+#define CPUID_FEAT_PSE (1 << 3)
+#define CPUID_FEAT_TSC (1 << 4)
+#define CPUID_FEAT_MSR (1 << 5)
+#define CPUID_FEAT_MTRR (1 << 12)
+#define CPUID_FEAT_PAT (1 << 16)
+
+// EFLAGS interrupt enable bit
+#define EFLAGS_IF (1u << 9)
+
+// Control register bits
+#define CR0_CD (1u << 30)
+#define CR0_NW (1u << 29)
+#define CR0_PG (1u << 31)
+#define CR4_PSE (1u << 4)
+
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+  asm volatile("cpuid"
+               : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+               : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t lo, hi;
+  asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr"
+               :
+               : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Disable interrupts, returning the EFLAGS to restore them from
+static inline uint32_t irq_save(void) {
+  uint32_t eflags;
+  asm volatile("pushfl; popl %0; cli" : "=r"(eflags) : : "memory");
+  return eflags;
+}
+
+// Enable interrupts again if they were enabled before irq_save()
+static inline void irq_restore(uint32_t eflags) {
+  if (eflags & EFLAGS_IF)
+    asm volatile("sti" : : : "memory");
+}
+
+static inline uint32_t read_cr0(void) {
+  uint32_t value;
+  asm volatile("mov %%cr0, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+  asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr3(void) {
+  uint32_t value;
+  asm volatile("mov %%cr3, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr3(uint32_t value) {
+  asm volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+  uint32_t value;
+  asm volatile("mov %%cr4, %0" : "=r"(value));
+  return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+  asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void wbinvd(void) { asm volatile("wbinvd" : : : "memory"); }
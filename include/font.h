@@ -0,0 +1,60 @@
+#ifndef FONT_H
+#define FONT_H
+
+#include <stdint.h>
+
+/*
+ * Bitmap fonts: the built-in 8x8 font, PSF1/PSF2 fonts and anti-aliased
+ * fonts with 8-bit coverage per pixel, e.g. loaded as a multiboot module.
+ * Glyphs are indexed by character byte, PSF unicode tables are ignored.
+ */
+
+// Font description, the glyph bitmaps stay where they were loaded
+struct font {
+  uint16_t width;
+  uint16_t height;
+  uint16_t glyph_count;
+
+  // Glyph rows are padded to whole bytes
+  uint16_t row_bytes;
+  uint32_t glyph_bytes;
+  const uint8_t *glyphs;
+
+  // Bit 0 is the leftmost pixel (built-in font), otherwise bit 7 (PSF)
+  bool lsb_left;
+
+  // One coverage byte (0 - 255) per pixel instead of one bit
+  bool coverage;
+};
+
+typedef struct font font_t;
+
+// Describe the built-in 8x8 font (characters 0x00 - 0x7F)
+void font_builtin(font_t *font);
+
+// Parse a PSF1 or PSF2 font in memory
+// Returns: 0 = success, -1 = not a PSF font or truncated
+int8_t font_load_psf(font_t *font, const void *data, uint32_t size);
+
+// Parse an anti-aliased font, as tools/mkfont.py renders it from a TrueType
+// font: "CCAF", version (1 byte), 0, width, height, glyph count (2 bytes
+// each, little endian), then the glyphs as rows of coverage bytes
+// Returns: 0 = success, -1 = not such a font or truncated
+int8_t font_load_coverage(font_t *font, const void *data, uint32_t size);
+
+// Whether pixel (x, y) of a 1-bit glyph is set
+static inline bool font_pixel(const font_t *font, const uint8_t *glyph,
+                              uint16_t x, uint16_t y) {
+  uint8_t bits = glyph[y * font->row_bytes + (x >> 3)];
+  return font->lsb_left ? (bits >> (x & 7)) & 1 : (bits << (x & 7)) & 0x80;
+}
+
+// How much pixel (x, y) of a glyph is covered, 0 - 255
+static inline uint8_t font_coverage(const font_t *font, const uint8_t *glyph,
+                                    uint16_t x, uint16_t y) {
+  if (font->coverage)
+    return glyph[y * font->row_bytes + x];
+  return font_pixel(font, glyph, x, y) ? 0xFF : 0x00;
+}
+
+#endif
@@ -26,4 +26,13 @@ void *memmove(void *dest, const void *src, size_t n);
 // Compares two memory blocks.
 int memcmp(const void *s1, const void *s2, size_t n);
 
+// Hands the physical range [start, end) to the boot-time allocator.
+void mem_init(uintptr_t start, uintptr_t end);
+
+// Allocates n bytes aligned to 'align' (power of two) from the boot-time
+// allocator. Memory is never freed. Returns NULL when the range is exhausted.
+// Buffers that are sized again later keep their capacity and are only
+// replaced by a larger allocation.
+void *mem_alloc(size_t n, size_t align);
+
 #endif
\ No newline at end of file
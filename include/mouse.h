@@ -0,0 +1,29 @@
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+// Buttons held, as reported in the first byte of a packet
+#define MOUSE_BUTTON_LEFT 0x01
+#define MOUSE_BUTTON_RIGHT 0x02
+#define MOUSE_BUTTON_MIDDLE 0x04
+
+// Motion in mouse counts since the last mouse_read(), y grows downwards like
+// screen coordinates
+typedef struct mouse_state {
+  int16_t dx;
+  int16_t dy;
+  uint8_t buttons;
+} mouse_state_t;
+
+// Enable the PS/2 auxiliary device behind the keyboard controller and its
+// interrupt (IRQ 12). The handler only collects motion, so nothing is drawn
+// from the interrupt. Call after PIC_Init() with interrupts disabled
+// Returns: 0 = success, -1 = no controller or no mouse answered
+int8_t mouse_init(void);
+
+// Take the motion collected since the last call, and the buttons held
+// Returns: true when the mouse moved or a button changed since then
+bool mouse_read(mouse_state_t *state);
+
+#endif
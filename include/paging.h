@@ -0,0 +1,45 @@
+#ifndef PAGING_H
+#define PAGING_H
+
+#include <stdint.h>
+
+/*
+ * Identity paging and memory types.
+ * The whole 4 GiB space is identity mapped with 4 MiB pages, which is what
+ * lets a physical range get its own cache policy through the PAT. CPUs
+ * without PAT (or without PSE) fall back to a variable range MTRR.
+ */
+
+// Memory types, encoded as in the PAT and MTRR registers
+typedef enum {
+  MEM_TYPE_UC = 0x00,      // Uncacheable
+  MEM_TYPE_WC = 0x01,      // Write-combining
+  MEM_TYPE_WT = 0x04,      // Write-through
+  MEM_TYPE_WP = 0x05,      // Write-protected
+  MEM_TYPE_WB = 0x06,      // Write-back
+  MEM_TYPE_UC_MINUS = 0x07 // Uncacheable, may be overridden by an MTRR
+} MEM_TYPE;
+
+// Where the memory type of a range comes from
+typedef enum {
+  MEM_SOURCE_NONE = 0, // Firmware defaults, nothing was changed
+  MEM_SOURCE_PAT,      // Page attributes
+  MEM_SOURCE_MTRR      // Variable range MTRR
+} MEM_SOURCE;
+
+// Identity map all memory and program the PAT when the CPU supports it.
+// Must run before anything relies on the caching of a specific range
+void paging_init(void);
+
+// Make [addr, addr + size) write-combining, meant for the framebuffer
+// Returns: the mechanism used, MEM_SOURCE_NONE when neither was available
+MEM_SOURCE paging_set_write_combining(uint64_t addr, uint32_t size);
+
+// Effective memory type at a physical address, read back from the page
+// directory, the PAT MSR and the MTRRs
+MEM_TYPE paging_memory_type(uint64_t addr);
+
+// Short name of a memory type, e.g. "WC"
+const char *paging_memory_type_name(MEM_TYPE type);
+
+#endif
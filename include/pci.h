@@ -0,0 +1,50 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+// Configuration mechanism #1 ports
+#define PCI_CONFIG_ADDRESS 0x0CF8
+#define PCI_CONFIG_DATA 0x0CFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_BAR0 0x10
+#define PCI_CAPABILITIES 0x34
+
+// Command register bits, and the status bit read along with them
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+#define PCI_STATUS_CAPABILITIES 0x00100000
+
+// Location of a function on the bus
+struct pci_device {
+  uint8_t bus;
+  uint8_t slot;
+  uint8_t func;
+};
+
+typedef struct pci_device pci_device_t;
+
+// Read/write a 32-bit register of a function's configuration space
+uint32_t pci_read32(pci_device_t dev, uint8_t offset);
+void pci_write32(pci_device_t dev, uint8_t offset, uint32_t value);
+
+// Find the first function with the given IDs
+// Returns: 0 = found and stored in 'out', -1 = not present
+int8_t pci_find_device(uint16_t vendor, uint16_t device, pci_device_t *out);
+
+// Base address of a memory BAR, flag bits removed. 0 for 64-bit BARs placed
+// above 4 GiB, which are out of reach
+uint32_t pci_bar_address(pci_device_t dev, uint8_t bar);
+
+// Let the function decode its memory BARs and master the bus (DMA)
+void pci_enable_memory(pci_device_t dev);
+
+// Walk the capability list for ID 'id', starting after the capability at
+// 'after' or at the head of the list when 'after' is 0
+// Returns: configuration space offset of the capability, 0 = not found
+uint8_t pci_find_capability(pci_device_t dev, uint8_t id, uint8_t after);
+
+#endif
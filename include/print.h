@@ -1,6 +1,8 @@
 #ifndef PRINT_H
 #define PRINT_H
 
+#include "compositor.h"
+#include "text_bitmap.h"
 #include "video.h"
 #include <stdarg.h>
 #include <stdint.h>
@@ -9,6 +11,13 @@
 void print_init(uint16_t screen_width, uint16_t screen_height,
                 uint8_t font_width, uint8_t font_height, color_t colorMode);
 
+// Draw the console into a compositor surface, e.g. a log pane beside a game
+// view, instead of onto the screen. Call print_init() with the surface size
+// afterwards, it reuses its buffers when they are large enough. Output then
+// only damages the pane and is shown with compositor_present(), the other
+// surfaces are not redrawn. NULL draws onto the screen again
+void print_set_surface(compositor_surface_t *pane);
+
 // Clears the print window
 void print_clear(color_t text_color, color_t bg_color);
 
@@ -18,9 +27,27 @@ void setColorMode(color_t colorMode);
 // Get current color
 color_t getColorMode();
 
+// The console keeps every character in a cell grid and only renders the
+// cells that changed. Output that scrolls is batched, so a burst of lines
+// costs one bulk scroll. It reaches the screen on print_flush(), or by itself
+// once a whole screen of lines is pending
+void print_flush(void);
+
+// Render every cell again, e.g. after the pixel format changed
+void print_redraw(void);
+
+// Scroll the viewport through the scrollback, positive 'lines' go back in
+// history and negative ones forward, down to the live screen
+void print_scroll_view(int16_t lines);
+
 // Prints a character at current cursor position with set color mode
 void putc(char c);
 
+// Prints a text bitmap on the lines below the cursor, starting on a new line.
+// Its cells join the console like printed text, but on screen it is one
+// copy of the pre-rendered bitmap. The cursor ends up on the line after it
+void print_bitmap(text_bitmap_t *bitmap);
+
 // Prints a character at given position with given color mode
 void putcAt(char c, uint16_t x, uint16_t y, color_t colorMode);
 
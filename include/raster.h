@@ -0,0 +1,66 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "video.h"
+#include <stdint.h>
+
+/*
+ * Triangle rasterizer for 3D scenes, drawing into the video module's
+ * target, normally the back buffer. Triangles are set up as edge functions
+ * and binned into 64x64 pixel tiles. raster_end() renders tile by tile, so
+ * the pixels and depths of a tile stay in cache while all its triangles are
+ * drawn. Within a tile, 8x8 blocks outside a triangle are skipped and blocks
+ * fully inside skip the edge tests. Pixels are shaded 4 at a time with SSE2.
+ * Only 32bpp XRGB targets are supported, which the back buffer always is.
+ */
+
+// Vertex positions are in 1/16 pixels
+#define RASTER_SUBPIXEL 16
+
+// Triangle modes, flat shading with the first vertex's color by default
+#define RASTER_GOURAUD 0x01  // Interpolate the vertex colors
+#define RASTER_TEXTURED 0x02 // Texture mapped, modulated by the shading
+#define RASTER_NO_DEPTH 0x04 // Neither test nor write the depth buffer
+
+struct raster_vertex {
+  // Pixel center (x + 0.5, y + 0.5) is (16x + 8, 16y + 8), clamped to
+  // +-2048 pixels
+  int32_t x;
+  int32_t y;
+
+  // Depth, smaller is nearer. raster_clear_depth() sets the far plane 0xFFFF,
+  // and 0xFFFF itself is drawn as 0xFFFE so that it still passes the test
+  uint16_t z;
+
+  color_t color;
+
+  // Texel position in 16.16 fixed point, wrapped at the texture size
+  int32_t u;
+  int32_t v;
+};
+
+typedef struct raster_vertex raster_vertex_t;
+
+// Start a frame in the current draw target. Memory for the depth buffer and
+// the bins grows to the target size on first use
+// Returns: 0 = success, -1 = target is not 32bpp XRGB or out of memory
+int8_t raster_begin(void);
+
+// Set every depth to the farthest value
+void raster_clear_depth(void);
+
+// Texture for the RASTER_TEXTURED triangles that follow, NULL for none. Its
+// width and height must be powers of two. The image must stay valid until
+// raster_end()
+// Returns: 0 = success, -1 = size is not a power of two
+int8_t raster_set_texture(const video_image_t *texture);
+
+// Queue a triangle, in either winding. The queue is rendered early when it
+// is full, so a frame may hold any number of triangles
+void raster_triangle(const raster_vertex_t *a, const raster_vertex_t *b,
+                     const raster_vertex_t *c, uint8_t mode);
+
+// Render the queued triangles and mark them dirty
+void raster_end(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include <stdint.h>
+
+/*
+ * 16550 UART on COM1, polled. Used to get data out of headless runs, e.g.
+ * QEMU with -display none -serial file:out.bin
+ */
+
+#define SERIAL_COM1 0x3F8
+
+// Program COM1 for 8N1 at 'baud' with FIFOs enabled
+// Returns: 0 = success, -1 = no UART answered the loopback test
+int8_t serial_init(uint32_t baud);
+
+// Send bytes, waiting for room in the transmit FIFO. Does nothing when
+// serial_init() failed
+void serial_write(const void *data, uint32_t size);
+
+// Whether a received byte is waiting
+bool serial_received(void);
+
+// Read a received byte, waits until one arrives (0 without a UART)
+uint8_t serial_read(void);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef TEXT_BITMAP_H
+#define TEXT_BITMAP_H
+
+#include "video.h"
+#include <stdint.h>
+
+/*
+ * Static multi-line text, e.g. banners and title screens, laid out once into
+ * a grid of character cells and rendered off-screen in the native pixel
+ * format. Drawing it is one row copy per pixel row, no glyph is expanded
+ * again until the font or the pixel format changes.
+ */
+
+// One character of the layout
+struct text_bitmap_cell {
+  char c;
+  color_t fg;
+};
+
+struct text_bitmap {
+  // Layout of 'columns' by 'rows' cells, row by row
+  struct text_bitmap_cell *cells;
+  uint16_t columns;
+  uint16_t rows;
+
+  // Column '\r' and '\n' return to, and where the next text goes
+  uint16_t origin_column;
+  uint16_t cursor_x;
+  uint16_t cursor_y;
+
+  // Behind every character and in cells never written
+  color_t background;
+
+  // Rendered cells, 'width' by 'height' pixels
+  uint8_t *pixels;
+  uint32_t pitch;
+  uint32_t capacity; // Sized for 4 bytes per pixel
+  uint16_t width;
+  uint16_t height;
+
+  // Pixel format and cell size of the render, 0 = render again
+  uint32_t rendered_format;
+  uint16_t rendered_cell_w;
+  uint16_t rendered_cell_h;
+};
+
+typedef struct text_bitmap text_bitmap_t;
+
+// Size of the grid 'text' needs when its lines start at 'origin_column'.
+// '\n' starts a new line, '\r' goes back to the origin column
+void text_bitmap_measure(const char *text, uint16_t origin_column,
+                         uint16_t *columns, uint16_t *rows);
+
+// Set up an empty grid of 'columns' by 'rows' cells, writing starts at the
+// origin column of the first row
+// Returns: 0 = success, -1 = empty grid or out of memory
+int8_t text_bitmap_create(text_bitmap_t *bitmap, uint16_t columns,
+                          uint16_t rows, uint16_t origin_column,
+                          color_t background);
+
+// Lay out 'text' from where the last call stopped. Characters past the right
+// or bottom edge are dropped
+void text_bitmap_puts(text_bitmap_t *bitmap, const char *text, color_t fg);
+
+// Create a grid just large enough for 'text' and lay it out
+// Returns: 0 = success, -1 = empty text or out of memory
+int8_t text_bitmap_from_string(text_bitmap_t *bitmap, const char *text,
+                               uint16_t origin_column, color_t fg,
+                               color_t background);
+
+// Copy the bitmap to the screen with its top left at (x, y), clipped to the
+// clip rect. It is rendered first if the layout, the cell size or the pixel
+// format changed since the last time
+// Returns: 0 = success, -1 = out of memory or wider than 65535 pixels
+int8_t text_bitmap_draw(text_bitmap_t *bitmap, int16_t x, int16_t y);
+
+// Render again on the next draw, e.g. after selecting another font of the
+// same cell size
+void text_bitmap_invalidate(text_bitmap_t *bitmap);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef TILEMAP_H
+#define TILEMAP_H
+
+#include "video.h"
+#include <stdint.h>
+
+/*
+ * Tile-map background layer drawn through the video module.
+ * Tiles are cut from a tileset image and kept converted to the pixel format
+ * of the draw target, so rendering is row copies only. A camera moving by a
+ * few pixels moves the pixels already in the viewport and draws just the
+ * strips of tiles that scrolled into view.
+ */
+
+// Tile index that is drawn as the background color
+#define TILEMAP_EMPTY 0xFFFF
+
+struct tilemap {
+  // Map of 'map_w' by 'map_h' tile indices, row by row
+  const uint16_t *tiles;
+  uint16_t map_w;
+  uint16_t map_h;
+
+  // Tile size in pixels, tiles are read from the tileset left to right,
+  // top to bottom
+  uint16_t tile_w;
+  uint16_t tile_h;
+  uint16_t tile_count;
+  const video_image_t *tileset;
+
+  // Drawn outside the map and for TILEMAP_EMPTY
+  color_t background;
+
+  // Screen rectangle the map is drawn into
+  video_rect_t view;
+
+  // Tiles in the native pixel format, rebuilt when the format changes
+  uint8_t *cache;
+  uint32_t cache_capacity;
+  uint32_t cache_format; // Pixel size and channel shifts, 0 = not built
+
+  // Bounce row for moving pixels sideways within a row
+  uint8_t *scratch;
+  uint32_t scratch_capacity;
+
+  // What the viewport shows, to reuse it on the next render
+  bool drawn;
+  int32_t drawn_x;
+  int32_t drawn_y;
+  const uint8_t *drawn_addr;
+  uint32_t drawn_pitch;
+};
+
+typedef struct tilemap tilemap_t;
+
+// Set up a map over a tileset cut into 'tile_w' by 'tile_h' tiles. The map
+// and the tileset must stay valid, tiles are converted on first render.
+// The viewport starts out as the whole screen. Only the first TILEMAP_EMPTY
+// tiles of the tileset can be indexed
+// Returns: 0 = success, -1 = tileset smaller than one tile
+int8_t tilemap_init(tilemap_t *map, const video_image_t *tileset,
+                    uint16_t tile_w, uint16_t tile_h, const uint16_t *tiles,
+                    uint16_t map_w, uint16_t map_h, color_t background);
+
+// Draw the map into a screen rectangle from now on
+void tilemap_set_viewport(tilemap_t *map, uint16_t x, uint16_t y, uint16_t w,
+                          uint16_t h);
+
+// Draw the map with the top left of the viewport at world pixel (cam_x,
+// cam_y). Pixels of the previous render are reused when the camera moved by
+// less than the viewport, so anything drawn over the map since then must be
+// restored with tilemap_redraw_rect() or tilemap_invalidate()
+// Returns: -1 = no memory for the tile cache, 0 = otherwise
+int8_t tilemap_render(tilemap_t *map, int32_t cam_x, int32_t cam_y);
+
+// Draw the tiles under a screen rectangle again, e.g. where a sprite was
+void tilemap_redraw_rect(tilemap_t *map, uint16_t x, uint16_t y, uint16_t w,
+                         uint16_t h);
+
+// Redraw the whole viewport on the next render, e.g. after the map changed
+void tilemap_invalidate(tilemap_t *map);
+
+#endif
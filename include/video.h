@@ -1,5 +1,6 @@
 #ifndef VIDEO_H
 #define VIDEO_H
+#include "font.h"
 #include <stdint.h>
 
 // Struct defines
@@ -19,6 +20,11 @@ struct color {
 #define COLOR_GREEN ((struct color){.r = 0x00, .g = 0xFF, .b = 0x00})
 #define COLOR_BLUE ((struct color){.r = 0x00, .g = 0x00, .b = 0xFF})
 
+// Compare two colors channel by channel
+static inline bool color_equal(struct color a, struct color b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
 // Framebuffer information structure
 struct framebuffer_info {
   uint64_t addr;
@@ -42,23 +48,365 @@ struct framebuffer_info {
   uint8_t blue_mask_size;
 };
 
+// Rectangle in screen coordinates
+struct video_rect {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+};
+
+// 32bpp ARGB image (0xAARRGGBB per pixel), e.g. a sprite sheet
+struct video_image {
+  const uint32_t *pixels;
+  uint16_t width;
+  uint16_t height;
+  uint16_t stride; // Pixels per row
+};
+
+// 8bpp image of palette indices, e.g. a paletted sprite sheet. Indices are
+// looked up in the palette set with video_set_palette()
+struct video_indexed_image {
+  const uint8_t *pixels;
+  uint16_t width;
+  uint16_t height;
+  uint16_t stride; // Pixels per row
+};
+
+// 2x3 affine transform in 16.16 fixed point from image to screen
+// coordinates: x' = a * x + b * y + tx, y' = c * x + d * y + ty. Image
+// coordinates run from (0, 0) at the top left corner of the image to
+// (width, height) at the bottom right, so texel (i, j) is centered on
+// (i + 0.5, j + 0.5). A sprite of size w by h rotated by angle r about its
+// center, which lands on (x, y), is a = d = cos r, b = -sin r, c = sin r,
+// tx = x - (a * w + b * h) / 2, ty = y - (c * w + d * h) / 2
+struct video_affine {
+  int32_t a, b;
+  int32_t c, d;
+  int32_t tx, ty;
+};
+
+// How transformed images are sampled
+enum video_filter {
+  VIDEO_FILTER_NEAREST,  // The texel a pixel center falls in
+  VIDEO_FILTER_BILINEAR, // Weighted 2x2 texels, clamped at the image edge
+};
+
+// Polygon vertex, may lie off screen
+struct video_point {
+  int16_t x;
+  int16_t y;
+};
+
+// Kernels that can copy rows into the framebuffer
+enum video_copy {
+  VIDEO_COPY_REP,    // rep movsd
+  VIDEO_COPY_SSE,    // 16-byte stores through the cache
+  VIDEO_COPY_STREAM, // 16-byte non-temporal stores (movntdq)
+  VIDEO_COPY_COUNT
+};
+
+// Throughput measured by video_probe(), in MB/s
+struct video_probe {
+  uint32_t tsc_mhz;
+
+  // RAM, cached stores
+  uint32_t ram_fill;
+  uint32_t ram_copy;
+
+  // Framebuffer fills with cached and non-temporal stores, reads into RAM
+  uint32_t lfb_fill;
+  uint32_t lfb_fill_stream;
+  uint32_t lfb_read;
+
+  // Rows copied from RAM to the framebuffer, by kernel. 'lfb_short_rows'
+  // copies 64-byte rows with the chosen kernel, like a small dirty rect
+  uint32_t lfb_copy[VIDEO_COPY_COUNT];
+  uint32_t lfb_short_rows;
+
+  // What was picked from the numbers above: the kernel for presents and
+  // other framebuffer copies, whether large framebuffer fills bypass the
+  // cache and whether drawing straight into the framebuffer beats a back
+  // buffer. Each row copied costs as much as 'row_overhead' extra bytes, so
+  // presents copy the whole frame instead of many narrow dirty rects when
+  // that comes out cheaper
+  enum video_copy copy;
+  bool stream_fills;
+  bool direct;
+  uint16_t row_overhead;
+};
+
 // Typedefs for structs used
 typedef struct framebuffer_info framebuffer_info_t;
 typedef struct color color_t;
+typedef struct video_rect video_rect_t;
+typedef struct video_image video_image_t;
+typedef struct video_indexed_image video_indexed_image_t;
+typedef struct video_point video_point_t;
+typedef struct video_affine video_affine_t;
+typedef struct video_probe video_probe_t;
+
+// Opaque pixel value packed in the native framebuffer layout, a palette
+// index in indexed mode
+typedef uint32_t pixel_t;
 
 // Initialize video driver
 void video_init(framebuffer_info_t *pFrame_buffer_info);
 
+// Initialize the video driver on a virtio-gpu device instead of the boot
+// framebuffer. Drawing goes to the scanout resource in guest RAM, always
+// XRGB8888 at the host's window size, and video_present() transfers the
+// damaged regions to the host, with or without a back buffer. Page flipping
+// and mode changes are not available
+// Returns: 0 = success, -1 = no usable device
+int8_t video_init_virtio_gpu(void);
+
+// Time fills and copies to RAM and to the framebuffer with the TSC, and pick
+// the copy kernel, fill stores and present strategy from the results. Until
+// then presents stream every dirty rect with non-temporal stores. Blanks
+// the top of the screen, so call it after video_init() and before drawing.
+// Takes a few frames. Whether to enable the back buffer is up to the caller
+// Returns: 0 = success, -1 = no TSC, PIT calibration failed, not drawing to
+// the framebuffer or out of memory
+int8_t video_probe(video_probe_t *result);
+
+// Restrict fills, blits and shapes to a rectangle of the screen
+void video_set_clip(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+// Remove the clip rectangle
+void video_reset_clip(void);
+
+// Pack a color into the native pixel layout. Packing once and drawing with
+// the pixel_t variants below avoids repacking on every call. In indexed mode
+// this is the nearest palette entry
+pixel_t video_pack_color(color_t color);
+
 // Clear screen
 void clear_screen(color_t color);
 
+// Fill a rectangle with a solid color, clipped to the clip rect
+void video_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                     color_t color);
+
 // Draw pixel to screen
 void video_draw_pixel(uint16_t x, uint16_t y, color_t color);
 
-// Draw text to screen
+// Draw text to screen, characters without a glyph in the font are skipped
 void video_draw_char(char c, uint16_t x, uint16_t y, color_t color);
 
-// Draw a 8x8 square
+// Pre-packed pixel variants of video_fill_rect, video_draw_pixel and
+// video_draw_char
+void video_fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                pixel_t pixel);
+void video_plot(uint16_t x, uint16_t y, pixel_t pixel);
+void video_draw_glyph(char c, uint16_t x, uint16_t y, pixel_t pixel);
+
+// Draw character and its background in one pass, no separate clear needed
+void video_draw_glyph_opaque(char c, uint16_t x, uint16_t y, pixel_t fg,
+                             pixel_t bg);
+
+// Draw 'len' characters side by side with their background, one scanline at
+// a time across the whole run. Characters that do not fit entirely on the
+// screen are dropped
+void video_draw_text(const char *str, uint16_t len, uint16_t x, uint16_t y,
+                     color_t fg, color_t bg);
+void video_draw_glyph_run(const char *str, uint16_t len, uint16_t x,
+                          uint16_t y, pixel_t fg, pixel_t bg);
+
+// Fill one character cell with a color
 void video_clear_char(uint16_t x, uint16_t y, color_t color);
 
+// Select the font for the text functions above, NULL selects the built-in
+// 8x8 font. Glyphs are scaled by an integer 'scale' (1 - 4) and rasterized
+// ahead of time, so drawing a glyph costs one masked row copy per pixel row
+// Returns: 0 = success, -1 = bad scale, cell over 255 pixels or out of memory
+int8_t video_set_font(const font_t *font, uint8_t scale);
+
+// Size of a character cell in pixels, font size times scale
+uint16_t video_font_width(void);
+uint16_t video_font_height(void);
+
+// Sprite blits, clipped to the clip rect so x and y may be negative
+// Copy the image as is
+void video_blit(const video_image_t *image, int16_t x, int16_t y);
+// Skip pixels equal to 'key' (ARGB)
+void video_blit_colorkey(const video_image_t *image, int16_t x, int16_t y,
+                         uint32_t key);
+// Blend with the per-pixel alpha of the image
+void video_blit_alpha(const video_image_t *image, int16_t x, int16_t y);
+// Paletted images, indices are copied as is in indexed mode and expanded
+// through the palette otherwise
+void video_blit_indexed(const video_indexed_image_t *image, int16_t x,
+                        int16_t y);
+// Skip pixels whose index is 'key'
+void video_blit_indexed_colorkey(const video_indexed_image_t *image,
+                                 int16_t x, int16_t y, uint8_t key);
+// Transformed blits, drawing the pixels whose centers map back into the
+// image. Each row is clipped to the image once, so the pixels in between
+// are sampled without bounds tests. Images may be at most 32767 pixels a
+// side, a transform that flattens the image to a line draws nothing
+// Copy the sampled pixels as they are
+void video_blit_affine(const video_image_t *image, const video_affine_t *m,
+                       enum video_filter filter);
+// Blend with the per-pixel alpha of the sampled pixels
+void video_blit_affine_alpha(const video_image_t *image,
+                             const video_affine_t *m, enum video_filter filter);
+
+// Shapes, drawn as clipped spans so off-screen parts cost nothing.
+// Coordinates are clamped to +-16383
+// Line between two end points, both included
+void video_draw_line(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                     color_t color);
+// One pixel wide rectangle outline
+void video_draw_rect(int16_t x, int16_t y, uint16_t w, uint16_t h,
+                     color_t color);
+// Ellipses and circles around a center point
+void video_draw_ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                        color_t color);
+void video_fill_ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                        color_t color);
+void video_draw_circle(int16_t cx, int16_t cy, uint16_t r, color_t color);
+void video_fill_circle(int16_t cx, int16_t cy, uint16_t r, color_t color);
+// Convex polygon of up to 64 points, filled by pixel center coverage
+void video_fill_polygon(const video_point_t *points, uint8_t count,
+                        color_t color);
+
+// Scroll the full-width band of rows [y, y + h) up by dy pixels with a single
+// bulk move, then fill the dy rows exposed at the bottom
+void video_scroll_up(uint16_t y, uint16_t h, uint16_t dy, pixel_t fill);
+
+// Redirect all drawing into an off-screen RAM back buffer, seeded with the
+// current screen contents. The back buffer is XRGB8888 whatever the screen
+// uses, damaged regions are converted and copied on video_present().
+// Colors packed before the switch have to be packed again
+// Returns: 0 = success, -1 = out of memory, page flipping or indexed mode is
+// active
+int8_t video_enable_back_buffer(void);
+
+// Redirect all drawing into an off-screen back buffer of 8-bit palette
+// indices, a quarter of the memory and bandwidth of XRGB8888. The current
+// screen contents are seeded as their nearest palette entries.
+// video_present() expands damaged regions through the palette, packed in
+// the screen's layout ahead of time. Colors packed before the switch have to
+// be packed again
+// Returns: 0 = success, -1 = out of memory or page flipping is active
+int8_t video_enable_indexed(void);
+
+// Change 'count' palette entries starting at 'first'. Until the first call
+// the palette is RGB 3-3-2. Pixels keep their indices, so in indexed mode
+// the next present shows the whole screen in the new colors, which makes
+// palette cycling and fades cost 256 writes and one full present
+void video_set_palette(uint8_t first, uint16_t count, const color_t *colors);
+
+// Draw at a lower internal resolution, e.g. 320x200, that video_present()
+// scales up by the largest whole factor fitting the screen (nearest
+// neighbour, at most 8x), centered between black borders. Drawing goes to
+// the back buffer, enabled if neither it nor indexed mode is. Both are set
+// up again at the new size and start out black, the clip rect is reset and
+// the console has to be initialized again. The screen size selects full
+// resolution again
+// Returns: 0 = success, -1 = larger than the screen, page flipping is active
+// or out of memory
+int8_t video_set_internal_resolution(uint16_t width, uint16_t height);
+
+// Size of the picture drawing sees, the internal resolution
+uint16_t video_width(void);
+uint16_t video_height(void);
+
+// Change resolution at runtime through the Bochs/QEMU VBE adapter. Drawing,
+// the clip rect and the back buffer follow the new mode at full resolution,
+// the console has to be initialized again by the caller
+// Returns: 0 = success, -1 = no adapter, virtio-gpu display or mode rejected
+int8_t video_set_mode(uint16_t width, uint16_t height, uint8_t bpp);
+
+// Keep 'pages' (2 or 3) screens in video memory and draw straight into a
+// hidden one. video_present() then shows it with a single register write and
+// moves drawing to the next page. Hidden pages hold older frames, so callers
+// redraw whole frames while flipping. Pages use the screen's pixel layout,
+// so colors have to be packed again after switching
+// Returns: 0 = success, -1 = no adapter, virtio-gpu display, not enough
+// video memory, indexed mode or a lower internal resolution is active
+int8_t video_enable_page_flip(uint8_t pages);
+
+// Show a single page again, drawing returns to the back buffer or framebuffer
+void video_disable_page_flip(void);
+
+// Copy the regions damaged since the last present from the back buffer to the
+// framebuffer, expanding palette indices in indexed mode, or flip to the
+// finished page. On virtio-gpu the regions are then transferred to the host.
+// When drawing goes straight to the framebuffer it only draws cursors that
+// are not on the screen
+void video_present(void);
+
+// Cursors, e.g. a text cursor or a mouse pointer, are overlays on the screen
+// that are never drawn into the picture. Drawing one saves the screen pixels
+// it covers, so moving, blinking or hiding it costs two small rect copies and
+// nothing under it is drawn again. Presents keep cursors on top of what they
+// copy. While drawing goes straight to the framebuffer, drawing that may
+// touch a cursor has to be wrapped in video_cursor_suspend() and
+// video_cursor_resume(). Cursors are positioned in drawing coordinates and
+// scaled up with the picture, and are not shown while page flipping. The
+// calls may be made from interrupt handlers
+#define VIDEO_CURSOR_MAX 64
+
+struct video_cursor {
+  // ARGB image blended over the screen, 'hot_x' and 'hot_y' is the pixel of
+  // it placed at the position
+  const video_image_t *image;
+  uint16_t hot_x, hot_y;
+
+  int16_t x, y;
+  bool visible;
+
+  // On screen at 'rect' (screen pixels) with the pixels it covers in
+  // 'saved', or taken off there to be drawn again ('parked')
+  bool shown;
+  bool parked;
+  video_rect_t rect;
+  uint8_t *saved;
+  uint32_t capacity;
+
+  // Next cursor up
+  struct video_cursor *next;
+};
+
+typedef struct video_cursor video_cursor_t;
+
+// Set the image of a cursor, added hidden at (0, 0) on top of the others
+// the first time. The image is used in place and has to stay valid
+// Returns: 0 = success, -1 = empty or larger than VIDEO_CURSOR_MAX a side
+int8_t video_cursor_set(video_cursor_t *cursor, const video_image_t *image,
+                        uint16_t hot_x, uint16_t hot_y);
+
+// Take a cursor off the screen for good
+void video_cursor_remove(video_cursor_t *cursor);
+
+// Move the hot spot of a cursor to (x, y), it may hang off the screen
+void video_cursor_move(video_cursor_t *cursor, int16_t x, int16_t y);
+
+// Show or hide a cursor, e.g. to blink it
+void video_cursor_show(video_cursor_t *cursor, bool visible);
+
+// Keep cursors off the screen while drawing straight into the framebuffer
+// under them, until the matching video_cursor_resume(). Calls nest, cursor
+// changes meanwhile show on the outermost resume
+void video_cursor_suspend(void);
+void video_cursor_resume(void);
+
+// Golden image capture of what the screen shows (the presented frame), for
+// checking renderer output in headless runs. Pixels are compared as 8-bit
+// RGB, whatever the framebuffer layout. At a lower internal resolution the
+// picture is captured before it is scaled up. Cursors are left out
+// CRC32 (as zlib computes it) of the rect's rows as R, G, B bytes, NULL
+// selects the whole screen
+uint32_t video_capture_crc(const video_rect_t *rect);
+
+// Send the CRC of a rect over COM1 as a small record
+void video_capture_send_crc(const video_rect_t *rect);
+
+// Stream a rect over COM1, run-length and row-delta compressed, see
+// tools/fbdump.py. COM1 must be set up with serial_init() first
+// Returns: 0 = success, -1 = rect off screen or video not initialized
+int8_t video_capture_dump(const video_rect_t *rect);
+
 #endif
\ No newline at end of file
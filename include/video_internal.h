@@ -0,0 +1,163 @@
+#ifndef VIDEO_INTERNAL_H
+#define VIDEO_INTERNAL_H
+
+#include "video.h"
+#include <stdint.h>
+
+/*
+ * State shared between the source files of the video module.
+ * Not meant for users of video.h.
+ */
+
+// Primitives specialized per pixel layout, so their loops never branch on
+// the format or repack colors
+typedef struct pixel_ops {
+  void (*put_pixel)(uint8_t *dest, pixel_t pixel);
+  void (*draw_glyph)(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                     pixel_t fg, pixel_t bg, bool opaque);
+} pixel_ops_t;
+
+// Pixel format descriptor of the draw target. XRGB8888 while drawing into the
+// back buffer, otherwise the framebuffer layout
+typedef struct pixel_format {
+  uint8_t bytes_pp;
+
+  // Shift to place each 8-bit channel, and bits dropped to fit the mask
+  uint8_t red_shift, red_loss;
+  uint8_t green_shift, green_loss;
+  uint8_t blue_shift, blue_loss;
+
+  // 32bpp with red, green and blue at bits 16, 8 and 0
+  bool xrgb8888;
+
+  // 8bpp palette indices, the XRGB8888 color of each. NULL otherwise
+  const uint32_t *palette;
+
+  const pixel_ops_t *ops;
+} pixel_format_t;
+
+// Where primitives draw, either the framebuffer itself or the back buffer
+typedef struct draw_target {
+  uint8_t *addr;
+  uint32_t pitch;
+  uint16_t width;
+  uint16_t height;
+
+  // Clip rectangle, [x0, x1) by [y0, y1), always inside the target
+  uint16_t clip_x0, clip_y0;
+  uint16_t clip_x1, clip_y1;
+
+  // Stores land straight on the framebuffer, large ones should bypass cache
+  bool is_framebuffer;
+
+  // Told about everything drawn into an off-screen target, may be NULL
+  void (*damage)(void *context, uint16_t x, uint16_t y, uint16_t w,
+                 uint16_t h);
+  void *damage_context;
+} draw_target_t;
+
+extern pixel_format_t video_format;
+extern draw_target_t video_target;
+
+// Copy kernel and present strategy in use, see video_probe()
+extern video_probe_t video_probe_result;
+
+// Address of pixel (x, y) in the draw target
+static inline uint8_t *target_pixel(uint32_t x, uint32_t y) {
+  return video_target.addr + (y * video_target.pitch) +
+         (x * video_format.bytes_pp);
+}
+
+// Identifies a pixel layout, e.g. to notice that pixels converted for it
+// are stale. Never 0
+static inline uint32_t pixel_format_key(const pixel_format_t *f) {
+  return f->bytes_pp | (f->red_shift << 8) | (f->green_shift << 16) |
+         ((uint32_t)f->blue_shift << 24);
+}
+
+// Read a pixel stored in layout 'f' as XRGB8888
+static inline uint32_t pixel_to_xrgb(const uint8_t *src,
+                                     const pixel_format_t *f) {
+  if (f->palette)
+    return f->palette[src[0]];
+
+  uint32_t pixel = src[0] | (src[1] << 8);
+  if (f->bytes_pp > 2)
+    pixel |= src[2] << 16;
+  if (f->bytes_pp > 3)
+    pixel |= (uint32_t)src[3] << 24;
+
+  uint32_t r = ((pixel >> f->red_shift) << f->red_loss) & 0xFF;
+  uint32_t g = ((pixel >> f->green_shift) << f->green_loss) & 0xFF;
+  uint32_t b = ((pixel >> f->blue_shift) << f->blue_loss) & 0xFF;
+  return (r << 16) | (g << 8) | b;
+}
+
+// Record a damaged region so the next present copies it to the screen. Off
+// screen, the target's damage callback gets it instead
+void video_mark_dirty(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+// Add a rect to a list of at most 'max' damaged rects, merged with a rect it
+// overlaps when the union costs no extra area. A full list grows the rect
+// that absorbs it most cheaply
+void video_damage_add(video_rect_t *rects, uint8_t *count, uint8_t max,
+                      video_rect_t rect);
+
+// Copy a row into the framebuffer with the kernel video_probe() picked,
+// non-temporal stores unless probed
+void video_copy_to_screen(uint8_t *dest, const uint8_t *src, uint32_t bytes);
+
+// Palette as pixels of the current draw format, for expanding indexed
+// images. NULL when drawing palette indices
+const pixel_t *video_palette_pixels(void);
+
+// Draw into caller owned memory in the current pixel format, e.g. to render
+// something once and copy it to the screen later. Nothing is marked dirty
+// until video_end_offscreen() restores the previous target. Calls nest up
+// to 4 deep, the clip rect starts out as the whole memory
+// Returns: 0 = success, -1 = nested too deep
+int8_t video_begin_offscreen(uint8_t *addr, uint32_t pitch, uint16_t width,
+                             uint16_t height);
+void video_end_offscreen(void);
+
+// The framebuffer as scanned out, and where the picture drawing sees lands on
+// it, scaled up 'scale' times
+typedef struct video_screen {
+  uint8_t *addr;
+  uint32_t pitch;
+  const pixel_format_t *format;
+  uint16_t width, height;
+
+  // Picture area in screen pixels
+  uint16_t view_x, view_y;
+  uint16_t view_w, view_h;
+  uint8_t scale;
+
+  // Drawing goes straight to it, and changes have to be transferred to a
+  // virtio-gpu host
+  bool direct;
+  bool virtio;
+} video_screen_t;
+
+// Returns: NULL before video_init() and while page flipping
+const video_screen_t *video_screen(void);
+
+// Take the shown cursors off a rect of the screen, and those above them that
+// overlap, until video_cursor_redraw()
+void video_cursor_park(video_rect_t rect);
+
+// Draw the visible cursors that are not on the screen, unless suspended
+void video_cursor_redraw(void);
+
+// Forget what cursors saved, the screen was cleared or changed mode
+void video_cursor_reset(void);
+
+// Memory holding what the screen shows after the last present: the back
+// buffer (XRGB8888 or indexed, before scaling), the page scanned out while
+// flipping, or the framebuffer. For back buffers the format's losses are
+// those of the screen
+// Returns: NULL before video_init()
+const uint8_t *video_visible_frame(uint32_t *pitch,
+                                   const pixel_format_t **format);
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef VIDEO_KERNELS_H
+#define VIDEO_KERNELS_H
+
+#include <stdint.h>
+
+/*
+ * SSE2 pixel kernels shared by the video module.
+ * Rows are processed as an unaligned head, a body of 16-byte aligned stores
+ * and a byte tail. Pass 'nontemporal' when the destination is the
+ * framebuffer, so the stores bypass the cache (movntdq) instead of evicting
+ * the back buffer.
+ */
+
+// One pixel repeated over 64 bytes. The body of a row repeats every 48 bytes
+// (lcm of 16 and 3), so this covers 15, 16, 24 and 32 bpp alike
+typedef struct fill_pattern {
+  uint8_t bytes[64];
+} __attribute__((aligned(16))) fill_pattern_t;
+
+// Builds a fill pattern from the low 'bytes_pp' bytes of a packed pixel
+void kernel_make_pattern(fill_pattern_t *pat, uint32_t pixel,
+                         uint8_t bytes_pp);
+
+// Fills 'bytes' bytes at dest, dest must sit on a pixel boundary
+void kernel_fill_row(uint8_t *dest, uint32_t bytes, const fill_pattern_t *pat,
+                     bool nontemporal);
+
+// Copies 'bytes' bytes of a row (Non-overlapping only)
+void kernel_copy_row(uint8_t *dest, const uint8_t *src, uint32_t bytes,
+                     bool nontemporal);
+
+// Same with rep movsd, no SSE2
+void kernel_copy_row_rep(uint8_t *dest, const uint8_t *src, uint32_t bytes);
+
+// Builds the glyph expansion table, which maps every 8-bit glyph row to eight
+// 32-bit lanes that are all ones where the bit is set (bit 0 = leftmost)
+void kernel_init_glyph_masks(void);
+
+// Expanded lane masks for one glyph row
+const uint32_t *kernel_glyph_mask(uint8_t row);
+
+// Draws an 8 pixel wide glyph of 'height' rows with mask blends. Opaque
+// glyphs write 'bg' where a bit is clear, otherwise those pixels are kept
+void kernel_glyph32(uint8_t *dest, uint32_t pitch, const uint8_t *rows,
+                    uint8_t height, uint32_t fg, uint32_t bg, bool opaque);
+void kernel_glyph16(uint8_t *dest, uint32_t pitch, const uint8_t *rows,
+                    uint8_t height, uint16_t fg, uint16_t bg, bool opaque);
+
+// Draws one row of a pre-rasterized glyph, 'mask' holds 0xFF for every byte
+// of a set pixel. A NULL 'bg' keeps the pixels under clear bytes
+void kernel_glyph_row(uint8_t *dest, const uint8_t *mask, uint32_t bytes,
+                      const fill_pattern_t *fg, const fill_pattern_t *bg);
+
+// Draws the same row of 'count' glyphs side by side, the row starting at
+// 'offset' in each glyph's masks. A NULL entry draws a blank glyph
+void kernel_glyph_run(uint8_t *dest, const uint8_t *const *masks,
+                      uint16_t count, uint32_t glyph_bytes, uint32_t offset,
+                      const fill_pattern_t *fg, const fill_pattern_t *bg);
+
+// Draws the same row of 'count' pre-blended glyphs side by side, copied
+// from 'offset' in each glyph. A NULL entry is filled with 'bg'
+void kernel_copy_run(uint8_t *dest, const uint8_t *const *sources,
+                     uint16_t count, uint32_t glyph_bytes, uint32_t offset,
+                     const fill_pattern_t *bg);
+
+// Sprite kernels over 'count' 32bpp pixels, 4 pixels per SSE2 step.
+// Source pixels are ARGB, destinations XRGB
+// Copies every source pixel except those equal to 'key'
+void kernel_blit_colorkey32(uint8_t *dest, const uint32_t *src, uint32_t count,
+                            uint32_t key);
+// Blends by source alpha: dest = (src * a + dest * (255 - a)) / 255
+void kernel_blit_alpha32(uint8_t *dest, const uint32_t *src, uint32_t count);
+
+// Copies 8bpp palette indices except those equal to 'key', 16 per step
+void kernel_blit_colorkey8(uint8_t *dest, const uint8_t *src, uint32_t count,
+                           uint8_t key);
+
+// Blends 'fg' (XRGB) over 'count' 32bpp pixels by 8-bit coverage, the
+// anti-aliased glyph path: dest = (fg * c + dest * (255 - c)) / 255
+void kernel_blend_coverage32(uint8_t *dest, const uint8_t *coverage,
+                             uint32_t count, uint32_t fg);
+
+// One block of a triangle for kernel_raster_block. Every value is for the
+// top left pixel of the block and '_dx' / '_dy' step it by one pixel
+typedef struct raster_block {
+  // Edge functions, the pixel is inside where all are >= 0
+  int32_t edge[3], edge_dx[3], edge_dy[3];
+
+  // Depth with 12 fraction bits, biased by -32768 like the depth buffer
+  int32_t z, z_dx, z_dy;
+
+  // Gouraud blue, green and red in 8.16 fixed point
+  int32_t shade[3], shade_dx[3], shade_dy[3];
+
+  // Texel position in 16.16 fixed point
+  int32_t u, u_dx, u_dy;
+  int32_t v, v_dx, v_dy;
+
+  // Power of two texture, ARGB with the alpha ignored
+  const uint32_t *texels;
+  uint32_t texture_stride;
+  uint32_t u_mask, v_mask;
+
+  // Flat color, or the one textures are modulated with
+  uint32_t pixel;
+
+  uint8_t flags;
+} raster_block_t;
+
+#define KERNEL_RASTER_COVERED 0x01  // Inside all edges, skip the edge tests
+#define KERNEL_RASTER_DEPTH 0x02    // Depth test and write
+#define KERNEL_RASTER_GOURAUD 0x04  // Interpolated shade instead of 'pixel'
+#define KERNEL_RASTER_TEXTURED 0x08 // Textured, modulated by the shade
+#define KERNEL_RASTER_MODULATE 0x10 // Shade is not plain white
+
+// Shades a 'w' by 'h' block (at most 8x8) of 32bpp pixels and their signed
+// 16-bit depths, 4 pixels per SSE2 step
+void kernel_raster_block(uint8_t *dest, uint32_t pitch, int16_t *depth,
+                         uint32_t depth_pitch, uint8_t w, uint8_t h,
+                         const raster_block_t *block);
+
+// One span of a transformed image for the affine kernels. The texel
+// position is 16.16 fixed point and steps by ('du', 'dv') per pixel. Callers
+// clip spans so that no texel read falls outside the image
+typedef struct affine_span {
+  const uint32_t *texels;
+  uint32_t stride;
+  int32_t u, v;
+  int32_t du, dv;
+} affine_span_t;
+
+// Samples 'count' ARGB pixels into 'dest'. Nearest takes the texel (u, v)
+// falls in, 4 pixels per SSE2 step with the texel offsets computed in
+// vector lanes. Bilinear weighs the 2x2 texels from (u, v) to (u + 1, v + 1)
+// by the position's 8 fraction bits, so u and v must stay one texel short of
+// the right and bottom edge
+void kernel_affine_nearest(uint32_t *dest, const affine_span_t *span,
+                           uint32_t count);
+void kernel_affine_bilinear(uint32_t *dest, const affine_span_t *span,
+                            uint32_t count);
+
+// Scalar bilinear filter of one pixel, rounded like the SSE2 path. For
+// edge pixels whose 2x2 texels are clamped to the image
+uint32_t kernel_bilinear_pixel(uint32_t t00, uint32_t t01, uint32_t t10,
+                               uint32_t t11, uint32_t fu, uint32_t fv);
+
+// Present-time conversion of 'count' XRGB8888 pixels to packed layouts
+// RGB565, or RGB555 when 'rgb555' is set, 8 pixels per SSE2 step
+void kernel_pack_row16(uint8_t *dest, const uint32_t *src, uint32_t count,
+                       bool rgb555);
+// 24bpp with blue in the lowest byte, 4 pixels into 12 bytes per step
+void kernel_pack_row24(uint8_t *dest, const uint32_t *src, uint32_t count);
+
+// Expands 'count' 8bpp palette indices through 'lut', pixels packed in the
+// destination layout. 32bpp and 16bpp rows are assembled 4 or 8 pixels at a
+// time and written with aligned stores, 24bpp one pixel at a time
+void kernel_expand_row8(uint8_t *dest, const uint8_t *src, uint32_t count,
+                        const uint32_t *lut, uint8_t bytes_pp,
+                        bool nontemporal);
+
+// Repeats each of 'count' pixels 'factor' times, nearest neighbour upscaling
+// of a row. 32bpp and 16bpp rows with factors 2 - 4 take 4 or 8 source
+// pixels per SSE2 step, others go one pixel at a time
+void kernel_scale_row(uint8_t *dest, const uint8_t *src, uint32_t count,
+                      uint8_t bytes_pp, uint8_t factor);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef VIRTIO_GPU_H
+#define VIRTIO_GPU_H
+
+#include <stdint.h>
+
+/*
+ * virtio-gpu 2D display, as implemented by QEMU's virtio-gpu-pci (virtio 1.0,
+ * modern PCI transport only). The scanout shows a host resource whose pixels
+ * live in guest RAM: TRANSFER_TO_HOST_2D copies a rect of that RAM to the
+ * host, RESOURCE_FLUSH puts it on screen. Commands go through the control
+ * virtqueue and are polled, no interrupts are used.
+ */
+
+// PCI IDs, the device ID is 0x1040 plus the virtio device type (16)
+#define VIRTIO_GPU_PCI_VENDOR 0x1AF4
+#define VIRTIO_GPU_PCI_DEVICE 0x1050
+
+// Find the device, set up the control queue and show a resource the size of
+// the first scanout. Its guest RAM holds XRGB8888 pixels, 'width' * 4 bytes
+// per row, and starts out black
+// Returns: 0 = success, -1 = no device, unsupported transport, BAR above
+// 4 GiB, out of memory or a command failed
+int8_t virtio_gpu_init(void);
+
+// Pixels of the scanout resource, NULL before virtio_gpu_init()
+uint8_t *virtio_gpu_framebuffer(void);
+
+// Size of the scanout resource in pixels
+uint16_t virtio_gpu_width(void);
+uint16_t virtio_gpu_height(void);
+
+// Queue a copy of a rect of guest RAM to the host resource. Commands are
+// sent in batches, a full queue is sent and waited for
+// Returns: 0 = success, -1 = the device failed a command or timed out
+int8_t virtio_gpu_transfer(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+// Queue a flush of a rect of the resource to the screen, send everything
+// queued and wait until the host has processed it, so guest RAM may be
+// changed again
+// Returns: 0 = success, -1 = the device failed a command or timed out
+int8_t virtio_gpu_flush(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+#endif
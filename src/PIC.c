@@ -92,7 +92,7 @@ void PIC_ClearMask(uint8_t irq) {
   else {
     irq -= 8;
     pic2_mask &= ~(1 << irq);
-    outByte(PIC1_DATA, pic2_mask);
+    outByte(PIC2_DATA, pic2_mask);
   }
 }
 
@@ -0,0 +1,68 @@
+#include "bga.h"
+#include "io.h"
+#include "pci.h"
+
+// PCI IDs of the Bochs/QEMU standard VGA
+#define BGA_PCI_VENDOR 0x1234
+#define BGA_PCI_DEVICE 0x1111
+
+// Adapters older than 0xB0C5 cannot report their memory, assume the 4 MiB
+// they shipped with
+#define BGA_LEGACY_VRAM (4 * 1024 * 1024)
+
+static void bga_write(uint16_t index, uint16_t value) {
+  outWord(BGA_INDEX_PORT, index);
+  outWord(BGA_DATA_PORT, value);
+}
+
+static uint16_t bga_read(uint16_t index) {
+  outWord(BGA_INDEX_PORT, index);
+  return inWord(BGA_DATA_PORT);
+}
+
+uint16_t bga_detect(void) {
+  uint16_t id = bga_read(BGA_INDEX_ID);
+  if (id < BGA_ID_MIN || id > BGA_ID_MAX)
+    return 0;
+  return id;
+}
+
+uint32_t bga_framebuffer_addr(void) {
+  pci_device_t dev;
+  if (pci_find_device(BGA_PCI_VENDOR, BGA_PCI_DEVICE, &dev) != 0)
+    return 0;
+  return pci_bar_address(dev, 0);
+}
+
+uint32_t bga_vram_size(void) {
+  if (bga_detect() < BGA_ID_MAX)
+    return BGA_LEGACY_VRAM;
+  return (uint32_t)bga_read(BGA_INDEX_VIDEO_MEMORY_64K) << 16;
+}
+
+int8_t bga_set_mode(uint16_t width, uint16_t height, uint8_t bpp) {
+  // Registers only take effect while the display is disabled
+  bga_write(BGA_INDEX_ENABLE, BGA_DISABLED);
+  bga_write(BGA_INDEX_XRES, width);
+  bga_write(BGA_INDEX_YRES, height);
+  bga_write(BGA_INDEX_BPP, bpp);
+  bga_write(BGA_INDEX_ENABLE, BGA_ENABLED | BGA_LFB_ENABLED);
+
+  // Writing the virtual width makes the adapter recompute the virtual height
+  bga_write(BGA_INDEX_VIRT_WIDTH, width);
+  bga_write(BGA_INDEX_X_OFFSET, 0);
+  bga_write(BGA_INDEX_Y_OFFSET, 0);
+
+  // Unsupported modes are silently adjusted, so read them back
+  if (bga_read(BGA_INDEX_XRES) != width || bga_read(BGA_INDEX_YRES) != height ||
+      bga_read(BGA_INDEX_BPP) != bpp)
+    return -1;
+
+  return 0;
+}
+
+uint16_t bga_virtual_width(void) { return bga_read(BGA_INDEX_VIRT_WIDTH); }
+
+uint16_t bga_virtual_height(void) { return bga_read(BGA_INDEX_VIRT_HEIGHT); }
+
+void bga_set_y_offset(uint16_t y) { bga_write(BGA_INDEX_Y_OFFSET, y); }
@@ -0,0 +1,320 @@
+#include "compositor.h"
+#include "memory.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define SCREEN_DAMAGE_RECTS 16
+
+// Surfaces from the bottom up
+static compositor_surface_t *surfaces = 0;
+
+// Screen areas to composite again because a surface moved, was restacked,
+// hidden or removed
+static video_rect_t screen_damage[SCREEN_DAMAGE_RECTS];
+static uint8_t screen_damage_count = 0;
+
+static color_t background = COLOR_BLACK;
+
+// Surfaces being drawn, and whether a composite waits for them to finish
+static uint8_t drawing = 0;
+static bool present_pending = false;
+
+// Helper function declaration
+static bool listed(const compositor_surface_t *surface);
+static void insert(compositor_surface_t *surface);
+static void detach(compositor_surface_t *surface);
+static void surface_damaged(void *context, uint16_t x, uint16_t y, uint16_t w,
+                            uint16_t h);
+static void damage_screen(video_rect_t rect);
+static bool intersect(video_rect_t a, video_rect_t b, video_rect_t *out);
+static void expose(const compositor_surface_t *surface,
+                   const compositor_surface_t *above, video_rect_t rect);
+static void copy_rect(const compositor_surface_t *surface, video_rect_t rect);
+
+int8_t compositor_add(compositor_surface_t *surface, uint16_t x, uint16_t y,
+                      uint16_t w, uint16_t h, int16_t z) {
+  if (w == 0 || h == 0)
+    return -1;
+
+  bool added = listed(surface);
+  if (!added)
+    *surface = (compositor_surface_t){0};
+
+  // Rows are 16-byte aligned for the copy kernels
+  uint32_t pitch = ((uint32_t)w * video_format.bytes_pp + 15) & ~15U;
+  uint32_t size = pitch * h;
+  if (size > surface->capacity) {
+    uint8_t *pixels = mem_alloc(size, 16);
+    if (pixels == 0)
+      return -1;
+    surface->pixels = pixels;
+    surface->capacity = size;
+  }
+
+  if (added) {
+    if (surface->visible)
+      damage_screen(surface->rect);
+    detach(surface);
+  }
+
+  surface->rect = (video_rect_t){.x = x, .y = y, .w = w, .h = h};
+  surface->z = z;
+  surface->visible = true;
+  surface->pitch = pitch;
+  surface->format = pixel_format_key(&video_format);
+  surface->damage_count = 0;
+  insert(surface);
+
+  // Clearing damages the whole surface
+  if (compositor_begin(surface) == 0) {
+    clear_screen(COLOR_BLACK);
+    compositor_end();
+  }
+  return 0;
+}
+
+void compositor_remove(compositor_surface_t *surface) {
+  if (!listed(surface))
+    return;
+
+  if (surface->visible)
+    damage_screen(surface->rect);
+  detach(surface);
+}
+
+// Draw into the store, the damage callback collects what was drawn
+int8_t compositor_begin(compositor_surface_t *surface) {
+  if (surface->format != pixel_format_key(&video_format))
+    return -1;
+  if (video_begin_offscreen(surface->pixels, surface->pitch, surface->rect.w,
+                            surface->rect.h) != 0)
+    return -1;
+
+  video_target.damage = surface_damaged;
+  video_target.damage_context = surface;
+  drawing++;
+  return 0;
+}
+
+void compositor_end(void) {
+  if (drawing == 0)
+    return;
+
+  video_end_offscreen();
+  if (--drawing == 0 && present_pending)
+    compositor_present();
+}
+
+void compositor_damage(compositor_surface_t *surface, uint16_t x, uint16_t y,
+                       uint16_t w, uint16_t h) {
+  surface_damaged(surface, x, y, w, h);
+}
+
+// The old place shows what was under the surface, the new one all of it
+void compositor_move(compositor_surface_t *surface, uint16_t x, uint16_t y) {
+  if (surface->visible)
+    damage_screen(surface->rect);
+
+  surface->rect.x = x;
+  surface->rect.y = y;
+  surface_damaged(surface, 0, 0, surface->rect.w, surface->rect.h);
+}
+
+void compositor_set_z(compositor_surface_t *surface, int16_t z) {
+  if (!listed(surface)) {
+    surface->z = z;
+    return;
+  }
+
+  detach(surface);
+  surface->z = z;
+  insert(surface);
+  if (surface->visible)
+    damage_screen(surface->rect);
+}
+
+void compositor_show(compositor_surface_t *surface, bool visible) {
+  if (surface->visible == visible)
+    return;
+
+  surface->visible = visible;
+  damage_screen(surface->rect);
+}
+
+void compositor_set_background(color_t color) {
+  background = color;
+
+  // Whatever of it shows has to be filled again
+  damage_screen((video_rect_t){0, 0, video_width(), video_height()});
+}
+
+// Screen damage first goes to the surfaces under it, so restacking and
+// moving share the path of drawing. Then every surface copies its damage
+// minus the surfaces above it, bottom up, and the background fills what no
+// surface covers
+void compositor_present(void) {
+  if (drawing) {
+    present_pending = true;
+    return;
+  }
+  present_pending = false;
+
+  // Composite onto the whole target, whatever clip rect the caller set
+  uint16_t clip_x0 = video_target.clip_x0, clip_y0 = video_target.clip_y0;
+  uint16_t clip_x1 = video_target.clip_x1, clip_y1 = video_target.clip_y1;
+  video_reset_clip();
+  video_cursor_suspend();
+
+  for (uint8_t i = 0; i < screen_damage_count; ++i) {
+    video_rect_t rect = screen_damage[i];
+    for (compositor_surface_t *s = surfaces; s != 0; s = s->next) {
+      video_rect_t part;
+      if (s->visible && intersect(rect, s->rect, &part))
+        surface_damaged(s, part.x - s->rect.x, part.y - s->rect.y, part.w,
+                        part.h);
+    }
+    expose(0, surfaces, rect);
+  }
+  screen_damage_count = 0;
+
+  video_rect_t screen = {0, 0, video_target.width, video_target.height};
+  uint32_t format = pixel_format_key(&video_format);
+
+  for (compositor_surface_t *s = surfaces; s != 0; s = s->next) {
+    // A store left from another pixel format would show garbage
+    if (s->visible && s->format == format) {
+      for (uint8_t i = 0; i < s->damage_count; ++i) {
+        video_rect_t rect = s->damage[i];
+        rect.x += s->rect.x;
+        rect.y += s->rect.y;
+        if (intersect(rect, screen, &rect))
+          expose(s, s->next, rect);
+      }
+    }
+    s->damage_count = 0;
+  }
+
+  video_cursor_resume();
+  video_target.clip_x0 = clip_x0;
+  video_target.clip_y0 = clip_y0;
+  video_target.clip_x1 = clip_x1;
+  video_target.clip_y1 = clip_y1;
+  video_present();
+}
+
+// Helper functions
+static bool listed(const compositor_surface_t *surface) {
+  for (const compositor_surface_t *s = surfaces; s != 0; s = s->next) {
+    if (s == surface)
+      return true;
+  }
+  return false;
+}
+
+// Insert above every surface with a lower or equal z
+static void insert(compositor_surface_t *surface) {
+  compositor_surface_t **at = &surfaces;
+  while (*at != 0 && (*at)->z <= surface->z)
+    at = &(*at)->next;
+
+  surface->next = *at;
+  *at = surface;
+}
+
+static void detach(compositor_surface_t *surface) {
+  compositor_surface_t **at = &surfaces;
+  while (*at != 0 && *at != surface)
+    at = &(*at)->next;
+
+  if (*at != 0)
+    *at = surface->next;
+  surface->next = 0;
+}
+
+// Damage in surface coordinates, clipped to the surface
+static void surface_damaged(void *context, uint16_t x, uint16_t y, uint16_t w,
+                            uint16_t h) {
+  compositor_surface_t *surface = context;
+  video_rect_t all = {0, 0, surface->rect.w, surface->rect.h};
+  video_rect_t rect;
+  if (intersect((video_rect_t){x, y, w, h}, all, &rect))
+    video_damage_add(surface->damage, &surface->damage_count,
+                     COMPOSITOR_DAMAGE_RECTS, rect);
+}
+
+static void damage_screen(video_rect_t rect) {
+  if (rect.w != 0 && rect.h != 0)
+    video_damage_add(screen_damage, &screen_damage_count, SCREEN_DAMAGE_RECTS,
+                     rect);
+}
+
+// Returns: false when the rects do not overlap
+static bool intersect(video_rect_t a, video_rect_t b, video_rect_t *out) {
+  uint32_t x0 = a.x > b.x ? a.x : b.x;
+  uint32_t y0 = a.y > b.y ? a.y : b.y;
+  uint32_t ax1 = (uint32_t)a.x + a.w, bx1 = (uint32_t)b.x + b.w;
+  uint32_t ay1 = (uint32_t)a.y + a.h, by1 = (uint32_t)b.y + b.h;
+  uint32_t x1 = ax1 < bx1 ? ax1 : bx1;
+  uint32_t y1 = ay1 < by1 ? ay1 : by1;
+  if (x0 >= x1 || y0 >= y1)
+    return false;
+
+  *out = (video_rect_t){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+  return true;
+}
+
+// Draw the parts of a screen rect of 'surface' (NULL for the background)
+// that none of the surfaces from 'above' up covers. Each covering surface
+// splits the rect into bands above and below it and pieces left and right
+// of it, which are checked against the surfaces further up
+static void expose(const compositor_surface_t *surface,
+                   const compositor_surface_t *above, video_rect_t rect) {
+  for (; above != 0; above = above->next) {
+    video_rect_t o;
+    if (!above->visible || !intersect(rect, above->rect, &o))
+      continue;
+
+    uint16_t rect_x1 = rect.x + rect.w, rect_y1 = rect.y + rect.h;
+    uint16_t o_x1 = o.x + o.w, o_y1 = o.y + o.h;
+    if (o.y > rect.y)
+      expose(surface, above->next,
+             (video_rect_t){rect.x, rect.y, rect.w, o.y - rect.y});
+    if (o_y1 < rect_y1)
+      expose(surface, above->next,
+             (video_rect_t){rect.x, o_y1, rect.w, rect_y1 - o_y1});
+    if (o.x > rect.x)
+      expose(surface, above->next,
+             (video_rect_t){rect.x, o.y, o.x - rect.x, o.h});
+    if (o_x1 < rect_x1)
+      expose(surface, above->next,
+             (video_rect_t){o_x1, o.y, rect_x1 - o_x1, o.h});
+    return;
+  }
+
+  if (surface == 0)
+    video_fill_rect(rect.x, rect.y, rect.w, rect.h, background);
+  else
+    copy_rect(surface, rect);
+}
+
+// Copy a screen rect of the surface from its store
+static void copy_rect(const compositor_surface_t *surface, video_rect_t rect) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+  const uint8_t *src = surface->pixels +
+                       (rect.y - surface->rect.y) * surface->pitch +
+                       (rect.x - surface->rect.x) * bytes_pp;
+  uint8_t *dest = target_pixel(rect.x, rect.y);
+  uint32_t bytes = (uint32_t)rect.w * bytes_pp;
+
+  for (uint16_t row = 0; row < rect.h; ++row) {
+    if (video_target.is_framebuffer)
+      video_copy_to_screen(dest, src, bytes);
+    else
+      kernel_copy_row(dest, src, bytes, false);
+    src += surface->pitch;
+    dest += video_target.pitch;
+  }
+
+  video_mark_dirty(rect.x, rect.y, rect.w, rect.h);
+}
@@ -0,0 +1,123 @@
+#include "font.h"
+#include "font8x8_basic.h"
+
+// PSF1 header
+#define PSF1_MAGIC0 0x36
+#define PSF1_MAGIC1 0x04
+#define PSF1_MODE512 0x01
+#define PSF1_HEADER_SIZE 4
+
+// PSF2 header
+#define PSF2_MAGIC 0x864AB572
+
+// Anti-aliased font header
+#define COVERAGE_VERSION 1
+
+struct coverage_header {
+  char magic[4];
+  uint8_t version;
+  uint8_t reserved;
+  uint16_t width;
+  uint16_t height;
+  uint16_t glyph_count;
+};
+
+struct psf2_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t flags;
+  uint32_t length;
+  uint32_t glyph_bytes;
+  uint32_t height;
+  uint32_t width;
+};
+
+void font_builtin(font_t *font) {
+  *font = (font_t){
+      .width = FONT_WIDTH,
+      .height = FONT_HEIGHT,
+      .glyph_count = 128,
+      .row_bytes = 1,
+      .glyph_bytes = FONT_HEIGHT,
+      .glyphs = &font8x8_basic[0][0],
+      .lsb_left = true,
+  };
+}
+
+int8_t font_load_psf(font_t *font, const void *data, uint32_t size) {
+  const uint8_t *bytes = data;
+
+  if (size >= PSF1_HEADER_SIZE && bytes[0] == PSF1_MAGIC0 &&
+      bytes[1] == PSF1_MAGIC1) {
+    // PSF1: 8 pixels wide, 256 or 512 glyphs of 'height' bytes
+    uint16_t count = (bytes[2] & PSF1_MODE512) ? 512 : 256;
+    uint8_t height = bytes[3];
+    if (height == 0 || PSF1_HEADER_SIZE + (uint32_t)count * height > size)
+      return -1;
+
+    *font = (font_t){
+        .width = 8,
+        .height = height,
+        .glyph_count = count,
+        .row_bytes = 1,
+        .glyph_bytes = height,
+        .glyphs = bytes + PSF1_HEADER_SIZE,
+        .lsb_left = false,
+    };
+    return 0;
+  }
+
+  if (size < sizeof(struct psf2_header))
+    return -1;
+
+  const struct psf2_header *h = data;
+  if (h->magic != PSF2_MAGIC || h->width == 0 || h->height == 0 ||
+      h->width > 64 || h->height > 128 || h->length == 0)
+    return -1;
+
+  uint16_t row_bytes = (h->width + 7) / 8;
+  if (h->glyph_bytes < (uint32_t)row_bytes * h->height ||
+      h->header_size > size ||
+      (size - h->header_size) / h->glyph_bytes < h->length)
+    return -1;
+
+  *font = (font_t){
+      .width = h->width,
+      .height = h->height,
+      .glyph_count = h->length > 512 ? 512 : h->length,
+      .row_bytes = row_bytes,
+      .glyph_bytes = h->glyph_bytes,
+      .glyphs = bytes + h->header_size,
+      .lsb_left = false,
+  };
+  return 0;
+}
+
+int8_t font_load_coverage(font_t *font, const void *data, uint32_t size) {
+  if (size < sizeof(struct coverage_header))
+    return -1;
+
+  const struct coverage_header *h = data;
+  if (h->magic[0] != 'C' || h->magic[1] != 'C' || h->magic[2] != 'A' ||
+      h->magic[3] != 'F' || h->version != COVERAGE_VERSION ||
+      h->width == 0 || h->height == 0 || h->width > 64 || h->height > 128 ||
+      h->glyph_count == 0)
+    return -1;
+
+  uint16_t count = h->glyph_count > 512 ? 512 : h->glyph_count;
+  uint32_t glyph_bytes = (uint32_t)h->width * h->height;
+  if ((size - sizeof(*h)) / glyph_bytes < count)
+    return -1;
+
+  *font = (font_t){
+      .width = h->width,
+      .height = h->height,
+      .glyph_count = count,
+      .row_bytes = h->width,
+      .glyph_bytes = glyph_bytes,
+      .glyphs = (const uint8_t *)data + sizeof(*h),
+      .coverage = true,
+  };
+  return 0;
+}
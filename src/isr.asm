@@ -1,4 +1,5 @@
 global isr_keyboard
+global isr_mouse
 global isr_ud
 global isr_gp
 global isr_df
@@ -9,10 +10,30 @@ extern k_panic
 ; Keyboard isr handler function
 extern keyboard_handler
 
+; Mouse isr handler function
+extern mouse_handler
+
 ; Keyboard ISR wrapper
+; The handler echoes through the video kernels, which use SSE, so the
+; interrupted code's FPU/SSE state is saved around it (fxsave needs a
+; 16-byte aligned 512 byte area)
 isr_keyboard:
     pusha
+    mov ebp, esp
+    sub esp, 512
+    and esp, 0xFFFFFFF0
+    fxsave [esp]
     call keyboard_handler
+    fxrstor [esp]
+    mov esp, ebp
+    popa
+    iretd
+
+; Mouse ISR wrapper
+; The handler only collects packets and draws nothing
+isr_mouse:
+    pusha
+    call mouse_handler
     popa
     iretd
 
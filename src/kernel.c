@@ -1,27 +1,89 @@
 #include <stdint.h>
 
 #include "PIC.h"
+#include "bga.h"
 #include "common_intr.h"
+#include "font.h"
 #include "idt.h"
 #include "io.h"
 #include "keyboard.h"
+#include "memory.h"
+#include "mouse.h"
 #include "multiboot.h"
+#include "paging.h"
 #include "print.h"
+#include "serial.h"
 #include "video.h"
 
 // MACROS
 /* Check if the bit BIT in FLAGS is set. */
 #define CHECK_FLAG(flags, bit) ((flags) & (1 << (bit)))
 
+// Text gets scaled up until fewer console rows than this would fit
+#define CONSOLE_MIN_ROWS 50
+
+// Mouse pointer image, 'X' is the outline and '.' the fill
+#define POINTER_WIDTH 12
+#define POINTER_HEIGHT 19
+
 // Define the kernel's end
 extern uint8_t __kernel_end[];
 
 // Start of 4K aligned free memory
 extern uint8_t __free_mem_aligned[];
 
+// House drawn under the welcome message
+extern const char *houseData;
+
 // Initialize the console and print a welcome message
 void print_info(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr);
 
+// First free address past the kernel image and the boot modules
+static uintptr_t free_memory_start(multiboot_info_t *mbi);
+
+// Use the first font module as console font, scaled to the screen height
+static void load_font(multiboot_info_t *mbi, uint32_t screen_height);
+
+// Value of "name=value" on the kernel command line, NULL without it
+static const char *boot_option(multiboot_info_t *mbi, const char *name);
+
+// Factor from "scale=N" on the kernel command line, 1 without it
+static uint8_t boot_scale(multiboot_info_t *mbi);
+
+// True with "display=virtio" on the kernel command line
+static bool boot_virtio_gpu(multiboot_info_t *mbi);
+
+// Answer capture requests arriving on COM1
+static void serial_command(uint8_t command);
+
+// Report the framebuffer throughput measured at boot
+static void print_probe(void);
+
+// Set up the text cursor over the console cursor cell and the mouse pointer
+static void cursors_init(void);
+
+// Move the mouse pointer by the motion collected since the last call
+static void pointer_update(void);
+
+// Framebuffer throughput measured at boot
+static video_probe_t probe;
+static bool probed = false;
+
+// Overlays on the screen, drawn over the console without redrawing it
+static video_cursor_t text_cursor;
+static video_cursor_t pointer;
+static video_image_t text_cursor_image;
+static video_image_t pointer_image;
+static uint32_t pointer_pixels[POINTER_WIDTH * POINTER_HEIGHT];
+
+static const char *pointer_art[POINTER_HEIGHT] = {
+    "X           ", "XX          ", "X.X         ", "X..X        ",
+    "X...X       ", "X....X      ", "X.....X     ", "X......X    ",
+    "X.......X   ", "X........X  ", "X.........X ", "X......XXXXX",
+    "X...X..X    ", "X..XX..X    ", "X.X  X..X   ", "XX   X..X   ",
+    "X     X..X  ", "      X..X  ", "       XX   ",
+};
+
 // Kernel main function impl
 extern void kernel_main(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
   // Cast Physical address to multiboot info struct
@@ -40,8 +102,32 @@ extern void kernel_main(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
   idt_set_gate(GP_INT_VECTOR, (uint32_t)isr_gp);
   idt_set_gate(DF_INT_VECTOR, (uint32_t)isr_df);
 
-  // Initialize video unit
-  if (CHECK_FLAG(mbi->flags, 12)) {
+  // Identity map memory so ranges can get their own caching (PAT)
+  paging_init();
+
+  // Hand the upper memory past the kernel image to the boot allocator
+  if (CHECK_FLAG(mbi->flags, 0)) {
+    mem_init(free_memory_start(mbi),
+             0x100000 + (uintptr_t)mbi->mem_upper * 1024);
+  }
+
+  // Headless runs read captures of the screen from COM1
+  bool serial = serial_init(115200) == 0;
+
+  // Initialize video unit, on virtio-gpu instead of the boot framebuffer
+  // when asked to, so both display paths can run the same workload
+  MEM_SOURCE framebuffer_caching = MEM_SOURCE_NONE;
+  bool virtio = boot_virtio_gpu(mbi) && video_init_virtio_gpu() == 0;
+  bool video = virtio;
+  if (!video && CHECK_FLAG(mbi->flags, 12)) {
+    // Write-combine framebuffer stores instead of one bus cycle per store.
+    // On the VBE adapter that covers all pages used for page flipping
+    uint32_t framebuffer_size =
+        bga_detect() ? bga_vram_size()
+                     : mbi->framebuffer_pitch * mbi->framebuffer_height;
+    framebuffer_caching =
+        paging_set_write_combining(mbi->framebuffer_addr, framebuffer_size);
+
     // Populate framebuffer information struct needed by video library
     framebuffer_info_t framebuffer_info = {
         .addr = mbi->framebuffer_addr,
@@ -63,10 +149,33 @@ extern void kernel_main(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
 
     // Initialize the video library
     video_init(&framebuffer_info);
+    video = true;
+  }
+
+  if (video) {
+    // Time the framebuffer against RAM to pick how drawing reaches it
+    probed = video_probe(&probe) == 0;
+
+    // Draw in RAM and present damaged regions, unless drawing straight into
+    // the framebuffer measured faster. Falls back to direct framebuffer
+    // writes when there is no memory for it
+    if (!probed || !probe.direct)
+      video_enable_back_buffer();
+
+    // Optionally draw fewer, larger pixels that are scaled up on present
+    uint8_t scale = boot_scale(mbi);
+    if (scale > 1)
+      video_set_internal_resolution(video_width() / scale,
+                                    video_height() / scale);
+
+    // Pick the font before the console sizes its grid from it
+    load_font(mbi, video_height());
 
     // Initialize printer
-    print_init(framebuffer_info.width, framebuffer_info.height, 8, 8,
-               COLOR(0xFF, 0xFF, 0xFF));
+    print_init(video_width(), video_height(), video_font_width(),
+               video_font_height(), COLOR(0xFF, 0xFF, 0xFF));
+
+    cursors_init();
   }
 
   // Initialize PIC
@@ -75,6 +184,13 @@ extern void kernel_main(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
   // Initialize keyboard
   keyboard_init();
 
+  // The pointer starts in the middle of the screen
+  bool mouse = mouse_init() == 0;
+  if (mouse && video) {
+    video_cursor_move(&pointer, video_width() / 2, video_height() / 2);
+    video_cursor_show(&pointer, true);
+  }
+
   // Enable interrupts
   asm volatile("sti");
 
@@ -90,41 +206,78 @@ extern void kernel_main(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
             mbi->mem_upper);
   }
 
+  // Memory type read back from the page directory, PAT and MTRRs
+  if (virtio) {
+    println("Display: virtio-gpu, {u2}x{u2} resource in guest RAM",
+            video_width(), video_height());
+    print_probe();
+  } else if (CHECK_FLAG(mbi->flags, 12)) {
+    const char *sources[] = {"firmware", "PAT", "MTRR"};
+    println("Framebuffer memory type: {s} (set by {s})",
+            paging_memory_type_name(
+                paging_memory_type(mbi->framebuffer_addr)),
+            sources[framebuffer_caching]);
+    print_probe();
+  }
+
+  if (serial)
+    println("COM1: send 'D' to dump the screen, 'C' for its CRC32");
+  if (mouse)
+    println("PS/2 mouse on IRQ 12");
+
   uint16_t cursor_pos_x, cursor_pos_y;
-  color_t blinkColor = COLOR_WHITE;
+  bool blink = true;
   while (1) {
+    // Show anything still batched in the console
+    print_flush();
+
+    // Blinking puts back the pixels under the cursor, the text is not drawn
     getCursorPosition(&cursor_pos_x, &cursor_pos_y);
-    putcAt(' ', cursor_pos_x, cursor_pos_y, blinkColor);
+    video_cursor_move(&text_cursor, cursor_pos_x * video_font_width(),
+                      cursor_pos_y * video_font_height());
+    video_cursor_show(&text_cursor, blink);
+    blink = !blink;
 
-    for (uint32_t iw = 0; iw < UINT32_MAX / 64; ++iw)
+    for (uint32_t iw = 0; iw < UINT32_MAX / 64; ++iw) {
+      if (serial_received())
+        serial_command(serial_read());
+      if (mouse)
+        pointer_update();
       io_wait();
-
-    blinkColor.r = ~blinkColor.r;
-    blinkColor.g = ~blinkColor.g;
-    blinkColor.b = ~blinkColor.b;
+    }
   }
 }
 
 // Function definations
 void print_info(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
 
-  const char *OSName = "Candy Cane OS";
+  const char welcome[] = "Welcome to ";
+  const char OSName[] = "Candy Cane OS";
 
-  // Print welcome message
-  puts("Welcome to ");
-  for (int i = 0;; i++) {
-    if (OSName[i] == '\0') {
-      putc('\n');
-      break;
-    }
+  // The banner is laid out and rendered once, then copied to the screen
+  uint16_t columns, rows;
+  text_bitmap_measure(houseData, 0, &columns, &rows);
+  uint16_t title = sizeof(welcome) - 1 + sizeof(OSName) - 1;
+  if (title > columns)
+    columns = title;
 
-    if (i % 2 == 0) {
-      setColorMode(COLOR(255, 180, 180));
-      putc(OSName[i]); // Red
-    } else {
-      setColorMode(COLOR(180, 255, 180));
-      putc(OSName[i]); // Light Green
+  text_bitmap_t banner;
+  if (text_bitmap_create(&banner, columns, rows + 1, 0, COLOR_BLACK) == 0) {
+    text_bitmap_puts(&banner, welcome, COLOR_WHITE);
+    for (int i = 0; OSName[i] != '\0'; i++) {
+      char c[2] = {OSName[i], '\0'};
+      if (i % 2 == 0)
+        text_bitmap_puts(&banner, c, COLOR(255, 180, 180)); // Red
+      else
+        text_bitmap_puts(&banner, c, COLOR(180, 255, 180)); // Light Green
     }
+    text_bitmap_puts(&banner, "\n", COLOR_WHITE);
+    text_bitmap_puts(&banner, houseData, COLOR(255, 220, 180));
+    print_bitmap(&banner);
+  } else {
+    // Print welcome message
+    puts(welcome);
+    println("{s}", OSName);
   }
   setColorMode(COLOR(255, 255, 255));
 
@@ -138,4 +291,171 @@ void print_info(uint32_t mboot_magic, uint32_t *mboot_info_ptr_addr) {
   println("Kernel memory used: {u4h}", ((uint32_t)__kernel_end) - 0x100000);
 
   println("Free memory start address: {u4h}", (uint32_t)__free_mem_aligned);
-}
\ No newline at end of file
+}
+
+static uintptr_t free_memory_start(multiboot_info_t *mbi) {
+  uintptr_t start = (uintptr_t)__free_mem_aligned;
+  if (!CHECK_FLAG(mbi->flags, 3))
+    return start;
+
+  // GRUB loads modules right after the kernel, the allocator must not hand
+  // them out before they are used
+  multiboot_module_t *mods = (multiboot_module_t *)mbi->mods_addr;
+  uintptr_t list_end = mbi->mods_addr + mbi->mods_count * sizeof(*mods);
+  if (list_end > start)
+    start = list_end;
+
+  for (uint32_t i = 0; i < mbi->mods_count; ++i) {
+    if (mods[i].mod_end > start)
+      start = mods[i].mod_end;
+  }
+
+  return (start + 0xFFF) & ~(uintptr_t)0xFFF;
+}
+
+static void load_font(multiboot_info_t *mbi, uint32_t screen_height) {
+  font_t font;
+  font_builtin(&font);
+
+  if (CHECK_FLAG(mbi->flags, 3)) {
+    multiboot_module_t *mods = (multiboot_module_t *)mbi->mods_addr;
+    for (uint32_t i = 0; i < mbi->mods_count; ++i) {
+      const void *data = (const void *)mods[i].mod_start;
+      uint32_t size = mods[i].mod_end - mods[i].mod_start;
+      if (font_load_psf(&font, data, size) == 0 ||
+          font_load_coverage(&font, data, size) == 0)
+        break;
+    }
+  }
+
+  // 8x8 text is unreadable on 1080p-class modes
+  uint8_t scale = 1;
+  while (scale < 3 && screen_height / (font.height * (scale + 1U)) >=
+                          CONSOLE_MIN_ROWS)
+    scale++;
+
+  // Without memory for the atlas the built-in font still works unscaled
+  if (video_set_font(&font, scale) != 0)
+    video_set_font(0, 1);
+}
+
+static const char *boot_option(multiboot_info_t *mbi, const char *name) {
+  if (!CHECK_FLAG(mbi->flags, 2))
+    return 0;
+
+  // Options follow the kernel path, separated by spaces
+  const char *line = (const char *)mbi->cmdline;
+  for (const char *c = line; *c != '\0'; ++c) {
+    if (c != line && c[-1] != ' ')
+      continue;
+
+    uint32_t i = 0;
+    while (name[i] != '\0' && c[i] == name[i])
+      i++;
+    if (name[i] == '\0' && c[i] == '=')
+      return c + i + 1;
+  }
+  return 0;
+}
+
+static uint8_t boot_scale(multiboot_info_t *mbi) {
+  const char *value = boot_option(mbi, "scale");
+  if (value == 0 || value[0] < '1' || value[0] > '8')
+    return 1;
+  return value[0] - '0';
+}
+
+static bool boot_virtio_gpu(multiboot_info_t *mbi) {
+  const char *value = boot_option(mbi, "display");
+  const char *want = "virtio";
+  if (value == 0)
+    return false;
+
+  while (*want != '\0' && *value == *want) {
+    value++;
+    want++;
+  }
+  return *want == '\0' && (*value == '\0' || *value == ' ');
+}
+
+static void print_probe(void) {
+  if (!probed) {
+    println("Framebuffer probe failed, using the default strategy");
+    return;
+  }
+
+  const char *kernels[] = {"rep movsd", "SSE", "non-temporal SSE"};
+  println("Framebuffer probe at {u4} MHz, MB/s:", probe.tsc_mhz);
+  println("  RAM fill {u4}, copy {u4}", probe.ram_fill, probe.ram_copy);
+  println("  LFB fill {u4}, streamed {u4}, read {u4}", probe.lfb_fill,
+          probe.lfb_fill_stream, probe.lfb_read);
+  println("  LFB copy rep {u4}, SSE {u4}, non-temporal {u4}, 64-byte rows {u4}",
+          probe.lfb_copy[VIDEO_COPY_REP], probe.lfb_copy[VIDEO_COPY_SSE],
+          probe.lfb_copy[VIDEO_COPY_STREAM], probe.lfb_short_rows);
+
+  if (probe.direct)
+    println("  Strategy: direct framebuffer writes, {s} copies",
+            kernels[probe.copy]);
+  else
+    println("  Strategy: back buffer, {s} copies, dirty rects or full "
+            "frames at {u2} bytes per row",
+            kernels[probe.copy], probe.row_overhead);
+}
+
+static void cursors_init(void) {
+  // A translucent block keeps the character under it readable
+  uint16_t w = video_font_width(), h = video_font_height();
+  if (w > VIDEO_CURSOR_MAX)
+    w = VIDEO_CURSOR_MAX;
+  if (h > VIDEO_CURSOR_MAX)
+    h = VIDEO_CURSOR_MAX;
+  uint32_t *block = mem_alloc(w * h * sizeof(uint32_t), sizeof(uint32_t));
+  if (block != 0) {
+    for (uint32_t i = 0; i < (uint32_t)w * h; ++i)
+      block[i] = 0xA0FFFFFF;
+    text_cursor_image = (video_image_t){block, w, h, w};
+    video_cursor_set(&text_cursor, &text_cursor_image, 0, 0);
+  }
+
+  for (uint16_t y = 0; y < POINTER_HEIGHT; ++y) {
+    for (uint16_t x = 0; x < POINTER_WIDTH; ++x) {
+      char c = pointer_art[y][x];
+      pointer_pixels[y * POINTER_WIDTH + x] =
+          c == 'X' ? 0xFF000000 : (c == '.' ? 0xFFFFFFFF : 0);
+    }
+  }
+  pointer_image = (video_image_t){pointer_pixels, POINTER_WIDTH,
+                                  POINTER_HEIGHT, POINTER_WIDTH};
+  video_cursor_set(&pointer, &pointer_image, 0, 0);
+}
+
+static void pointer_update(void) {
+  mouse_state_t state;
+  if (!mouse_read(&state))
+    return;
+
+  // The hot spot stays on the picture
+  int32_t x = pointer.x + state.dx;
+  int32_t y = pointer.y + state.dy;
+  int32_t max_x = video_width() - 1, max_y = video_height() - 1;
+  x = x < 0 ? 0 : (x > max_x ? max_x : x);
+  y = y < 0 ? 0 : (y > max_y ? max_y : y);
+  video_cursor_move(&pointer, x, y);
+}
+
+static void serial_command(uint8_t command) {
+  // Captures read the presented frame
+  print_flush();
+  video_present();
+
+  switch (command) {
+  case 'D':
+    video_capture_dump(0);
+    break;
+  case 'C':
+    video_capture_send_crc(0);
+    break;
+  default:
+    break;
+  }
+}
@@ -55,4 +55,5 @@ void k_panic(void) {
   print_regs("C3", cr3);
 
   println("-----------------------------------");
+  print_flush();
 }
\ No newline at end of file
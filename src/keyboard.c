@@ -3,11 +3,9 @@
 #include "common_intr.h"
 #include "idt.h"
 #include "io.h"
+#include "print.h"
 
 #define KBD_DBG_PRINT
-#ifdef KBD_DBG_PRINT
-#include "print.h"
-#endif
 
 // Current key pressed state
 volatile uint8_t key_state[256] = {0};
@@ -219,6 +217,7 @@ static const uint8_t scancode_to_key_high[256] = {
 
 // Private helper functions
 static void handle_asciiKey(uint8_t scancode);
+static void handle_pageKey(uint8_t up);
 
 // Public API
 void keyboard_init() {
@@ -248,7 +247,9 @@ void keyboard_handler() {
   if (kbd_init == 0)
     return; // Keyboard not initialized
 
-  if (((inByte(KBD_STATUS_PORT) & 0x01) == 0) || (kbd_handler_enabled == 0))
+  // Bytes from the mouse are left for its own interrupt handler
+  uint8_t status = inByte(KBD_STATUS_PORT);
+  if (((status & 0x01) == 0) || (status & 0x20) || (kbd_handler_enabled == 0))
     goto send_eoi; // No data to read
 
   // Read the scan code from keyboard data port
@@ -290,6 +291,15 @@ void keyboard_handler() {
   case 0xE0:
     specialKeys |= KBD_EXTENDED_CODE;
     break;
+  case 0x49: // Page Up (extended), otherwise Keypad 9
+  case 0x51: // Page Down (extended), otherwise Keypad 3
+    if (specialKeys & KBD_EXTENDED_CODE) {
+      specialKeys &= ~KBD_EXTENDED_CODE;
+      handle_pageKey(scan_code == 0x49);
+    } else {
+      handle_asciiKey(scan_code);
+    }
+    break;
 
   // Release events
   case 0xAA:
@@ -356,6 +366,17 @@ static void handle_asciiKey(uint8_t scancode) {
   }
 
   setColorMode(COLOR_WHITE);
+  print_flush();
   // setCursorPosition(oldX, oldY);
 #endif
-}
\ No newline at end of file
+}
+
+// Page through the console scrollback
+static void handle_pageKey(uint8_t up) {
+  uint16_t cols = 0, rows = 0;
+  getConsoleSize(&cols, &rows);
+
+  // Keep one line of the previous page for context
+  int16_t lines = rows > 1 ? rows - 1 : 1;
+  print_scroll_view(up ? lines : -lines);
+}
@@ -1,6 +1,10 @@
 #include "memory.h"
 #include <stdint.h>
 
+// Boot-time bump allocator state
+static uintptr_t heap_next = 0;
+static uintptr_t heap_end = 0;
+
 void *memset(void *dest, int c, size_t n) {
   if (n == 0)
     return dest;
@@ -73,4 +77,23 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     }
   }
   return 0;
-}
\ No newline at end of file
+}
+
+void mem_init(uintptr_t start, uintptr_t end) {
+  heap_next = start;
+  heap_end = end;
+}
+
+void *mem_alloc(size_t n, size_t align) {
+  if (align == 0)
+    align = 1;
+
+  uintptr_t addr = (heap_next + align - 1) & ~(uintptr_t)(align - 1);
+
+  // Reject requests that wrap around or run past the end of the range
+  if (addr < heap_next || addr + n < addr || addr + n > heap_end)
+    return NULL;
+
+  heap_next = addr + n;
+  return (void *)addr;
+}
@@ -0,0 +1,177 @@
+#include "mouse.h"
+#include "PIC.h"
+#include "common_intr.h"
+#include "cpu.h"
+#include "idt.h"
+#include "io.h"
+#include "keyboard.h"
+
+// Macros
+#define MOUSE_IRQ 12
+#define CASCADE_IRQ 2
+
+// Keyboard controller commands, status and configuration bits
+#define CTRL_READ_CONFIG 0x20
+#define CTRL_WRITE_CONFIG 0x60
+#define CTRL_ENABLE_AUX 0xA8
+#define CTRL_WRITE_AUX 0xD4
+
+#define STATUS_OUTPUT_FULL 0x01
+#define STATUS_INPUT_FULL 0x02
+#define STATUS_AUX_DATA 0x20
+
+#define CONFIG_AUX_IRQ 0x02
+#define CONFIG_AUX_CLOCK_OFF 0x20
+
+// Mouse commands and the reply to each
+#define MOUSE_SET_DEFAULTS 0xF6
+#define MOUSE_ENABLE_REPORTING 0xF4
+#define MOUSE_ACK 0xFA
+
+// First byte of a packet
+#define PACKET_BUTTONS 0x07
+#define PACKET_SYNC 0x08
+#define PACKET_X_SIGN 0x10
+#define PACKET_Y_SIGN 0x20
+#define PACKET_OVERFLOW 0xC0
+
+// Status polls before giving up on the controller
+#define WAIT_SPINS 100000
+
+// Collected by the interrupt handler until mouse_read()
+static volatile int16_t motion_x = 0;
+static volatile int16_t motion_y = 0;
+static volatile uint8_t buttons = 0;
+static volatile bool changed = false;
+
+// Packet being received
+static uint8_t packet[3];
+static uint8_t packet_length = 0;
+
+// Helper function declaration
+static bool wait_write(void);
+static bool wait_read(void);
+static bool controller_command(uint8_t command);
+static bool mouse_command(uint8_t command);
+static int16_t add_motion(int16_t total, int16_t delta);
+
+int8_t mouse_init(void) {
+  // Drop whatever the controller still holds, replies are read below
+  for (uint32_t i = 0;
+       i < WAIT_SPINS && (inByte(KBD_STATUS_PORT) & STATUS_OUTPUT_FULL); ++i)
+    inByte(KBD_DATA_PORT);
+
+  // Enable the auxiliary port with its clock running and its interrupt on
+  if (!controller_command(CTRL_ENABLE_AUX) ||
+      !controller_command(CTRL_READ_CONFIG) || !wait_read())
+    return -1;
+  uint8_t config = inByte(KBD_DATA_PORT);
+  config = (config | CONFIG_AUX_IRQ) & ~CONFIG_AUX_CLOCK_OFF;
+  if (!controller_command(CTRL_WRITE_CONFIG) || !wait_write())
+    return -1;
+  outByte(KBD_DATA_PORT, config);
+
+  // 3 byte packets at the default rate and resolution
+  if (!mouse_command(MOUSE_SET_DEFAULTS) ||
+      !mouse_command(MOUSE_ENABLE_REPORTING))
+    return -1;
+
+  packet_length = 0;
+  idt_set_gate(MOUSE_INT_VECTOR, (uint32_t)isr_mouse);
+
+  // IRQ 12 reaches the CPU through the slave PIC on IRQ 2
+  PIC_ClearMask(CASCADE_IRQ);
+  PIC_ClearMask(MOUSE_IRQ);
+  return 0;
+}
+
+// The handler must not add motion between reading and clearing it
+bool mouse_read(mouse_state_t *state) {
+  uint32_t eflags = irq_save();
+  state->dx = motion_x;
+  state->dy = motion_y;
+  state->buttons = buttons;
+  bool moved = changed;
+  motion_x = 0;
+  motion_y = 0;
+  changed = false;
+  irq_restore(eflags);
+  return moved;
+}
+
+// C ISR handler for mouse interrupts
+void mouse_handler(void) {
+  uint8_t status = inByte(KBD_STATUS_PORT);
+  if ((status & (STATUS_OUTPUT_FULL | STATUS_AUX_DATA)) !=
+      (STATUS_OUTPUT_FULL | STATUS_AUX_DATA))
+    goto send_eoi; // No mouse data to read
+
+  uint8_t byte = inByte(KBD_DATA_PORT);
+
+  // The first byte always has bit 3 set, anything else is skipped to get
+  // back in step after a lost byte
+  if (packet_length == 0 && !(byte & PACKET_SYNC))
+    goto send_eoi;
+  packet[packet_length++] = byte;
+  if (packet_length < 3)
+    goto send_eoi;
+  packet_length = 0;
+
+  // Motion is 9-bit two's complement with the sign bits in the first byte,
+  // and y points up. Packets that overflowed carry no usable motion
+  if (!(packet[0] & PACKET_OVERFLOW)) {
+    int16_t dx = packet[1] - ((packet[0] & PACKET_X_SIGN) ? 256 : 0);
+    int16_t dy = packet[2] - ((packet[0] & PACKET_Y_SIGN) ? 256 : 0);
+    motion_x = add_motion(motion_x, dx);
+    motion_y = add_motion(motion_y, -dy);
+  }
+  buttons = packet[0] & PACKET_BUTTONS;
+  changed = true;
+
+send_eoi:
+  PIC_SendEOI(MOUSE_IRQ);
+}
+
+// Helper functions
+// Returns: false when the controller never became ready
+static bool wait_write(void) {
+  for (uint32_t i = 0; i < WAIT_SPINS; ++i) {
+    if (!(inByte(KBD_STATUS_PORT) & STATUS_INPUT_FULL))
+      return true;
+  }
+  return false;
+}
+
+static bool wait_read(void) {
+  for (uint32_t i = 0; i < WAIT_SPINS; ++i) {
+    if (inByte(KBD_STATUS_PORT) & STATUS_OUTPUT_FULL)
+      return true;
+  }
+  return false;
+}
+
+static bool controller_command(uint8_t command) {
+  if (!wait_write())
+    return false;
+  outByte(KBD_STATUS_PORT, command);
+  return true;
+}
+
+// Commands for the mouse are passed on by the controller, the mouse
+// acknowledges each
+static bool mouse_command(uint8_t command) {
+  if (!controller_command(CTRL_WRITE_AUX) || !wait_write())
+    return false;
+  outByte(KBD_DATA_PORT, command);
+  return wait_read() && inByte(KBD_DATA_PORT) == MOUSE_ACK;
+}
+
+// Sum of motion, saturated instead of wrapping around
+static int16_t add_motion(int16_t total, int16_t delta) {
+  int32_t sum = (int32_t)total + delta;
+  if (sum > INT16_MAX)
+    return INT16_MAX;
+  if (sum < INT16_MIN)
+    return INT16_MIN;
+  return sum;
+}
@@ -0,0 +1,253 @@
+#include "paging.h"
+#include "cpu.h"
+
+// MSRs
+#define MSR_MTRRCAP 0xFE
+#define MSR_PAT 0x277
+#define MSR_MTRR_DEF_TYPE 0x2FF
+#define MSR_MTRR_PHYSBASE(n) (0x200 + 2 * (n))
+#define MSR_MTRR_PHYSMASK(n) (0x201 + 2 * (n))
+
+// MTRR register bits
+#define MTRRCAP_VCNT 0xFF
+#define MTRRCAP_WC (1 << 10)
+#define MTRR_DEF_ENABLE (1 << 11)
+#define MTRR_MASK_VALID (1 << 11)
+#define MTRR_TYPE 0xFF
+
+// Page directory entry bits (4 MiB pages)
+#define PDE_PRESENT 0x001
+#define PDE_WRITE 0x002
+#define PDE_PWT 0x008
+#define PDE_PCD 0x010
+#define PDE_LARGE 0x080
+#define PDE_PAT 0x1000
+#define LARGE_PAGE_SHIFT 22
+
+// Power-on PAT layout (WB, WT, UC-, UC twice), and the one loaded here with
+// entry 1, selected by PWT alone, turned from WT into WC
+#define PAT_DEFAULT 0x0007040600070406ULL
+#define PAT_LAYOUT 0x0007040600070106ULL
+
+#define ADDR_LIMIT 0x100000000ULL
+
+// Identity mapped page directory, 4 MiB per entry
+static uint32_t page_directory[1024] __attribute__((aligned(4096)));
+
+// CPU state
+static uint32_t cpu_features = 0;
+static uint8_t phys_addr_bits = 36;
+static bool paging_enabled = false;
+static bool pat_enabled = false;
+
+// Helper function declaration
+static uint32_t cache_disable(void);
+static void cache_enable(uint32_t cr0);
+static bool mtrr_set_write_combining(uint64_t addr, uint32_t size);
+static MEM_TYPE mtrr_memory_type(uint64_t addr);
+
+// Interrupts must still be disabled, caches are switched off briefly
+void paging_init(void) {
+  uint32_t eax, ebx, ecx, edx;
+
+  cpuid(1, &eax, &ebx, &ecx, &cpu_features);
+
+  cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+  if (eax >= 0x80000008) {
+    cpuid(0x80000008, &eax, &ebx, &ecx, &edx);
+    phys_addr_bits = eax & 0xFF;
+  }
+
+  // Without large pages the identity map would need 4 MiB of page tables
+  if (!(cpu_features & CPUID_FEAT_PSE))
+    return;
+
+  for (uint32_t i = 0; i < 1024; ++i) {
+    page_directory[i] =
+        (i << LARGE_PAGE_SHIFT) | PDE_LARGE | PDE_WRITE | PDE_PRESENT;
+  }
+
+  write_cr4(read_cr4() | CR4_PSE);
+  write_cr3((uint32_t)page_directory);
+  write_cr0(read_cr0() | CR0_PG);
+  paging_enabled = true;
+
+  // Nothing uses PWT yet, so entry 1 can be repurposed safely
+  if ((cpu_features & CPUID_FEAT_PAT) && (cpu_features & CPUID_FEAT_MSR)) {
+    uint32_t cr0 = cache_disable();
+    wrmsr(MSR_PAT, PAT_LAYOUT);
+    cache_enable(cr0);
+    pat_enabled = true;
+  }
+}
+
+/*
+ * With PAT the range's page directory entries select PAT entry 1 (WC).
+ * Pages are 4 MiB, so the rest of the last page gets WC as well; firmware
+ * places framebuffers on a boundary at least that large in practice.
+ * The MTRR fallback needs a naturally aligned power of two range and a free
+ * variable MTRR.
+ */
+MEM_SOURCE paging_set_write_combining(uint64_t addr, uint32_t size) {
+  if (size == 0 || addr + size > ADDR_LIMIT)
+    return MEM_SOURCE_NONE;
+
+  if (pat_enabled) {
+    uint32_t first = (uint32_t)(addr >> LARGE_PAGE_SHIFT);
+    uint32_t last = (uint32_t)((addr + size - 1) >> LARGE_PAGE_SHIFT);
+    for (uint32_t i = first; i <= last; ++i) {
+      page_directory[i] = (page_directory[i] & ~(PDE_PCD | PDE_PAT)) | PDE_PWT;
+    }
+
+    // Reload CR3 to drop the stale translations
+    write_cr3(read_cr3());
+    return MEM_SOURCE_PAT;
+  }
+
+  if (mtrr_set_write_combining(addr, size))
+    return MEM_SOURCE_MTRR;
+
+  return MEM_SOURCE_NONE;
+}
+
+// Combine the page level type with the MTRR type (Intel SDM vol 3, 11.5.2.2)
+MEM_TYPE paging_memory_type(uint64_t addr) {
+  MEM_TYPE mtrr = mtrr_memory_type(addr);
+  if (!paging_enabled || addr >= ADDR_LIMIT)
+    return mtrr;
+
+  uint32_t pde = page_directory[addr >> LARGE_PAGE_SHIFT];
+  uint8_t index = ((pde & PDE_PWT) ? 1 : 0) | ((pde & PDE_PCD) ? 2 : 0) |
+                  ((pde & PDE_PAT) ? 4 : 0);
+
+  // Without PAT the CPU behaves as if the power-on layout was loaded
+  uint64_t layout = pat_enabled ? rdmsr(MSR_PAT) : PAT_DEFAULT;
+  MEM_TYPE page = (MEM_TYPE)((layout >> (index * 8)) & 0x07);
+
+  switch (page) {
+  case MEM_TYPE_UC:
+  case MEM_TYPE_WC:
+    return page;
+  case MEM_TYPE_UC_MINUS:
+    return mtrr == MEM_TYPE_WC ? MEM_TYPE_WC : MEM_TYPE_UC;
+  case MEM_TYPE_WT:
+    if (mtrr == MEM_TYPE_UC || mtrr == MEM_TYPE_WC)
+      return MEM_TYPE_UC;
+    return mtrr == MEM_TYPE_WP ? MEM_TYPE_WP : MEM_TYPE_WT;
+  case MEM_TYPE_WP:
+    if (mtrr == MEM_TYPE_UC || mtrr == MEM_TYPE_WC)
+      return MEM_TYPE_UC;
+    return MEM_TYPE_WP;
+  default:
+    return mtrr;
+  }
+}
+
+const char *paging_memory_type_name(MEM_TYPE type) {
+  switch (type) {
+  case MEM_TYPE_UC:
+    return "UC";
+  case MEM_TYPE_WC:
+    return "WC";
+  case MEM_TYPE_WT:
+    return "WT";
+  case MEM_TYPE_WP:
+    return "WP";
+  case MEM_TYPE_WB:
+    return "WB";
+  case MEM_TYPE_UC_MINUS:
+    return "UC-";
+  default:
+    return "??";
+  }
+}
+
+// Helper functions
+// Caches off and flushed, as required while memory types change
+static uint32_t cache_disable(void) {
+  uint32_t cr0 = read_cr0();
+  write_cr0((cr0 | CR0_CD) & ~CR0_NW);
+  wbinvd();
+  return cr0;
+}
+
+// Flush again, drop the TLB and restore the previous cache mode
+static void cache_enable(uint32_t cr0) {
+  wbinvd();
+  if (paging_enabled)
+    write_cr3(read_cr3());
+  write_cr0(cr0);
+}
+
+static bool mtrr_set_write_combining(uint64_t addr, uint32_t size) {
+  if (!(cpu_features & CPUID_FEAT_MTRR) || !(cpu_features & CPUID_FEAT_MSR))
+    return false;
+
+  uint64_t cap = rdmsr(MSR_MTRRCAP);
+  if (!(cap & MTRRCAP_WC))
+    return false;
+
+  // Round up to a power of two, the base has to be aligned to it
+  uint64_t length = 0x1000;
+  while (length < size)
+    length <<= 1;
+  if (addr & (length - 1))
+    return false;
+
+  uint64_t addr_mask = ((1ULL << phys_addr_bits) - 1) & ~0xFFFULL;
+  for (uint8_t n = 0; n < (cap & MTRRCAP_VCNT); ++n) {
+    if (rdmsr(MSR_MTRR_PHYSMASK(n)) & MTRR_MASK_VALID)
+      continue;
+
+    uint32_t cr0 = cache_disable();
+    uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type & ~MTRR_DEF_ENABLE);
+
+    wrmsr(MSR_MTRR_PHYSBASE(n), addr | MEM_TYPE_WC);
+    wrmsr(MSR_MTRR_PHYSMASK(n), (~(length - 1) & addr_mask) | MTRR_MASK_VALID);
+
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+    cache_enable(cr0);
+    return true;
+  }
+
+  return false;
+}
+
+// Type the MTRRs give an address. Fixed range MTRRs are not consulted, they
+// only cover the first MiB
+static MEM_TYPE mtrr_memory_type(uint64_t addr) {
+  // No MTRRs, only the page attributes apply
+  if (!(cpu_features & CPUID_FEAT_MTRR) || !(cpu_features & CPUID_FEAT_MSR))
+    return MEM_TYPE_WB;
+
+  uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+  if (!(def_type & MTRR_DEF_ENABLE))
+    return MEM_TYPE_UC;
+
+  uint64_t addr_mask = ((1ULL << phys_addr_bits) - 1) & ~0xFFFULL;
+  uint8_t count = rdmsr(MSR_MTRRCAP) & MTRRCAP_VCNT;
+  bool matched = false;
+  MEM_TYPE type = (MEM_TYPE)(def_type & MTRR_TYPE);
+
+  for (uint8_t n = 0; n < count; ++n) {
+    uint64_t mask = rdmsr(MSR_MTRR_PHYSMASK(n));
+    if (!(mask & MTRR_MASK_VALID))
+      continue;
+
+    uint64_t base = rdmsr(MSR_MTRR_PHYSBASE(n));
+    mask &= addr_mask;
+    if ((addr & mask) != (base & addr_mask & mask))
+      continue;
+
+    // Overlaps: UC wins, WT wins over WB
+    MEM_TYPE range = (MEM_TYPE)(base & MTRR_TYPE);
+    if (range == MEM_TYPE_UC)
+      return MEM_TYPE_UC;
+    if (!matched || (range == MEM_TYPE_WT && type == MEM_TYPE_WB))
+      type = range;
+    matched = true;
+  }
+
+  return type;
+}
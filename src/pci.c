@@ -0,0 +1,86 @@
+#include "pci.h"
+#include "io.h"
+
+// Address register layout
+#define PCI_ENABLE 0x80000000
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_MULTI_FUNCTION 0x80
+#define PCI_BAR_MEM_MASK 0xFFFFFFF0
+#define PCI_BAR_TYPE_MASK 0x6
+#define PCI_BAR_TYPE_64 0x4
+
+// More capabilities than fit in configuration space means a broken list
+#define PCI_MAX_CAPABILITIES 48
+
+static uint32_t config_address(pci_device_t dev, uint8_t offset) {
+  return PCI_ENABLE | ((uint32_t)dev.bus << 16) | ((uint32_t)dev.slot << 11) |
+         ((uint32_t)dev.func << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read32(pci_device_t dev, uint8_t offset) {
+  outLong(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+  return inLong(PCI_CONFIG_DATA);
+}
+
+void pci_write32(pci_device_t dev, uint8_t offset, uint32_t value) {
+  outLong(PCI_CONFIG_ADDRESS, config_address(dev, offset));
+  outLong(PCI_CONFIG_DATA, value);
+}
+
+// Brute force scan, only done once per driver at boot
+int8_t pci_find_device(uint16_t vendor, uint16_t device, pci_device_t *out) {
+  for (uint16_t bus = 0; bus < 256; ++bus) {
+    for (uint8_t slot = 0; slot < 32; ++slot) {
+      pci_device_t dev = {.bus = (uint8_t)bus, .slot = slot, .func = 0};
+      uint32_t id = pci_read32(dev, PCI_VENDOR_ID);
+      if ((id & 0xFFFF) == 0xFFFF)
+        continue;
+
+      // Only multi-function devices have more than function 0
+      uint8_t header = pci_read32(dev, PCI_HEADER_TYPE & 0xFC) >> 16;
+      uint8_t funcs = (header & PCI_MULTI_FUNCTION) ? 8 : 1;
+
+      for (dev.func = 0; dev.func < funcs; ++dev.func) {
+        id = pci_read32(dev, PCI_VENDOR_ID);
+        if ((id & 0xFFFF) == vendor && (id >> 16) == device) {
+          *out = dev;
+          return 0;
+        }
+      }
+    }
+  }
+
+  return -1;
+}
+
+uint32_t pci_bar_address(pci_device_t dev, uint8_t bar) {
+  uint32_t low = pci_read32(dev, PCI_BAR0 + bar * 4);
+  if ((low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 &&
+      pci_read32(dev, PCI_BAR0 + (bar + 1) * 4) != 0)
+    return 0;
+  return low & PCI_BAR_MEM_MASK;
+}
+
+void pci_enable_memory(pci_device_t dev) {
+  // Status bits are cleared by writing ones, so only the command is written
+  uint32_t command = pci_read32(dev, PCI_COMMAND) & 0xFFFF;
+  pci_write32(dev, PCI_COMMAND,
+              command | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER);
+}
+
+uint8_t pci_find_capability(pci_device_t dev, uint8_t id, uint8_t after) {
+  if (!(pci_read32(dev, PCI_COMMAND) & PCI_STATUS_CAPABILITIES))
+    return 0;
+
+  // Each entry starts with its ID and the offset of the next one
+  uint8_t offset = after ? (uint8_t)(pci_read32(dev, after) >> 8)
+                         : (uint8_t)pci_read32(dev, PCI_CAPABILITIES);
+  for (uint8_t i = 0; i < PCI_MAX_CAPABILITIES && offset != 0; ++i) {
+    uint32_t header = pci_read32(dev, offset & 0xFC);
+    if ((header & 0xFF) == id)
+      return offset & 0xFC;
+    offset = header >> 8;
+  }
+
+  return 0;
+}
@@ -1,4 +1,12 @@
 #include "print.h"
+#include "compositor.h"
+#include "memory.h"
+
+// Lines kept above the screen for scrolling back
+#define SCROLLBACK_LINES 512
+
+// Longest text run handed to the video library at once
+#define RUN_LENGTH 128
 
 // Screen size (in char)
 static uint16_t max_char_x = 0;
@@ -17,7 +25,56 @@ static uint8_t font_size_y = 0;
 static color_t default_color_mode = COLOR(0xFF, 0xFF, 0xFF);
 static color_t background_color = COLOR_BLACK;
 
+// Same colors packed for the framebuffer, refreshed whenever they change
+static pixel_t text_pixel = 0;
+static pixel_t background_pixel = 0;
+
+// One character cell of the screen or the scrollback
+struct console_cell {
+  char c;
+  color_t fg;
+  color_t bg;
+};
+
+// Ring of lines, the screen is its newest 'max_char_y' lines and the
+// scrollback the ones before. Scrolling only moves 'screen_top'
+static struct console_cell *cells = 0;
+static uint16_t ring_lines = 0;
+static uint16_t screen_top = 0;
+static uint16_t history_lines = 0;
+
+// Lines the viewport is scrolled back into the history, 0 = live screen
+static uint16_t view_offset = 0;
+
+// Per screen row, the cells [x0, x1) changed since the last flush
+static uint16_t *dirty_x0 = 0;
+static uint16_t *dirty_x1 = 0;
+static bool redraw_all = false;
+
+// Buffers from an earlier print_init(), reused when large enough
+static struct console_cell *cell_store = 0;
+static uint32_t cell_capacity = 0;
+static uint16_t dirty_capacity = 0;
+
+// Lines scrolled since the last flush, moved on screen with one bulk scroll
+static uint16_t scroll_pending = 0;
+
+// Surface the console is drawn into, NULL draws onto the screen
+static compositor_surface_t *surface = 0;
+
 // Helper function declaration
+static struct console_cell *console_line(uint16_t row);
+static void console_clear_line(struct console_cell *line);
+static void console_mark(uint16_t row, uint16_t x0, uint16_t x1);
+static void console_set(uint16_t x, uint16_t y, char c, color_t fg,
+                        color_t bg);
+static void console_newline(void);
+static void console_sync(void);
+static bool console_begin(void);
+static void console_end(void);
+static void console_present(void);
+static void console_putc(char c);
+static uint32_t console_puts(const char *str);
 static int16_t print_int(uint32_t value, uint8_t base, bool signed_type,
                          uint8_t bytes);
 
@@ -35,21 +92,91 @@ void print_init(uint16_t screen_width, uint16_t screen_height,
   max_char_x = screen_width / font_width;
   max_char_y = screen_height / font_height;
 
+  // Cell grid with scrollback, or just the screen when memory is short.
+  // Without any, characters are drawn straight to the screen
+  uint32_t line_bytes = max_char_x * sizeof(*cells);
+  uint32_t size = (max_char_y + SCROLLBACK_LINES) * line_bytes;
+  if (size > cell_capacity) {
+    struct console_cell *grid = mem_alloc(size, sizeof(uint32_t));
+    if (grid == 0 && max_char_y * line_bytes > cell_capacity) {
+      size = max_char_y * line_bytes;
+      grid = mem_alloc(size, sizeof(uint32_t));
+    }
+    if (grid != 0) {
+      cell_store = grid;
+      cell_capacity = size;
+    }
+  }
+  ring_lines = max_char_y + SCROLLBACK_LINES;
+  if (line_bytes != 0 && cell_capacity / line_bytes < ring_lines)
+    ring_lines = cell_capacity / line_bytes;
+
+  if (max_char_y > dirty_capacity) {
+    uint16_t *x0 = mem_alloc(max_char_y * sizeof(*x0), sizeof(uint16_t));
+    uint16_t *x1 = mem_alloc(max_char_y * sizeof(*x1), sizeof(uint16_t));
+    if (x0 != 0 && x1 != 0) {
+      dirty_x0 = x0;
+      dirty_x1 = x1;
+      dirty_capacity = max_char_y;
+    }
+  }
+  bool have_cells = cell_store != 0 && ring_lines >= max_char_y &&
+                    dirty_capacity >= max_char_y;
+  cells = have_cells ? cell_store : 0;
+
+  screen_top = 0;
+  history_lines = 0;
+  view_offset = 0;
+  scroll_pending = 0;
+  redraw_all = false;
+
   // Set default color of print
   default_color_mode = colorMode;
+  text_pixel = video_pack_color(colorMode);
 
   // Also clear screen for printing
   background_color = COLOR_BLACK;
-  clear_screen(background_color);
+  background_pixel = video_pack_color(background_color);
+  if (cells) {
+    for (uint16_t line = 0; line < ring_lines; ++line)
+      console_clear_line(cells + line * max_char_x);
+    for (uint16_t row = 0; row < max_char_y; ++row)
+      dirty_x0[row] = dirty_x1[row] = 0;
+  }
+  if (console_begin()) {
+    clear_screen(background_color);
+    console_end();
+  }
+  console_present();
 }
 
+// Draw the console into a compositor surface from now on
+void print_set_surface(compositor_surface_t *pane) { surface = pane; }
+
 // Clears the print window
 void print_clear(color_t text_color, color_t bg_color) {
   background_color = bg_color;
   default_color_mode = text_color;
+  background_pixel = video_pack_color(bg_color);
+  text_pixel = video_pack_color(text_color);
+
+  // The screen is wiped, the scrollback is kept
+  if (cells) {
+    for (uint16_t row = 0; row < max_char_y; ++row) {
+      console_clear_line(console_line(row));
+      dirty_x0[row] = dirty_x1[row] = 0;
+    }
+  }
+  view_offset = 0;
+  scroll_pending = 0;
+  redraw_all = false;
 
   // Dispatch call to video library to clear screen
-  clear_screen(bg_color);
+  if (console_begin()) {
+    clear_screen(bg_color);
+    console_end();
+  }
+  console_present();
 
   // Reset cursor position
   cursor_x = 0;
@@ -57,70 +184,344 @@ void print_clear(color_t text_color, color_t bg_color) {
 }
 
 // Set color mode of screen
-void setColorMode(color_t colorMode) { default_color_mode = colorMode; }
+void setColorMode(color_t colorMode) {
+  default_color_mode = colorMode;
+  text_pixel = video_pack_color(colorMode);
+}
 
 // Get current color
 color_t getColorMode() { return default_color_mode; }
 
+// Render the cells changed since the last flush and make them visible
+void print_flush(void) {
+  if (cells == 0) {
+    console_present();
+    return;
+  }
+
+  // Changes stay recorded until the surface can be drawn
+  if (!console_begin())
+    return;
+
+  if (redraw_all) {
+    for (uint16_t row = 0; row < max_char_y; ++row) {
+      dirty_x0[row] = 0;
+      dirty_x1[row] = max_char_x;
+    }
+  } else if (scroll_pending) {
+    // One bulk move for all lines scrolled in, clearing the rows it exposes
+    video_scroll_up(0, max_char_y * font_size_y, scroll_pending * font_size_y,
+                    background_pixel);
+  }
+
+  // Colors are packed once per run of equally colored cells
+  color_t fg = COLOR_BLACK, bg = COLOR_BLACK;
+  pixel_t fg_pixel = video_pack_color(fg), bg_pixel = fg_pixel;
+
+  for (uint16_t row = 0; row < max_char_y; ++row) {
+    if (dirty_x0[row] >= dirty_x1[row])
+      continue;
+
+    // Rows of the viewport are lines of the ring counted back from the screen
+    uint16_t line = (screen_top + ring_lines - view_offset + row) % ring_lines;
+    struct console_cell *cell = cells + line * max_char_x;
+
+    // Consecutive cells in the same colors are drawn as one text run
+    uint16_t x = dirty_x0[row];
+    while (x < dirty_x1[row]) {
+      if (!color_equal(cell[x].fg, fg)) {
+        fg = cell[x].fg;
+        fg_pixel = video_pack_color(fg);
+      }
+      if (!color_equal(cell[x].bg, bg)) {
+        bg = cell[x].bg;
+        bg_pixel = video_pack_color(bg);
+      }
+
+      char text[RUN_LENGTH];
+      uint16_t start = x, length = 0;
+      while (x < dirty_x1[row] && length < RUN_LENGTH &&
+             color_equal(cell[x].fg, fg) && color_equal(cell[x].bg, bg))
+        text[length++] = cell[x++].c;
+
+      video_draw_glyph_run(text, length, start * font_size_x,
+                           row * font_size_y, fg_pixel, bg_pixel);
+    }
+    dirty_x0[row] = dirty_x1[row] = 0;
+  }
+
+  scroll_pending = 0;
+  redraw_all = false;
+  console_end();
+  console_present();
+}
+
+// Repaint the whole console from its cells
+void print_redraw(void) {
+  // The surface's store is still in the old format
+  if (surface)
+    compositor_add(surface, surface->rect.x, surface->rect.y, surface->rect.w,
+                   surface->rect.h, surface->z);
+
+  text_pixel = video_pack_color(default_color_mode);
+  background_pixel = video_pack_color(background_color);
+  redraw_all = true;
+  print_flush();
+}
+
+// Move the viewport through the scrollback
+void print_scroll_view(int16_t lines) {
+  if (cells == 0)
+    return;
+
+  int32_t offset = (int32_t)view_offset + lines;
+  if (offset < 0)
+    offset = 0;
+  if (offset > history_lines)
+    offset = history_lines;
+  if (offset == view_offset)
+    return;
+
+  view_offset = offset;
+  redraw_all = true;
+  print_flush();
+}
+
 // Prints a character at current cursor position with given color mode
 void putc(char c) {
+  console_putc(c);
+  console_sync();
+}
+
+// Present after a print call, unless scrolled lines are still batched
+static void console_sync(void) {
+  if (scroll_pending == 0)
+    print_flush();
+}
+
+// Point drawing at the console's surface, if it has one. Without one the
+// cursors are kept off the screen meanwhile
+// Returns: false when the surface cannot be drawn
+static bool console_begin(void) {
+  if (surface)
+    return compositor_begin(surface) == 0;
+
+  video_cursor_suspend();
+  return true;
+}
+
+static void console_end(void) {
+  if (surface)
+    compositor_end();
+  else
+    video_cursor_resume();
+}
+
+// Show what was drawn. A surface only has its own damage copied, the rest
+// of the screen stays as it is
+static void console_present(void) {
+  if (surface)
+    compositor_present();
+  else
+    video_present();
+}
+
+// Cells of a row of the live screen
+static struct console_cell *console_line(uint16_t row) {
+  return cells + ((screen_top + row) % ring_lines) * max_char_x;
+}
+
+static void console_clear_line(struct console_cell *line) {
+  for (uint16_t x = 0; x < max_char_x; ++x) {
+    line[x] = (struct console_cell){
+        .c = ' ', .fg = default_color_mode, .bg = background_color};
+  }
+}
+
+// Record changed cells of a live screen row, wherever the viewport shows it
+static void console_mark(uint16_t row, uint16_t x0, uint16_t x1) {
+  uint32_t view_row = (uint32_t)row + view_offset;
+  if (view_row >= max_char_y)
+    return;
+
+  if (dirty_x0[view_row] >= dirty_x1[view_row]) {
+    dirty_x0[view_row] = x0;
+    dirty_x1[view_row] = x1;
+    return;
+  }
+  if (x0 < dirty_x0[view_row])
+    dirty_x0[view_row] = x0;
+  if (x1 > dirty_x1[view_row])
+    dirty_x1[view_row] = x1;
+}
+
+// Store a cell, only a real change has to be rendered again
+static void console_set(uint16_t x, uint16_t y, char c, color_t fg,
+                        color_t bg) {
+  struct console_cell *cell = console_line(y) + x;
+  if (cell->c == c && color_equal(cell->fg, fg) && color_equal(cell->bg, bg))
+    return;
+
+  *cell = (struct console_cell){.c = c, .fg = fg, .bg = bg};
+  console_mark(y, x, x + 1);
+}
+
+// Moves the cursor to the start of the next line, scrolling at the bottom
+static void console_newline(void) {
+  cursor_x = 0;
+  if (cursor_y + 1 < max_char_y) {
+    cursor_y++;
+    return;
+  }
+
+  if (cells == 0) {
+    // No cell grid, scroll right away
+    if (console_begin()) {
+      video_scroll_up(0, max_char_y * font_size_y, font_size_y,
+                      background_pixel);
+      console_end();
+    }
+    return;
+  }
+
+  // A whole screen is waiting already, draw it before starting another line
+  if (scroll_pending == max_char_y)
+    print_flush();
+
+  // The oldest line of the ring becomes the new bottom row
+  screen_top = (screen_top + 1) % ring_lines;
+  if (history_lines < ring_lines - max_char_y)
+    history_lines++;
+  console_clear_line(console_line(max_char_y - 1));
+
+  // A scrolled back viewport exposes an older line, not a blank one
+  if (view_offset)
+    redraw_all = true;
+
+  // Changed cells move up with their rows, the new row is blank on screen
+  // once the bulk scroll has run
+  memmove(dirty_x0, dirty_x0 + 1, (max_char_y - 1) * sizeof(*dirty_x0));
+  memmove(dirty_x1, dirty_x1 + 1, (max_char_y - 1) * sizeof(*dirty_x1));
+  dirty_x0[max_char_y - 1] = dirty_x1[max_char_y - 1] = 0;
+  scroll_pending++;
+}
+
+// Stores a character at the cursor without rendering it
+static void console_putc(char c) {
   if (c == '\n') {
+    console_newline();
+    return;
+  }
+  if (c == '\r') {
     cursor_x = 0;
-    cursor_y += 1;
-    // Wrap around logic
-    cursor_y %= max_char_y;
+    return;
+  }
 
-  } else {
-    color_t font_color = (c == ' ') ? background_color : default_color_mode;
+  if (cells) {
+    console_set(cursor_x, cursor_y, c, default_color_mode, background_color);
+  } else if (console_begin()) {
+    video_draw_glyph_opaque(c, cursor_x * font_size_x, cursor_y * font_size_y,
+                            text_pixel, background_pixel);
+    console_end();
+  }
 
-    video_draw_char(c, cursor_x * font_size_x, cursor_y * font_size_y,
-                    font_color);
+  // Auto new line logic, when cursor_x goes beyond screen_width
+  if (++cursor_x >= max_char_x)
+    console_newline();
+}
 
-    // Increment x and y
-    cursor_x += 1;
-    // Auto new line logic, when cursor_x goes beyond screen_width
-    cursor_y += (cursor_x >= max_char_x);
+// The bitmap is stored in the cells below the cursor, then copied to the
+// screen in one go once the lines it scrolled in are drawn
+void print_bitmap(text_bitmap_t *bitmap) {
+  if (cursor_x != 0)
+    console_newline();
+
+  // Each new line moves the cursor or scrolls, either way the bitmap keeps
+  // ending right above the cursor
+  for (uint16_t i = 0; i < bitmap->rows; ++i)
+    console_newline();
+  int32_t top = (int32_t)cursor_y - bitmap->rows;
+
+  uint16_t columns =
+      bitmap->columns < max_char_x ? bitmap->columns : max_char_x;
+  bool copy = view_offset == 0;
+
+  if (cells) {
+    for (uint16_t row = 0; row < bitmap->rows; ++row) {
+      if (top + row < 0)
+        continue;
+
+      const struct text_bitmap_cell *src =
+          bitmap->cells + row * bitmap->columns;
+      struct console_cell *line = console_line(top + row);
+      for (uint16_t x = 0; x < columns; ++x) {
+        line[x] = (struct console_cell){
+            .c = src[x].c, .fg = src[x].fg, .bg = bitmap->background};
+      }
+
+      // Rows not on screen right now are drawn from their cells
+      if (!copy)
+        console_mark(top + row, 0, columns);
+    }
+    print_flush();
+  }
+  if (!copy)
+    return;
 
-    // Handle cursor wrap around logic
-    cursor_y %= max_char_y;
-    cursor_x %= max_char_x;
+  int8_t status = -1;
+  if (console_begin()) {
+    video_set_clip(0, 0, max_char_x * font_size_x, max_char_y * font_size_y);
+    status = text_bitmap_draw(bitmap, 0, top * font_size_y);
+    video_reset_clip();
+    console_end();
   }
+
+  if (status != 0 && cells) {
+    // Fall back to drawing the cells
+    for (int32_t row = top > 0 ? top : 0; row < cursor_y; ++row)
+      console_mark(row, 0, columns);
+    print_flush();
+    return;
+  }
+  console_present();
 }
 
 void putcAt(char c, uint16_t x, uint16_t y, color_t colorMode) {
-  if (c == '\n') {
+  if (c == '\n' || x >= max_char_x || y >= max_char_y)
     return;
-  } else if (c == ' ') {
-    video_clear_char(x * font_size_x, y * font_size_y, colorMode);
+
+  if (cells == 0) {
+    if (console_begin()) {
+      if (c == ' ')
+        video_clear_char(x * font_size_x, y * font_size_y, colorMode);
+      else
+        video_draw_char(c, x * font_size_x, y * font_size_y, colorMode);
+      console_end();
+    }
+    console_present();
     return;
   }
 
-  video_draw_char(c, x * font_size_x, y * font_size_y, colorMode);
+  // A space fills the cell with the color, e.g. for a block cursor
+  if (c == ' ')
+    console_set(x, y, ' ', colorMode, colorMode);
+  else
+    console_set(x, y, c, colorMode, background_color);
+  print_flush();
 }
 
 // Prints a string until null terminator (unsafe)
 uint32_t puts(const char *str) {
+  uint32_t cnt = console_puts(str);
+  console_sync();
+  return cnt;
+}
+
+// Draws a string at the cursor without presenting it
+static uint32_t console_puts(const char *str) {
   uint32_t cnt = 0;
   while (*(str + cnt) && cnt != UINT32_MAX) {
-    char c = *(str + cnt++);
-
-    if (c == '\n') {
-      cursor_y = (cursor_y + 1) % max_char_y;
-      cursor_x = 0;
-    } else {
-      color_t font_color = (c == ' ') ? background_color : default_color_mode;
-      video_draw_char(c, cursor_x * font_size_x, cursor_y * font_size_y,
-                      font_color);
-
-      // Increment x and y
-      cursor_x += 1;
-      // Auto new line logic, when cursor_x goes beyond screen_width
-      cursor_y += (cursor_x >= max_char_x);
-
-      // Handle cursor wrap around logic
-      cursor_y %= max_char_y;
-      cursor_x %= max_char_x;
-    }
+    console_putc(*(str + cnt++));
   }
 
   return cnt;
@@ -136,7 +537,7 @@ int32_t print(const char *fmt, ...) {
     // --- ESCAPING & TAG START ---
     if (fmt[i] == '{') {
       if (fmt[i + 1] == '{') { // Escaped '{'
-        putc('{');
+        console_putc('{');
         cnt++;
         i++;
         continue;
@@ -147,7 +548,7 @@ int32_t print(const char *fmt, ...) {
 
       if (type == 'c') {
         char c = (char)va_arg(apList, int); // Promoted to int
-        putc(c);
+        console_putc(c);
         cnt++;
       } else if (type == 's') {
         const char *s = va_arg(apList, const char *);
@@ -165,7 +566,7 @@ int32_t print(const char *fmt, ...) {
         }
 
         for (uint32_t k = 0; s[k] != '\0' && k < max_len; ++k) {
-          putc(s[k]);
+          console_putc(s[k]);
           cnt++;
         }
       } else if (type == 'u' || type == 'i') {
@@ -200,7 +601,7 @@ int32_t print(const char *fmt, ...) {
     // --- ESCAPING FOR '}' ---
     if (fmt[i] == '}') {
       if (fmt[i + 1] == '}') { // Escaped '}'
-        putc('}');
+        console_putc('}');
         cnt++;
         i++;
         continue;
@@ -210,11 +611,12 @@ int32_t print(const char *fmt, ...) {
     }
 
     // Regular character
-    putc(fmt[i]);
+    console_putc(fmt[i]);
     cnt++;
   }
 
   va_end(apList);
+  console_sync();
   return cnt;
 }
 
@@ -227,7 +629,7 @@ int32_t println(const char *fmt, ...) {
     // --- ESCAPING & TAG START ---
     if (fmt[i] == '{') {
       if (fmt[i + 1] == '{') { // Escaped '{'
-        putc('{');
+        console_putc('{');
         cnt++;
         i++;
         continue;
@@ -238,7 +640,7 @@ int32_t println(const char *fmt, ...) {
 
       if (type == 'c') {
         char c = (char)va_arg(apList, int); // Promoted to int
-        putc(c);
+        console_putc(c);
         cnt++;
       } else if (type == 's') {
         const char *s = va_arg(apList, const char *);
@@ -256,7 +658,7 @@ int32_t println(const char *fmt, ...) {
         }
 
         for (uint32_t k = 0; s[k] != '\0' && k < max_len; ++k) {
-          putc(s[k]);
+          console_putc(s[k]);
           cnt++;
         }
       } else if (type == 'u' || type == 'i') {
@@ -295,7 +697,7 @@ int32_t println(const char *fmt, ...) {
     // --- ESCAPING FOR '}' ---
     if (fmt[i] == '}') {
       if (fmt[i + 1] == '}') { // Escaped '}'
-        putc('}');
+        console_putc('}');
         cnt++;
         i++;
         continue;
@@ -305,13 +707,14 @@ int32_t println(const char *fmt, ...) {
     }
 
     // Regular character
-    putc(fmt[i]);
+    console_putc(fmt[i]);
     cnt++;
   }
 
   va_end(apList);
 
-  putc('\n');
+  console_putc('\n');
+  console_sync();
 
   return cnt + 1;
 }
@@ -328,8 +731,18 @@ void putBackspace() {
     cursor_x--;
   }
 
-  video_clear_char(cursor_x * font_size_x, cursor_y * font_size_y,
-                   background_color);
+  if (cells) {
+    console_set(cursor_x, cursor_y, ' ', default_color_mode, background_color);
+    print_flush();
+    return;
+  }
+
+  if (console_begin()) {
+    video_fill(cursor_x * font_size_x, cursor_y * font_size_y, font_size_x,
+               font_size_y, background_pixel);
+    console_end();
+  }
+  console_present();
 }
 
 // Get current cursor position (unsafe)
@@ -381,7 +794,7 @@ static int16_t print_int(uint32_t value, uint8_t base, bool signed_type,
   if (base == 10 && signed_type) {
     uint32_t msb = 1U << (bytes * 8 - 1);
     if (masked_val & msb) {
-      putc('-');
+      console_putc('-');
       cnt++;
       masked_val = (~masked_val + 1) & mask;
     }
@@ -397,14 +810,14 @@ static int16_t print_int(uint32_t value, uint8_t base, bool signed_type,
 
   // Handle Prefixes for Hex and Binary
   if (base == 16) {
-    puts("0x");
+    console_puts("0x");
     cnt += 2;
   } else if (base == 2) {
-    puts("0b");
+    console_puts("0b");
     cnt += 2;
   }
 
   // Output the converted number string
-  cnt += puts(ptr);
+  cnt += console_puts(ptr);
   return cnt;
 }
\ No newline at end of file
@@ -0,0 +1,469 @@
+#include "raster.h"
+#include "memory.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define TILE_SIZE 64
+#define BLOCK_SIZE 8
+#define MAX_TRIANGLES 4096  // Queued before the bins are rendered early
+#define MAX_BIN_ENTRIES 32768
+#define BIN_END 0xFFFFFFFF
+
+#define GUARD_BAND (2048 * RASTER_SUBPIXEL)
+#define CLAMP_SUBPIXEL(v)                                                      \
+  ((v) < -GUARD_BAND ? -GUARD_BAND : (v) > GUARD_BAND ? GUARD_BAND : (v))
+
+// Edge functions stay inside this range, a block never steps further than
+// 8 pixels from where it was evaluated
+#define EDGE_LIMIT (1 << 30)
+
+// Plane values are kept modulo 2^32. Slivers whose area is barely above zero
+// can have gradients far outside int64, those are limited to convert safely
+#define PLANE_LIMIT 4611686018427387904.0 // 2^62
+#define CLAMP_PLANE(v)                                                         \
+  ((v) < -PLANE_LIMIT ? -PLANE_LIMIT : (v) > PLANE_LIMIT ? PLANE_LIMIT : (v))
+
+// Depth buffer values are biased to fit a signed 16-bit compare, the far
+// plane is z = 0xFFFF. Nearer passes, so vertex depths stop one short of it
+#define DEPTH_BIAS 32768
+#define DEPTH_FAR 0x7FFF
+#define VERTEX_Z(z) ((z) < 0xFFFF ? (z) : 0xFFFE)
+
+// Plane of an interpolated value, base at the top left of the bounding box
+struct plane {
+  uint32_t base;
+  uint32_t dx;
+  uint32_t dy;
+};
+
+// Triangle set up for rendering
+struct triangle {
+  // Edge function k at pixel (x, y) is a[k] * x + b[k] * y + c[k]
+  int32_t a[3];
+  int32_t b[3];
+  int64_t c[3];
+
+  // Bounding box in pixels, inside the clip rect, [x0, x1) by [y0, y1)
+  int16_t x0, y0, x1, y1;
+
+  struct plane z;
+  struct plane shade[3];
+  struct plane u, v;
+
+  const uint32_t *texels;
+  uint32_t texture_stride;
+  uint32_t u_mask, v_mask;
+  uint32_t pixel;
+  uint8_t flags; // KERNEL_RASTER_* except COVERED
+};
+
+// Frame state
+static int16_t *depth = 0;
+static uint32_t depth_capacity = 0;
+static uint32_t depth_pitch = 0;
+
+static struct triangle *triangles = 0;
+static uint16_t triangle_count = 0;
+
+// Per tile, a list of triangles in submission order
+static uint32_t *bin_head = 0;
+static uint32_t *bin_tail = 0;
+static uint32_t bin_capacity = 0;
+static uint16_t tiles_x = 0, tiles_y = 0;
+static uint16_t *entry_triangle = 0;
+static uint32_t *entry_next = 0;
+static uint32_t entry_count = 0;
+
+static bool ready = false;
+
+// Current texture
+static const video_image_t *texture = 0;
+
+// Area drawn since the last render, to mark it dirty
+static int16_t dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+
+// Helper function declaration
+static void reset_bins(void);
+static void render_bins(void);
+static bool setup(struct triangle *t, const raster_vertex_t *v0,
+                  const raster_vertex_t *v1, const raster_vertex_t *v2,
+                  uint8_t mode);
+static void set_plane(struct plane *p, const struct triangle *t,
+                      const int32_t *x, const int32_t *y, double area,
+                      double a0, double a1, double a2, double scale);
+static bool rejected(const struct triangle *t, int32_t x, int32_t y,
+                     int32_t w, int32_t h, bool *covered);
+static void draw_region(const struct triangle *t, int32_t x0, int32_t y0,
+                        int32_t x1, int32_t y1);
+static uint32_t plane_at(const struct plane *p, const struct triangle *t,
+                         int32_t x, int32_t y);
+
+int8_t raster_begin(void) {
+  ready = false;
+  if (!video_format.xrgb8888)
+    return -1;
+
+  // Depth rows are padded to whole blocks
+  uint32_t pitch = ((video_target.width + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1)) *
+                   sizeof(*depth);
+  uint32_t size = pitch * video_target.height;
+  if (size > depth_capacity) {
+    int16_t *buffer = mem_alloc(size, 16);
+    if (buffer == 0)
+      return -1;
+    depth = buffer;
+    depth_capacity = size;
+  }
+  depth_pitch = pitch;
+
+  uint16_t columns = (video_target.width + TILE_SIZE - 1) / TILE_SIZE;
+  uint16_t rows = (video_target.height + TILE_SIZE - 1) / TILE_SIZE;
+  uint32_t tiles = (uint32_t)columns * rows;
+  if (tiles > bin_capacity) {
+    uint32_t *head = mem_alloc(tiles * sizeof(*head), sizeof(uint32_t));
+    uint32_t *tail = mem_alloc(tiles * sizeof(*tail), sizeof(uint32_t));
+    if (head == 0 || tail == 0)
+      return -1;
+    bin_head = head;
+    bin_tail = tail;
+    bin_capacity = tiles;
+  }
+  tiles_x = columns;
+  tiles_y = rows;
+
+  if (triangles == 0) {
+    triangles = mem_alloc(MAX_TRIANGLES * sizeof(*triangles), 16);
+    entry_triangle =
+        mem_alloc(MAX_BIN_ENTRIES * sizeof(*entry_triangle), sizeof(uint16_t));
+    entry_next =
+        mem_alloc(MAX_BIN_ENTRIES * sizeof(*entry_next), sizeof(uint32_t));
+    if (triangles == 0 || entry_triangle == 0 || entry_next == 0) {
+      triangles = 0;
+      return -1;
+    }
+  }
+
+  reset_bins();
+  texture = 0;
+  ready = true;
+  return 0;
+}
+
+void raster_clear_depth(void) {
+  if (depth == 0 || depth_pitch == 0)
+    return;
+
+  fill_pattern_t far;
+  kernel_make_pattern(&far, DEPTH_FAR, sizeof(*depth));
+  kernel_fill_row((uint8_t *)depth, depth_pitch * video_target.height, &far,
+                  false);
+}
+
+int8_t raster_set_texture(const video_image_t *image) {
+  if (image && (image->width == 0 || image->height == 0 ||
+                (image->width & (image->width - 1)) ||
+                (image->height & (image->height - 1))))
+    return -1;
+
+  texture = image;
+  return 0;
+}
+
+void raster_triangle(const raster_vertex_t *a, const raster_vertex_t *b,
+                     const raster_vertex_t *c, uint8_t mode) {
+  if (!ready)
+    return;
+  if ((mode & RASTER_TEXTURED) && texture == 0)
+    mode &= ~RASTER_TEXTURED;
+
+  if (triangle_count == MAX_TRIANGLES)
+    render_bins();
+
+  struct triangle *t = &triangles[triangle_count];
+  if (!setup(t, a, b, c, mode))
+    return;
+
+  // Bin into every tile the triangle touches, tiles that only its bounding
+  // box overlaps are left out
+  int32_t tx0 = t->x0 / TILE_SIZE, tx1 = (t->x1 - 1) / TILE_SIZE;
+  int32_t ty0 = t->y0 / TILE_SIZE, ty1 = (t->y1 - 1) / TILE_SIZE;
+  uint32_t needed = (uint32_t)(tx1 - tx0 + 1) * (ty1 - ty0 + 1);
+  if (entry_count + needed > MAX_BIN_ENTRIES) {
+    render_bins();
+    if (needed > MAX_BIN_ENTRIES)
+      return;
+    // The slot was kept, only the bins were emptied
+    triangles[0] = *t;
+    t = &triangles[0];
+  }
+
+  for (int32_t ty = ty0; ty <= ty1; ++ty) {
+    for (int32_t tx = tx0; tx <= tx1; ++tx) {
+      bool covered;
+      if (rejected(t, tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE,
+                   &covered))
+        continue;
+
+      uint32_t tile = ty * tiles_x + tx;
+      uint32_t entry = entry_count++;
+      entry_triangle[entry] = triangle_count;
+      entry_next[entry] = BIN_END;
+      if (bin_head[tile] == BIN_END)
+        bin_head[tile] = entry;
+      else
+        entry_next[bin_tail[tile]] = entry;
+      bin_tail[tile] = entry;
+    }
+  }
+
+  dirty_x0 = t->x0 < dirty_x0 ? t->x0 : dirty_x0;
+  dirty_y0 = t->y0 < dirty_y0 ? t->y0 : dirty_y0;
+  dirty_x1 = t->x1 > dirty_x1 ? t->x1 : dirty_x1;
+  dirty_y1 = t->y1 > dirty_y1 ? t->y1 : dirty_y1;
+  triangle_count++;
+}
+
+void raster_end(void) {
+  if (!ready)
+    return;
+
+  render_bins();
+  ready = false;
+}
+
+// Helper functions
+static void reset_bins(void) {
+  for (uint32_t i = 0; i < (uint32_t)tiles_x * tiles_y; ++i)
+    bin_head[i] = BIN_END;
+  triangle_count = 0;
+  entry_count = 0;
+  dirty_x0 = dirty_y0 = INT16_MAX;
+  dirty_x1 = dirty_y1 = INT16_MIN;
+}
+
+// Every tile draws its triangles in order, then the next tile follows
+static void render_bins(void) {
+  for (uint16_t ty = 0; ty < tiles_y; ++ty) {
+    for (uint16_t tx = 0; tx < tiles_x; ++tx) {
+      int32_t x0 = tx * TILE_SIZE, y0 = ty * TILE_SIZE;
+      uint32_t entry = bin_head[ty * tiles_x + tx];
+
+      for (; entry != BIN_END; entry = entry_next[entry]) {
+        const struct triangle *t = &triangles[entry_triangle[entry]];
+        int32_t rx0 = x0 > t->x0 ? x0 : t->x0;
+        int32_t ry0 = y0 > t->y0 ? y0 : t->y0;
+        int32_t rx1 = x0 + TILE_SIZE < t->x1 ? x0 + TILE_SIZE : t->x1;
+        int32_t ry1 = y0 + TILE_SIZE < t->y1 ? y0 + TILE_SIZE : t->y1;
+        draw_region(t, rx0, ry0, rx1, ry1);
+      }
+    }
+  }
+
+  if (dirty_x0 < dirty_x1 && dirty_y0 < dirty_y1)
+    video_mark_dirty(dirty_x0, dirty_y0, dirty_x1 - dirty_x0,
+                     dirty_y1 - dirty_y0);
+  reset_bins();
+}
+
+// Edge functions and attribute planes. Gradients are worked out once per
+// triangle in floating point (the FPU is set up at boot), the per-pixel work
+// is all fixed point
+static bool setup(struct triangle *t, const raster_vertex_t *v0,
+                  const raster_vertex_t *v1, const raster_vertex_t *v2,
+                  uint8_t mode) {
+  // Counter-clockwise on screen is flipped so the area is positive
+  int32_t x[3] = {CLAMP_SUBPIXEL(v0->x), CLAMP_SUBPIXEL(v1->x),
+                  CLAMP_SUBPIXEL(v2->x)};
+  int32_t y[3] = {CLAMP_SUBPIXEL(v0->y), CLAMP_SUBPIXEL(v1->y),
+                  CLAMP_SUBPIXEL(v2->y)};
+  int64_t area = (int64_t)(x[1] - x[0]) * (y[2] - y[0]) -
+                 (int64_t)(y[1] - y[0]) * (x[2] - x[0]);
+  if (area == 0)
+    return false;
+
+  const raster_vertex_t *v[3] = {v0, v1, v2};
+  if (area < 0) {
+    const raster_vertex_t *tv = v[1];
+    v[1] = v[2];
+    v[2] = tv;
+    int32_t tx = x[1], ty = y[1];
+    x[1] = x[2];
+    y[1] = y[2];
+    x[2] = tx;
+    y[2] = ty;
+    area = -area;
+  }
+
+  // Pixels whose centers lie inside, clipped
+  int32_t min_x = x[0], max_x = x[0], min_y = y[0], max_y = y[0];
+  for (uint8_t i = 1; i < 3; ++i) {
+    min_x = x[i] < min_x ? x[i] : min_x;
+    max_x = x[i] > max_x ? x[i] : max_x;
+    min_y = y[i] < min_y ? y[i] : min_y;
+    max_y = y[i] > max_y ? y[i] : max_y;
+  }
+  int32_t x0 = (min_x - RASTER_SUBPIXEL / 2 + RASTER_SUBPIXEL - 1) >> 4;
+  int32_t y0 = (min_y - RASTER_SUBPIXEL / 2 + RASTER_SUBPIXEL - 1) >> 4;
+  int32_t x1 = ((max_x - RASTER_SUBPIXEL / 2) >> 4) + 1;
+  int32_t y1 = ((max_y - RASTER_SUBPIXEL / 2) >> 4) + 1;
+  x0 = x0 > video_target.clip_x0 ? x0 : video_target.clip_x0;
+  y0 = y0 > video_target.clip_y0 ? y0 : video_target.clip_y0;
+  x1 = x1 < video_target.clip_x1 ? x1 : video_target.clip_x1;
+  y1 = y1 < video_target.clip_y1 ? y1 : video_target.clip_y1;
+  if (x0 >= x1 || y0 >= y1)
+    return false;
+
+  t->x0 = x0;
+  t->y0 = y0;
+  t->x1 = x1;
+  t->y1 = y1;
+
+  // Edge from vertex k to the next, sampled at pixel centers. Pixels on an
+  // edge belong to the triangle only on its top or left side
+  for (uint8_t k = 0; k < 3; ++k) {
+    uint8_t n = k == 2 ? 0 : k + 1;
+    int32_t dx = x[n] - x[k], dy = y[n] - y[k];
+    bool top_left = dy < 0 || (dy == 0 && dx > 0);
+
+    t->a[k] = -dy * RASTER_SUBPIXEL;
+    t->b[k] = dx * RASTER_SUBPIXEL;
+    t->c[k] = (int64_t)dx * (RASTER_SUBPIXEL / 2 - y[k]) -
+              (int64_t)dy * (RASTER_SUBPIXEL / 2 - x[k]) - (top_left ? 0 : 1);
+  }
+
+  double fa = (double)area;
+  t->flags = 0;
+  if (!(mode & RASTER_NO_DEPTH)) {
+    t->flags |= KERNEL_RASTER_DEPTH;
+    set_plane(&t->z, t, x, y, fa, VERTEX_Z(v[0]->z) - DEPTH_BIAS,
+              VERTEX_Z(v[1]->z) - DEPTH_BIAS, VERTEX_Z(v[2]->z) - DEPTH_BIAS,
+              4096);
+  }
+
+  color_t first = v0->color;
+  t->pixel = (first.r << 16) | (first.g << 8) | first.b;
+  bool white = first.r == 0xFF && first.g == 0xFF && first.b == 0xFF;
+  if (mode & RASTER_GOURAUD) {
+    t->flags |= KERNEL_RASTER_GOURAUD | KERNEL_RASTER_MODULATE;
+    set_plane(&t->shade[0], t, x, y, fa, v[0]->color.b, v[1]->color.b,
+              v[2]->color.b, 65536);
+    set_plane(&t->shade[1], t, x, y, fa, v[0]->color.g, v[1]->color.g,
+              v[2]->color.g, 65536);
+    set_plane(&t->shade[2], t, x, y, fa, v[0]->color.r, v[1]->color.r,
+              v[2]->color.r, 65536);
+  } else if (!white) {
+    t->flags |= KERNEL_RASTER_MODULATE;
+  }
+
+  if (mode & RASTER_TEXTURED) {
+    t->flags |= KERNEL_RASTER_TEXTURED;
+    t->texels = texture->pixels;
+    t->texture_stride = texture->stride;
+    t->u_mask = texture->width - 1;
+    t->v_mask = texture->height - 1;
+    set_plane(&t->u, t, x, y, fa, v[0]->u, v[1]->u, v[2]->u, 1);
+    set_plane(&t->v, t, x, y, fa, v[0]->v, v[1]->v, v[2]->v, 1);
+  }
+  return true;
+}
+
+// Fixed point plane through the three vertex values, times 'scale'
+static void set_plane(struct plane *p, const struct triangle *t,
+                      const int32_t *x, const int32_t *y, double area,
+                      double a0, double a1, double a2, double scale) {
+  double d1 = a1 - a0, d2 = a2 - a0;
+  double dx = (d1 * (y[2] - y[0]) - d2 * (y[1] - y[0])) / area;
+  double dy = (d2 * (x[1] - x[0]) - d1 * (x[2] - x[0])) / area;
+
+  // Value at the center of the top left pixel of the bounding box
+  double cx = t->x0 * RASTER_SUBPIXEL + RASTER_SUBPIXEL / 2 - x[0];
+  double cy = t->y0 * RASTER_SUBPIXEL + RASTER_SUBPIXEL / 2 - y[0];
+  double base = (a0 + dx * cx + dy * cy) * scale;
+
+  // Out of range values only occur outside the triangle and may wrap
+  p->base = (uint32_t)(int64_t)CLAMP_PLANE(base);
+  p->dx = (uint32_t)(int64_t)CLAMP_PLANE(dx * RASTER_SUBPIXEL * scale);
+  p->dy = (uint32_t)(int64_t)CLAMP_PLANE(dy * RASTER_SUBPIXEL * scale);
+}
+
+// Whether the w by h pixels at (x, y) are all outside the triangle, and
+// otherwise whether they are all inside
+static bool rejected(const struct triangle *t, int32_t x, int32_t y,
+                     int32_t w, int32_t h, bool *covered) {
+  *covered = true;
+  for (uint8_t k = 0; k < 3; ++k) {
+    int64_t e = (int64_t)t->a[k] * x + (int64_t)t->b[k] * y + t->c[k];
+    int64_t ax = (int64_t)t->a[k] * (w - 1), by = (int64_t)t->b[k] * (h - 1);
+    int64_t high = e + (ax > 0 ? ax : 0) + (by > 0 ? by : 0);
+    int64_t low = e + (ax < 0 ? ax : 0) + (by < 0 ? by : 0);
+    if (high < 0)
+      return true;
+    if (low < 0)
+      *covered = false;
+  }
+  return false;
+}
+
+// Draw the part of the triangle in [x0, x1) by [y0, y1), one 8x8 block of
+// the screen grid at a time
+static void draw_region(const struct triangle *t, int32_t x0, int32_t y0,
+                        int32_t x1, int32_t y1) {
+  raster_block_t block = {
+      .texels = t->texels,
+      .texture_stride = t->texture_stride,
+      .u_mask = t->u_mask,
+      .v_mask = t->v_mask,
+      .pixel = t->pixel,
+      .u_dx = t->u.dx,
+      .u_dy = t->u.dy,
+      .v_dx = t->v.dx,
+      .v_dy = t->v.dy,
+      .z_dx = t->z.dx,
+      .z_dy = t->z.dy,
+  };
+  for (uint8_t k = 0; k < 3; ++k) {
+    block.edge_dx[k] = t->a[k];
+    block.edge_dy[k] = t->b[k];
+    block.shade_dx[k] = t->shade[k].dx;
+    block.shade_dy[k] = t->shade[k].dy;
+  }
+
+  for (int32_t by = y0; by < y1;) {
+    int32_t next_y = (by & ~(BLOCK_SIZE - 1)) + BLOCK_SIZE;
+    int32_t h = (next_y < y1 ? next_y : y1) - by;
+
+    for (int32_t bx = x0; bx < x1;) {
+      int32_t next_x = (bx & ~(BLOCK_SIZE - 1)) + BLOCK_SIZE;
+      int32_t w = (next_x < x1 ? next_x : x1) - bx;
+
+      bool covered;
+      if (!rejected(t, bx, by, w, h, &covered)) {
+        // Blocks that are not rejected are within 8 pixels of every edge
+        // they are outside of, so only large positive values are cut
+        for (uint8_t k = 0; k < 3; ++k) {
+          int64_t e = (int64_t)t->a[k] * bx + (int64_t)t->b[k] * by + t->c[k];
+          block.edge[k] = e > EDGE_LIMIT ? EDGE_LIMIT : (int32_t)e;
+          block.shade[k] = plane_at(&t->shade[k], t, bx, by);
+        }
+        block.z = plane_at(&t->z, t, bx, by);
+        block.u = plane_at(&t->u, t, bx, by);
+        block.v = plane_at(&t->v, t, bx, by);
+        block.flags = t->flags | (covered ? KERNEL_RASTER_COVERED : 0);
+
+        kernel_raster_block(target_pixel(bx, by), video_target.pitch,
+                            (int16_t *)((uint8_t *)depth + by * depth_pitch) +
+                                bx,
+                            depth_pitch, w, h, &block);
+      }
+      bx += w;
+    }
+    by += h;
+  }
+}
+
+static uint32_t plane_at(const struct plane *p, const struct triangle *t,
+                         int32_t x, int32_t y) {
+  return p->base + p->dx * (uint32_t)(x - t->x0) +
+         p->dy * (uint32_t)(y - t->y0);
+}
@@ -0,0 +1,79 @@
+#include "serial.h"
+#include "io.h"
+
+// UART registers, offsets from the base port
+#define UART_DATA 0         // Receive/transmit buffer, divisor low with DLAB
+#define UART_IER 1          // Interrupt enable, divisor high with DLAB
+#define UART_FCR 2          // FIFO control
+#define UART_LCR 3          // Line control
+#define UART_MCR 4          // Modem control
+#define UART_LSR 5          // Line status
+
+// Register bits
+#define LCR_8N1 0x03
+#define LCR_DLAB 0x80
+#define FCR_ENABLE_CLEAR 0x07 // Enable FIFOs and clear both
+#define MCR_DTR_RTS_OUT2 0x0B
+#define MCR_LOOPBACK 0x1E
+#define LSR_DATA_READY 0x01
+#define LSR_THR_EMPTY 0x20
+
+#define UART_CLOCK 115200
+#define UART_FIFO_SIZE 16
+
+static bool serial_ready = false;
+
+int8_t serial_init(uint32_t baud) {
+  uint16_t port = SERIAL_COM1;
+  uint16_t divisor = baud && baud <= UART_CLOCK ? UART_CLOCK / baud : 1;
+
+  outByte(port + UART_IER, 0x00);
+  outByte(port + UART_LCR, LCR_DLAB);
+  outByte(port + UART_DATA, divisor & 0xFF);
+  outByte(port + UART_IER, divisor >> 8);
+  outByte(port + UART_LCR, LCR_8N1);
+  outByte(port + UART_FCR, FCR_ENABLE_CLEAR);
+
+  // A byte sent in loopback mode must come back
+  outByte(port + UART_MCR, MCR_LOOPBACK);
+  outByte(port + UART_DATA, 0xAE);
+  if (inByte(port + UART_DATA) != 0xAE) {
+    serial_ready = false;
+    return -1;
+  }
+
+  outByte(port + UART_MCR, MCR_DTR_RTS_OUT2);
+  serial_ready = true;
+  return 0;
+}
+
+// The empty flag means the whole FIFO is free, so it is refilled in bursts
+// instead of polling the line status once per byte
+void serial_write(const void *data, uint32_t size) {
+  const uint8_t *bytes = data;
+  if (!serial_ready)
+    return;
+
+  while (size > 0) {
+    while (!(inByte(SERIAL_COM1 + UART_LSR) & LSR_THR_EMPTY))
+      ;
+
+    uint32_t burst = size < UART_FIFO_SIZE ? size : UART_FIFO_SIZE;
+    for (uint32_t i = 0; i < burst; ++i)
+      outByte(SERIAL_COM1 + UART_DATA, bytes[i]);
+    bytes += burst;
+    size -= burst;
+  }
+}
+
+bool serial_received(void) {
+  return serial_ready && (inByte(SERIAL_COM1 + UART_LSR) & LSR_DATA_READY);
+}
+
+uint8_t serial_read(void) {
+  if (!serial_ready)
+    return 0;
+  while (!serial_received())
+    ;
+  return inByte(SERIAL_COM1 + UART_DATA);
+}
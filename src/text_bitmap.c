@@ -0,0 +1,205 @@
+#include "text_bitmap.h"
+#include "memory.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Longest run of equally colored characters drawn at once
+#define RUN_LENGTH 128
+
+// Helper function declaration
+static int8_t render(text_bitmap_t *bitmap);
+
+void text_bitmap_measure(const char *text, uint16_t origin_column,
+                         uint16_t *columns, uint16_t *rows) {
+  uint16_t width = 0, lines = 0;
+  uint16_t x = origin_column;
+
+  for (; *text; ++text) {
+    if (lines == 0)
+      lines = 1;
+
+    if (*text == '\n') {
+      x = origin_column;
+      lines += lines < UINT16_MAX;
+    } else if (*text == '\r') {
+      x = origin_column;
+    } else if (x < UINT16_MAX) {
+      if (++x > width)
+        width = x;
+    }
+  }
+
+  *columns = width;
+  *rows = lines;
+}
+
+int8_t text_bitmap_create(text_bitmap_t *bitmap, uint16_t columns,
+                          uint16_t rows, uint16_t origin_column,
+                          color_t background) {
+  if (columns == 0 || rows == 0)
+    return -1;
+
+  uint32_t count = (uint32_t)columns * rows;
+  struct text_bitmap_cell *cells =
+      mem_alloc(count * sizeof(*cells), sizeof(uint32_t));
+  if (cells == 0)
+    return -1;
+
+  for (uint32_t i = 0; i < count; ++i)
+    cells[i] = (struct text_bitmap_cell){.c = ' ', .fg = background};
+
+  *bitmap = (text_bitmap_t){
+      .cells = cells,
+      .columns = columns,
+      .rows = rows,
+      .origin_column = origin_column,
+      .cursor_x = origin_column,
+      .background = background,
+  };
+  return 0;
+}
+
+void text_bitmap_puts(text_bitmap_t *bitmap, const char *text, color_t fg) {
+  for (; *text; ++text) {
+    if (*text == '\n') {
+      bitmap->cursor_x = bitmap->origin_column;
+      if (bitmap->cursor_y < UINT16_MAX)
+        bitmap->cursor_y++;
+      continue;
+    }
+    if (*text == '\r') {
+      bitmap->cursor_x = bitmap->origin_column;
+      continue;
+    }
+
+    if (bitmap->cursor_x < bitmap->columns &&
+        bitmap->cursor_y < bitmap->rows) {
+      uint32_t i = (uint32_t)bitmap->cursor_y * bitmap->columns +
+                   bitmap->cursor_x;
+      bitmap->cells[i] = (struct text_bitmap_cell){.c = *text, .fg = fg};
+    }
+    if (bitmap->cursor_x < UINT16_MAX)
+      bitmap->cursor_x++;
+  }
+
+  bitmap->rendered_format = 0;
+}
+
+int8_t text_bitmap_from_string(text_bitmap_t *bitmap, const char *text,
+                               uint16_t origin_column, color_t fg,
+                               color_t background) {
+  uint16_t columns, rows;
+  text_bitmap_measure(text, origin_column, &columns, &rows);
+  if (text_bitmap_create(bitmap, columns, rows, origin_column, background) !=
+      0)
+    return -1;
+
+  text_bitmap_puts(bitmap, text, fg);
+  return 0;
+}
+
+int8_t text_bitmap_draw(text_bitmap_t *bitmap, int16_t x, int16_t y) {
+  if (bitmap->rendered_format != pixel_format_key(&video_format) ||
+      bitmap->rendered_cell_w != video_font_width() ||
+      bitmap->rendered_cell_h != video_font_height()) {
+    if (render(bitmap) != 0)
+      return -1;
+  }
+
+  int32_t src_x = 0, src_y = 0;
+  int32_t dest_x = x, dest_y = y;
+  int32_t w = bitmap->width, h = bitmap->height;
+
+  // Clip like a sprite blit
+  if (dest_x < video_target.clip_x0) {
+    src_x = video_target.clip_x0 - dest_x;
+    w -= src_x;
+    dest_x = video_target.clip_x0;
+  }
+  if (dest_y < video_target.clip_y0) {
+    src_y = video_target.clip_y0 - dest_y;
+    h -= src_y;
+    dest_y = video_target.clip_y0;
+  }
+  if (dest_x + w > video_target.clip_x1)
+    w = video_target.clip_x1 - dest_x;
+  if (dest_y + h > video_target.clip_y1)
+    h = video_target.clip_y1 - dest_y;
+
+  if (w <= 0 || h <= 0)
+    return 0;
+
+  uint8_t bytes_pp = video_format.bytes_pp;
+  const uint8_t *src =
+      bitmap->pixels + src_y * bitmap->pitch + src_x * bytes_pp;
+  uint8_t *dest = target_pixel(dest_x, dest_y);
+
+  for (int32_t row = 0; row < h; ++row) {
+    if (video_target.is_framebuffer)
+      video_copy_to_screen(dest, src, w * bytes_pp);
+    else
+      kernel_copy_row(dest, src, w * bytes_pp, false);
+    src += bitmap->pitch;
+    dest += video_target.pitch;
+  }
+
+  video_mark_dirty(dest_x, dest_y, w, h);
+  return 0;
+}
+
+void text_bitmap_invalidate(text_bitmap_t *bitmap) {
+  bitmap->rendered_format = 0;
+}
+
+// Helper functions
+// Draw every cell into the pixel buffer, runs of one color at a time
+static int8_t render(text_bitmap_t *bitmap) {
+  uint16_t cell_w = video_font_width();
+  uint16_t cell_h = video_font_height();
+  uint32_t width = (uint32_t)bitmap->columns * cell_w;
+  uint32_t height = (uint32_t)bitmap->rows * cell_h;
+  if (width > UINT16_MAX || height > UINT16_MAX ||
+      width * height > UINT32_MAX / 4)
+    return -1;
+
+  uint32_t size = width * height * 4;
+  if (size > bitmap->capacity) {
+    uint8_t *pixels = mem_alloc(size, 16);
+    if (pixels == 0)
+      return -1;
+    bitmap->pixels = pixels;
+    bitmap->capacity = size;
+  }
+
+  bitmap->width = width;
+  bitmap->height = height;
+  bitmap->pitch = width * video_format.bytes_pp;
+
+  if (video_begin_offscreen(bitmap->pixels, bitmap->pitch, width, height) !=
+      0)
+    return -1;
+
+  const struct text_bitmap_cell *cell = bitmap->cells;
+  for (uint16_t row = 0; row < bitmap->rows; ++row) {
+    uint16_t x = 0;
+    while (x < bitmap->columns) {
+      color_t fg = cell[x].fg;
+      char text[RUN_LENGTH];
+      uint16_t start = x, length = 0;
+      while (x < bitmap->columns && length < RUN_LENGTH &&
+             color_equal(cell[x].fg, fg))
+        text[length++] = cell[x++].c;
+
+      video_draw_text(text, length, start * cell_w, row * cell_h, fg,
+                      bitmap->background);
+    }
+    cell += bitmap->columns;
+  }
+
+  video_end_offscreen();
+
+  bitmap->rendered_format = pixel_format_key(&video_format);
+  bitmap->rendered_cell_w = cell_w;
+  bitmap->rendered_cell_h = cell_h;
+  return 0;
+}
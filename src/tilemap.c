@@ -0,0 +1,293 @@
+#include "tilemap.h"
+#include "memory.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Helper function declaration
+static int8_t prepare(tilemap_t *map);
+static void convert_tiles(tilemap_t *map);
+static void shift_view(tilemap_t *map, uint16_t w, uint16_t h, int32_t dx,
+                       int32_t dy);
+static void draw_area(const tilemap_t *map, int32_t cam_x, int32_t cam_y,
+                      uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1);
+static int32_t floor_div(int32_t a, uint16_t b);
+
+int8_t tilemap_init(tilemap_t *map, const video_image_t *tileset,
+                    uint16_t tile_w, uint16_t tile_h, const uint16_t *tiles,
+                    uint16_t map_w, uint16_t map_h, color_t background) {
+  if (tile_w == 0 || tile_h == 0 || tileset->width < tile_w ||
+      tileset->height < tile_h)
+    return -1;
+
+  // Indexes stop short of TILEMAP_EMPTY, tiles past it are never drawn
+  uint32_t tile_count =
+      (uint32_t)(tileset->width / tile_w) * (tileset->height / tile_h);
+  if (tile_count > TILEMAP_EMPTY)
+    tile_count = TILEMAP_EMPTY;
+
+  *map = (tilemap_t){
+      .tiles = tiles,
+      .map_w = map_w,
+      .map_h = map_h,
+      .tile_w = tile_w,
+      .tile_h = tile_h,
+      .tile_count = tile_count,
+      .tileset = tileset,
+      .background = background,
+  };
+  tilemap_set_viewport(map, 0, 0, video_target.width, video_target.height);
+  return 0;
+}
+
+void tilemap_set_viewport(tilemap_t *map, uint16_t x, uint16_t y, uint16_t w,
+                          uint16_t h) {
+  map->view = (video_rect_t){.x = x, .y = y, .w = w, .h = h};
+  map->drawn = false;
+}
+
+void tilemap_invalidate(tilemap_t *map) { map->drawn = false; }
+
+int8_t tilemap_render(tilemap_t *map, int32_t cam_x, int32_t cam_y) {
+  if (prepare(map) != 0)
+    return -1;
+
+  // The viewport may hang over the edge of the screen
+  video_rect_t *v = &map->view;
+  if (v->x >= video_target.width || v->y >= video_target.height)
+    return 0;
+  uint16_t w = v->w < video_target.width - v->x ? v->w
+                                                : video_target.width - v->x;
+  uint16_t h = v->h < video_target.height - v->y ? v->h
+                                                 : video_target.height - v->y;
+  if (w == 0 || h == 0)
+    return 0;
+
+  // Another page, buffer or mode no longer holds the previous render
+  bool reuse = map->drawn && map->drawn_addr == video_target.addr &&
+               map->drawn_pitch == video_target.pitch;
+
+  int32_t dx = cam_x - map->drawn_x;
+  int32_t dy = cam_y - map->drawn_y;
+
+  if (reuse && dx == 0 && dy == 0)
+    return 0;
+
+  if (reuse && dx > -w && dx < w && dy > -h && dy < h) {
+    shift_view(map, w, h, dx, dy);
+
+    // Rows exposed at the top or bottom, then columns at the sides
+    uint16_t keep_y0 = dy < 0 ? -dy : 0;
+    uint16_t keep_y1 = dy > 0 ? h - dy : h;
+    if (dy > 0)
+      draw_area(map, cam_x, cam_y, 0, keep_y1, w, h);
+    else if (dy < 0)
+      draw_area(map, cam_x, cam_y, 0, 0, w, keep_y0);
+
+    if (dx > 0)
+      draw_area(map, cam_x, cam_y, w - dx, keep_y0, w, keep_y1);
+    else if (dx < 0)
+      draw_area(map, cam_x, cam_y, 0, keep_y0, -dx, keep_y1);
+  } else {
+    draw_area(map, cam_x, cam_y, 0, 0, w, h);
+  }
+
+  map->drawn = true;
+  map->drawn_x = cam_x;
+  map->drawn_y = cam_y;
+  map->drawn_addr = video_target.addr;
+  map->drawn_pitch = video_target.pitch;
+  video_mark_dirty(v->x, v->y, w, h);
+  return 0;
+}
+
+void tilemap_redraw_rect(tilemap_t *map, uint16_t x, uint16_t y, uint16_t w,
+                         uint16_t h) {
+  if (!map->drawn || prepare(map) != 0)
+    return;
+
+  // Intersect with the viewport and the screen
+  video_rect_t *v = &map->view;
+  uint32_t x0 = x > v->x ? x : v->x;
+  uint32_t y0 = y > v->y ? y : v->y;
+  uint32_t x1 = (uint32_t)x + w;
+  uint32_t y1 = (uint32_t)y + h;
+  if (x1 > (uint32_t)v->x + v->w)
+    x1 = (uint32_t)v->x + v->w;
+  if (y1 > (uint32_t)v->y + v->h)
+    y1 = (uint32_t)v->y + v->h;
+  if (x1 > video_target.width)
+    x1 = video_target.width;
+  if (y1 > video_target.height)
+    y1 = video_target.height;
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  draw_area(map, map->drawn_x, map->drawn_y, x0 - v->x, y0 - v->y, x1 - v->x,
+            y1 - v->y);
+  video_mark_dirty(x0, y0, x1 - x0, y1 - y0);
+}
+
+// Helper functions
+// Convert the tiles for the current pixel format and size the bounce row
+static int8_t prepare(tilemap_t *map) {
+  uint32_t size = (uint32_t)map->tile_count * map->tile_w * map->tile_h * 4;
+  if (size > map->cache_capacity) {
+    uint8_t *cache = mem_alloc(size, 16);
+    if (cache == 0)
+      return -1;
+    map->cache = cache;
+    map->cache_capacity = size;
+    map->cache_format = 0;
+  }
+
+  uint32_t row = (uint32_t)video_target.width * 4;
+  if (row > map->scratch_capacity) {
+    uint8_t *scratch = mem_alloc(row, 16);
+    if (scratch == 0)
+      return -1;
+    map->scratch = scratch;
+    map->scratch_capacity = row;
+  }
+
+  uint32_t format = pixel_format_key(&video_format);
+  if (map->cache_format != format) {
+    convert_tiles(map);
+    map->cache_format = format;
+    map->drawn = false;
+  }
+  return 0;
+}
+
+// Each tile is stored on its own, rows of tile_w pixels back to back
+static void convert_tiles(tilemap_t *map) {
+  const video_image_t *set = map->tileset;
+  uint16_t columns = set->width / map->tile_w;
+  uint8_t bytes_pp = video_format.bytes_pp;
+  uint8_t *dest = map->cache;
+
+  for (uint16_t t = 0; t < map->tile_count; ++t) {
+    const uint32_t *src = set->pixels +
+                          (uint32_t)(t / columns) * map->tile_h * set->stride +
+                          (uint32_t)(t % columns) * map->tile_w;
+
+    for (uint16_t y = 0; y < map->tile_h; ++y, src += set->stride) {
+      for (uint16_t x = 0; x < map->tile_w; ++x) {
+        uint32_t s = src[x];
+        pixel_t pixel = video_pack_color(
+            COLOR((s >> 16) & 0xFF, (s >> 8) & 0xFF, s & 0xFF));
+        for (uint8_t b = 0; b < bytes_pp; ++b)
+          *dest++ = (uint8_t)(pixel >> (b * 8));
+      }
+    }
+  }
+}
+
+// Move the pixels that stay visible by (-dx, -dy) inside the viewport
+static void shift_view(tilemap_t *map, uint16_t w, uint16_t h, int32_t dx,
+                       int32_t dy) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+  uint32_t pitch = video_target.pitch;
+  uint32_t row_bytes = (w - (dx < 0 ? -dx : dx)) * bytes_pp;
+  uint16_t rows = h - (dy < 0 ? -dy : dy);
+
+  uint8_t *src = target_pixel(map->view.x + (dx > 0 ? dx : 0),
+                              map->view.y + (dy > 0 ? dy : 0));
+  uint8_t *dest = target_pixel(map->view.x + (dx < 0 ? -dx : 0),
+                               map->view.y + (dy < 0 ? -dy : 0));
+
+  if (dy != 0) {
+    // Rows never overlap, walk them so no source row is overwritten first
+    int32_t step = pitch;
+    if (dy < 0) {
+      src += (rows - 1) * pitch;
+      dest += (rows - 1) * pitch;
+      step = -step;
+    }
+    for (uint16_t row = 0; row < rows; ++row) {
+      kernel_copy_row(dest, src, row_bytes, false);
+      src += step;
+      dest += step;
+    }
+    return;
+  }
+
+  // Within a row only a forward copy may overlap, the other way bounces
+  for (uint16_t row = 0; row < rows; ++row) {
+    if (dx > 0) {
+      memmove(dest, src, row_bytes);
+    } else {
+      kernel_copy_row(map->scratch, src, row_bytes, false);
+      kernel_copy_row(dest, map->scratch, row_bytes, false);
+    }
+    src += pitch;
+    dest += pitch;
+  }
+}
+
+// Draw the tiles of viewport area [x0, x1) by [y0, y1), a row at a time with
+// one copy per tile crossed
+static void draw_area(const tilemap_t *map, int32_t cam_x, int32_t cam_y,
+                      uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+  uint32_t tile_row_bytes = (uint32_t)map->tile_w * bytes_pp;
+  uint32_t tile_bytes = tile_row_bytes * map->tile_h;
+
+  fill_pattern_t background;
+  kernel_make_pattern(&background, video_pack_color(map->background),
+                      bytes_pp);
+
+  // Tile column and pixel in it where every row starts
+  int32_t start_tx = floor_div(cam_x + x0, map->tile_w);
+  uint16_t start_rx = cam_x + x0 - start_tx * map->tile_w;
+
+  int32_t ty = floor_div(cam_y + y0, map->tile_h);
+  uint16_t ry = cam_y + y0 - ty * map->tile_h;
+  uint8_t *dest_row = target_pixel(map->view.x + x0, map->view.y + y0);
+
+  for (uint16_t y = y0; y < y1; ++y) {
+    bool row_inside = ty >= 0 && ty < map->map_h;
+    const uint16_t *tiles = map->tiles + (row_inside ? ty * map->map_w : 0);
+    uint8_t *dest = dest_row;
+    int32_t tx = start_tx;
+    uint16_t rx = start_rx;
+    uint16_t count = x1 - x0;
+
+    while (count > 0) {
+      uint16_t run = map->tile_w - rx;
+      if (run > count)
+        run = count;
+
+      uint16_t index = TILEMAP_EMPTY;
+      if (row_inside && tx >= 0 && tx < map->map_w)
+        index = tiles[tx];
+
+      if (index < map->tile_count) {
+        const uint8_t *src = map->cache + index * tile_bytes +
+                             ry * tile_row_bytes + rx * bytes_pp;
+        kernel_copy_row(dest, src, run * bytes_pp, false);
+      } else {
+        kernel_fill_row(dest, run * bytes_pp, &background, false);
+      }
+
+      dest += run * bytes_pp;
+      count -= run;
+      rx = 0;
+      ++tx;
+    }
+
+    dest_row += video_target.pitch;
+    if (++ry == map->tile_h) {
+      ry = 0;
+      ++ty;
+    }
+  }
+}
+
+// Division rounding towards negative infinity, for cameras left of or above
+// the map
+static int32_t floor_div(int32_t a, uint16_t b) {
+  int32_t q = a / b;
+  if (a % b != 0 && a < 0)
+    --q;
+  return q;
+}
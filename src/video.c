@@ -1,315 +1,1127 @@
 #include "video.h"
+#include "bga.h"
 #include "font8x8_basic.h"
+#include "io.h"
 #include "memory.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+#include "virtio_gpu.h"
 
 // Macros
 #define BPP framebuffer_info.bitsPerPixel
+#define MAX_DIRTY_RECTS 32
+#define PALETTE_SIZE 256
+#define NEAREST_CACHE_SIZE 256
+#define MAX_SCALE 8
+#define MAX_OFFSCREEN 4
+
+// VGA input status register, bit 3 is set during vertical retrace
+#define VGA_INPUT_STATUS 0x3DA
+#define VGA_RETRACE 0x08
+#define RETRACE_SPINS 1000000
 
 // Internal state flags
 static uint8_t flags = 0x00;
 #define FLAGS_INIT 0x01
+#define FLAGS_BACK_BUFFER 0x02
+#define FLAGS_PAGE_FLIP 0x04
+#define FLAGS_OFFSCREEN 0x08
+#define FLAGS_INDEXED 0x10
+#define FLAGS_SCALED 0x20
 
 // Frame buffer info struct
 static framebuffer_info_t framebuffer_info;
 
+// Pixel format and draw target shared with the rest of the video module
+pixel_format_t video_format;
+draw_target_t video_target;
+
+// Layout of the framebuffer itself. Drawing into the back buffer always uses
+// XRGB8888 instead, and video_present() converts to this layout
+static pixel_format_t hw_format;
+
+// How video_present() turns back buffer rows into framebuffer rows
+enum present_mode {
+  PRESENT_COPY,   // Framebuffer is XRGB8888 too
+  PRESENT_RGB565, // SSE2 pack to 16bpp
+  PRESENT_RGB555, // SSE2 pack to 15bpp
+  PRESENT_RGB888, // SSE2 pack to 24bpp
+  PRESENT_GENERIC // Any other layout, one pixel at a time
+};
+static enum present_mode present_mode = PRESENT_COPY;
+
+// Off-screen back buffer and the regions damaged since the last present
+static uint8_t *back_buffer = 0;
+static uint32_t back_pitch = 0;
+static uint32_t back_capacity = 0;
+static video_rect_t dirty_rects[MAX_DIRTY_RECTS];
+static uint8_t dirty_count = 0;
+
+// 8bpp back buffer of palette indices, dirty regions are shared with the
+// XRGB8888 one
+static uint8_t *indexed_buffer = 0;
+static uint32_t indexed_pitch = 0;
+static uint32_t indexed_capacity = 0;
+
+// Palette as XRGB8888, and packed in the framebuffer layout for presenting
+static uint32_t palette[PALETTE_SIZE];
+static pixel_t palette_packed[PALETTE_SIZE];
+static bool palette_ready = false;
+
+// Recent nearest palette matches, direct-mapped by color. Keys carry bit 24
+// so that 0 marks an empty entry
+static uint32_t nearest_keys[NEAREST_CACHE_SIZE];
+static uint8_t nearest_index[NEAREST_CACHE_SIZE];
+
+// Size drawing sees. Smaller than the screen at a lower internal resolution,
+// then presented 'scale' times larger at (view_x, view_y)
+static uint16_t screen_width = 0;
+static uint16_t screen_height = 0;
+static uint8_t scale = 1;
+static uint16_t view_x = 0;
+static uint16_t view_y = 0;
+
+// Present rows while scaling: converted to the screen layout, then widened
+static uint8_t *scale_row = 0;
+static uint8_t *scale_wide = 0;
+static uint32_t scale_capacity = 0;
+
+// The framebuffer is a virtio-gpu resource in guest RAM, the host shows
+// only the rects transferred to it on present
+static bool virtio_display = false;
+
+// Targets to return to after drawing off-screen, innermost last
+static draw_target_t saved_targets[MAX_OFFSCREEN];
+static uint8_t offscreen_depth = 0;
+
+// Video memory pages while page flipping, drawing goes to 'flip_page'
+static uint8_t flip_pages = 0;
+static uint8_t flip_page = 0;
+
+// Per format primitives
+static void put_pixel32(uint8_t *dest, pixel_t pixel);
+static void put_pixel24(uint8_t *dest, pixel_t pixel);
+static void put_pixel16(uint8_t *dest, pixel_t pixel);
+static void put_pixel8(uint8_t *dest, pixel_t pixel);
+static void draw_glyph32(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque);
+static void draw_glyph24(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque);
+static void draw_glyph16(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque);
+static void draw_glyph8(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                        pixel_t fg, pixel_t bg, bool opaque);
+
+static const pixel_ops_t ops32 = {put_pixel32, draw_glyph32};
+static const pixel_ops_t ops24 = {put_pixel24, draw_glyph24};
+// 15bpp pixels are stored like 16bpp ones, only the packing differs
+static const pixel_ops_t ops16 = {put_pixel16, draw_glyph16};
+static const pixel_ops_t ops8 = {put_pixel8, draw_glyph8};
+
+// Helper function declaration
+static void use_canonical_format(void);
+static void use_indexed_format(void);
+static void default_palette(void);
+static pixel_t pack_hw(uint32_t xrgb);
+static uint8_t nearest_entry(color_t color);
+static void present_rect(const video_rect_t *r);
+static video_rect_t to_screen(const video_rect_t *r);
+static void transfer_dirty(void);
+static void convert_row(uint8_t *dest, const uint8_t *src, uint16_t count,
+                        bool nontemporal);
+static void flip_retarget(void);
+static void wait_retrace(void);
+
 // Sets up the video framebuffer settings
 void video_init(framebuffer_info_t *pFrame_buffer_info) {
   framebuffer_info = *pFrame_buffer_info;
-  flags |= (FLAGS_INIT & 1);
+
+  // Build the pixel format descriptor once
+  video_format.bytes_pp = (BPP + 7) >> 3;
+  video_format.red_shift = framebuffer_info.red_pos;
+  video_format.red_loss = 8 - framebuffer_info.red_mask_size;
+  video_format.green_shift = framebuffer_info.green_pos;
+  video_format.green_loss = 8 - framebuffer_info.green_mask_size;
+  video_format.blue_shift = framebuffer_info.blue_pos;
+  video_format.blue_loss = 8 - framebuffer_info.blue_mask_size;
+  video_format.palette = 0;
+
+  // Glyph rows are drawn through the expansion table
+  kernel_init_glyph_masks();
+
+  switch (BPP) {
+  case 32:
+    video_format.ops = &ops32;
+    break;
+  case 24:
+    video_format.ops = &ops24;
+    break;
+  default:
+    video_format.ops = &ops16;
+    break;
+  }
+
+  // Sprites in ARGB can be copied as is when the layout matches
+  video_format.xrgb8888 = BPP == 32 && video_format.red_shift == 16 &&
+                          video_format.green_shift == 8 &&
+                          video_format.blue_shift == 0;
+  hw_format = video_format;
+
+  // Palette entries are kept across modes, only their packing changes
+  for (uint16_t i = 0; i < PALETTE_SIZE; ++i)
+    palette_packed[i] = pack_hw(palette[i]);
+
+  video_target.addr = (uint8_t *)(uintptr_t)framebuffer_info.addr;
+  video_target.pitch = framebuffer_info.pitch;
+  video_target.width = framebuffer_info.width;
+  video_target.height = framebuffer_info.height;
+  video_target.is_framebuffer = true;
+  video_reset_clip();
+
+  screen_width = framebuffer_info.width;
+  screen_height = framebuffer_info.height;
+  scale = 1;
+  view_x = 0;
+  view_y = 0;
+
+  // A new mode starts without back buffer, page flipping or scaling
+  flags = FLAGS_INIT;
+  virtio_display = false;
+  offscreen_depth = 0;
+  dirty_count = 0;
+  video_cursor_reset();
 }
 
-// Clear video framebuffer
-void clear_screen(color_t color) {
-  uint8_t bpp = framebuffer_info.bitsPerPixel;
-  volatile uint8_t *base_addr =
-      (volatile uint8_t *)(uintptr_t)framebuffer_info.addr;
-  uint32_t total_pixels = framebuffer_info.width * framebuffer_info.height;
-
-  // Handle different bits per pixels
-  switch (bpp) {
-  case 32: {
-    uint32_t packed_col = (color.r << framebuffer_info.red_pos) |
-                          (color.g << framebuffer_info.green_pos) |
-                          (color.b << framebuffer_info.blue_pos);
-
-    // Treat the framebuffer as a linear array of 32-bit integers
-    volatile uint32_t *dest = (volatile uint32_t *)base_addr;
-
-    // Optimization: Process 4 pixels at a time (Loop Unrolling)
-    uint32_t count = total_pixels;
-    while (count >= 4) {
-      dest[0] = packed_col;
-      dest[1] = packed_col;
-      dest[2] = packed_col;
-      dest[3] = packed_col;
-      dest += 4;
-      count -= 4;
+// Draw into a virtio-gpu scanout resource instead of the boot framebuffer
+int8_t video_init_virtio_gpu(void) {
+  if (virtio_gpu_init() != 0)
+    return -1;
+
+  framebuffer_info_t info = {
+      .addr = (uintptr_t)virtio_gpu_framebuffer(),
+      .pitch = virtio_gpu_width() * 4,
+      .width = virtio_gpu_width(),
+      .height = virtio_gpu_height(),
+      .bitsPerPixel = 32,
+      .red_pos = 16,
+      .red_mask_size = 8,
+      .green_pos = 8,
+      .green_mask_size = 8,
+      .blue_pos = 0,
+      .blue_mask_size = 8,
+  };
+  video_init(&info);
+  virtio_display = true;
+  return 0;
+}
+
+// Pack a color into the native pixel layout
+// Shifting right by the channel loss scales the 8-bit color down to hardware
+// depth
+pixel_t video_pack_color(color_t color) {
+  const pixel_format_t *f = &video_format;
+  if (f->palette)
+    return nearest_entry(color);
+
+  return ((pixel_t)(color.r >> f->red_loss) << f->red_shift) |
+         ((pixel_t)(color.g >> f->green_loss) << f->green_shift) |
+         ((pixel_t)(color.b >> f->blue_loss) << f->blue_shift);
+}
+
+// Restrict drawing to a rectangle
+void video_set_clip(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  uint32_t x1 = (uint32_t)x + w;
+  uint32_t y1 = (uint32_t)y + h;
+
+  video_target.clip_x0 = x < video_target.width ? x : video_target.width;
+  video_target.clip_y0 = y < video_target.height ? y : video_target.height;
+  video_target.clip_x1 = x1 < video_target.width ? x1 : video_target.width;
+  video_target.clip_y1 = y1 < video_target.height ? y1 : video_target.height;
+}
+
+// Allow drawing anywhere on the screen again
+void video_reset_clip(void) {
+  video_set_clip(0, 0, video_target.width, video_target.height);
+}
+
+// Switch drawing into a RAM back buffer
+int8_t video_enable_back_buffer(void) {
+  if (flags & FLAGS_BACK_BUFFER)
+    return 0;
+  if (flags & (FLAGS_PAGE_FLIP | FLAGS_INDEXED))
+    return -1;
+
+  // XRGB8888 rows, 16-byte aligned so they can be processed with wide stores
+  uint32_t row_bytes = screen_width * 4;
+  uint32_t pitch = (row_bytes + 15) & ~15U;
+  uint32_t size = pitch * screen_height;
+
+  // A buffer from an earlier mode is reused
+  uint8_t *buffer = back_buffer;
+  if (size > back_capacity) {
+    buffer = mem_alloc(size, 16);
+    if (buffer == 0)
+      return -1;
+    back_capacity = size;
+  }
+
+  // Pick the conversion run at present time
+  const pixel_format_t *hw = &hw_format;
+  if (hw->xrgb8888)
+    present_mode = PRESENT_COPY;
+  else if (hw->bytes_pp == 2 && hw->red_shift == 11 && hw->green_shift == 5 &&
+           hw->green_loss == 2 && hw->blue_shift == 0)
+    present_mode = PRESENT_RGB565;
+  else if (hw->bytes_pp == 2 && hw->red_shift == 10 && hw->green_shift == 5 &&
+           hw->green_loss == 3 && hw->blue_shift == 0)
+    present_mode = PRESENT_RGB555;
+  else if (hw->bytes_pp == 3 && hw->red_shift == 16 && hw->green_shift == 8 &&
+           hw->blue_shift == 0 && hw->red_loss == 0)
+    present_mode = PRESENT_RGB888;
+  else
+    present_mode = PRESENT_GENERIC;
+
+  // Seed with what is on screen so nothing is lost on the first present,
+  // without the cursors on it
+  video_cursor_park((video_rect_t){0, 0, framebuffer_info.width,
+                                   framebuffer_info.height});
+  uint8_t *lfb = (uint8_t *)(uintptr_t)framebuffer_info.addr;
+  for (uint32_t y = 0; y < screen_height; ++y) {
+    uint8_t *src = lfb + y * framebuffer_info.pitch;
+    uint32_t *dest = (uint32_t *)(buffer + y * pitch);
+
+    if (present_mode == PRESENT_COPY) {
+      kernel_copy_row((uint8_t *)dest, src, row_bytes, false);
+      continue;
     }
-    // Handle remaining pixels
-    while (count--) {
-      *dest++ = packed_col;
+    for (uint32_t x = 0; x < screen_width; ++x) {
+      dest[x] = pixel_to_xrgb(src, hw);
+      src += hw->bytes_pp;
     }
-    break;
   }
 
-  case 24: {
-    // 24bpp must be written byte-by-byte as pixels are 3 bytes wide
-    for (uint32_t i = 0; i < total_pixels; ++i) {
-      base_addr[i * 3 + 0] = color.b;
-      base_addr[i * 3 + 1] = color.g;
-      base_addr[i * 3 + 2] = color.r;
+  back_buffer = buffer;
+  back_pitch = pitch;
+  video_target.addr = buffer;
+  video_target.pitch = pitch;
+  video_target.is_framebuffer = false;
+  use_canonical_format();
+  dirty_count = 0;
+  flags |= FLAGS_BACK_BUFFER;
+  video_cursor_redraw();
+  return 0;
+}
+
+// Switch drawing into a back buffer of palette indices
+int8_t video_enable_indexed(void) {
+  if (flags & FLAGS_INDEXED)
+    return 0;
+  if (!(flags & FLAGS_INIT) || (flags & FLAGS_PAGE_FLIP))
+    return -1;
+
+  uint32_t pitch = (screen_width + 15) & ~15U;
+  uint32_t size = pitch * screen_height;
+  uint8_t *buffer = indexed_buffer;
+  if (size > indexed_capacity) {
+    buffer = mem_alloc(size, 16);
+    if (buffer == 0)
+      return -1;
+    indexed_capacity = size;
+  }
+
+  if (!palette_ready)
+    default_palette();
+
+  // Seed from what is drawn so far, the back buffer if there is one. Screens
+  // hold few distinct colors, so the nearest match is mostly cached
+  video_cursor_park((video_rect_t){0, 0, framebuffer_info.width,
+                                   framebuffer_info.height});
+  for (uint32_t y = 0; y < screen_height; ++y) {
+    const uint8_t *src = video_target.addr + y * video_target.pitch;
+    uint8_t *dest = buffer + y * pitch;
+    for (uint32_t x = 0; x < screen_width; ++x) {
+      uint32_t p = pixel_to_xrgb(src, &video_format);
+      dest[x] = nearest_entry(COLOR(p >> 16, (p >> 8) & 0xFF, p & 0xFF));
+      src += video_format.bytes_pp;
     }
-    break;
   }
 
-  case 16: {
-    uint16_t packed_col =
-        (uint16_t)(((color.r >> (8 - framebuffer_info.red_mask_size))
-                    << framebuffer_info.red_pos) |
-                   ((color.g >> (8 - framebuffer_info.green_mask_size))
-                    << framebuffer_info.green_pos) |
-                   ((color.b >> (8 - framebuffer_info.blue_mask_size))
-                    << framebuffer_info.blue_pos));
+  indexed_buffer = buffer;
+  indexed_pitch = pitch;
+  video_target.addr = buffer;
+  video_target.pitch = pitch;
+  video_target.is_framebuffer = false;
+  use_indexed_format();
+  flags |= FLAGS_INDEXED;
+
+  // The palette may not hold the screen's exact colors
+  dirty_count = 0;
+  video_mark_dirty(0, 0, screen_width, screen_height);
+  video_cursor_redraw();
+  return 0;
+}
+
+// Rewrite palette entries, indexed pixels pick up the change on present
+void video_set_palette(uint8_t first, uint16_t count, const color_t *colors) {
+  if (!palette_ready)
+    default_palette();
+  if (count > PALETTE_SIZE - first)
+    count = PALETTE_SIZE - first;
+
+  for (uint16_t i = 0; i < count; ++i) {
+    uint32_t xrgb = ((uint32_t)colors[i].r << 16) | (colors[i].g << 8) |
+                    colors[i].b;
+    palette[first + i] = xrgb;
+    palette_packed[first + i] = pack_hw(xrgb);
+  }
+
+  // Nearest matches are stale
+  for (uint16_t i = 0; i < NEAREST_CACHE_SIZE; ++i)
+    nearest_keys[i] = 0;
+
+  if (flags & FLAGS_INDEXED)
+    video_mark_dirty(0, 0, screen_width, screen_height);
+}
+
+// Palette packed for whatever is being drawn into
+const pixel_t *video_palette_pixels(void) {
+  if (!palette_ready)
+    default_palette();
+  if (video_format.palette)
+    return 0;
+  if (video_format.xrgb8888)
+    return palette;
+  return palette_packed;
+}
+
+// Draw at a lower resolution and scale it up on present
+int8_t video_set_internal_resolution(uint16_t width, uint16_t height) {
+  if (!(flags & FLAGS_INIT) || (flags & FLAGS_PAGE_FLIP) || width == 0 ||
+      height == 0 || width > framebuffer_info.width ||
+      height > framebuffer_info.height)
+    return -1;
+
+  uint32_t factor_x = framebuffer_info.width / width;
+  uint32_t factor_y = framebuffer_info.height / height;
+  uint8_t factor = factor_x < factor_y ? factor_x : factor_y;
+  if (factor_x > MAX_SCALE && factor_y > MAX_SCALE)
+    factor = MAX_SCALE;
+
+  // One row in the screen layout and one widened row of the whole screen
+  uint32_t row_bytes = ((uint32_t)width * 4 + 15) & ~15U;
+  uint32_t size = row_bytes + framebuffer_info.width * 4;
+  if (factor > 1 && size > scale_capacity) {
+    uint8_t *rows = mem_alloc(size, 16);
+    if (rows == 0)
+      return -1;
+    scale_row = rows;
+    scale_capacity = size;
+  }
+  if (factor > 1)
+    scale_wide = scale_row + row_bytes;
+
+  // Black borders around the picture, and a black picture to start with.
+  // Cursors are drawn again over it
+  video_cursor_reset();
+  fill_pattern_t black;
+  kernel_make_pattern(&black, 0, hw_format.bytes_pp);
+  uint8_t *lfb = (uint8_t *)(uintptr_t)framebuffer_info.addr;
+  for (uint32_t y = 0; y < framebuffer_info.height; ++y) {
+    kernel_fill_row(lfb + y * framebuffer_info.pitch,
+                    framebuffer_info.width * hw_format.bytes_pp, &black,
+                    video_probe_result.stream_fills);
+  }
+  if (virtio_display) {
+    virtio_gpu_transfer(0, 0, framebuffer_info.width, framebuffer_info.height);
+    virtio_gpu_flush(0, 0, framebuffer_info.width, framebuffer_info.height);
+  }
+
+  // The back buffer is set up again at the new size, seeded from the
+  // cleared screen
+  bool indexed = flags & FLAGS_INDEXED;
+  flags &= ~(FLAGS_BACK_BUFFER | FLAGS_INDEXED | FLAGS_SCALED);
+  if (width != framebuffer_info.width || height != framebuffer_info.height)
+    flags |= FLAGS_SCALED;
+
+  screen_width = width;
+  screen_height = height;
+  scale = factor;
+  view_x = (framebuffer_info.width - width * factor) / 2;
+  view_y = (framebuffer_info.height - height * factor) / 2;
+
+  video_format = hw_format;
+  video_target.addr = lfb;
+  video_target.pitch = framebuffer_info.pitch;
+  video_target.width = width;
+  video_target.height = height;
+  video_target.is_framebuffer = true;
+  video_reset_clip();
+  dirty_count = 0;
+
+  return indexed ? video_enable_indexed() : video_enable_back_buffer();
+}
+
+uint16_t video_width(void) { return screen_width; }
+
+uint16_t video_height(void) { return screen_height; }
+
+// Change the display mode through the Bochs/QEMU VBE adapter
+int8_t video_set_mode(uint16_t width, uint16_t height, uint8_t bpp) {
+  if (virtio_display || bga_detect() == 0)
+    return -1;
+
+  // Without PCI, the framebuffer from the bootloader is the same memory
+  uint32_t lfb = bga_framebuffer_addr();
+  if (lfb == 0) {
+    if (!(flags & FLAGS_INIT))
+      return -1;
+    lfb = (uint32_t)framebuffer_info.addr;
+  }
+
+  if (flags & FLAGS_PAGE_FLIP)
+    video_disable_page_flip();
+
+  if (bga_set_mode(width, height, bpp) != 0)
+    return -1;
+
+  // The adapter uses fixed channel layouts
+  framebuffer_info_t info = {
+      .addr = lfb,
+      .pitch = bga_virtual_width() * ((bpp + 7) >> 3),
+      .width = width,
+      .height = height,
+      .bitsPerPixel = bpp,
+      .red_pos = bpp == 15 ? 10 : (bpp == 16 ? 11 : 16),
+      .red_mask_size = bpp <= 16 ? 5 : 8,
+      .green_pos = bpp <= 16 ? 5 : 8,
+      .green_mask_size = bpp == 15 ? 5 : (bpp == 16 ? 6 : 8),
+      .blue_pos = 0,
+      .blue_mask_size = bpp <= 16 ? 5 : 8,
+  };
+
+  bool back = flags & FLAGS_BACK_BUFFER;
+  bool indexed = flags & FLAGS_INDEXED;
+  video_init(&info);
+
+  if (back && video_enable_back_buffer() != 0)
+    return -1;
+  if (indexed)
+    return video_enable_indexed();
+  return 0;
+}
+
+// Keep 'pages' screens in video memory and draw into a hidden one
+int8_t video_enable_page_flip(uint8_t pages) {
+  if (!(flags & FLAGS_INIT) || (flags & (FLAGS_INDEXED | FLAGS_SCALED)) ||
+      virtio_display || pages < 2 || pages > 3 || bga_detect() == 0)
+    return -1;
 
-    volatile uint16_t *dest = (volatile uint16_t *)base_addr;
-    for (uint32_t i = 0; i < total_pixels; ++i) {
-      dest[i] = packed_col;
+  // The Y offset can only reach rows inside the virtual screen
+  uint32_t rows = (uint32_t)framebuffer_info.height * pages;
+  if (bga_virtual_height() < rows)
+    return -1;
+
+  // Cursors would have to be drawn on every page, they wait for page 0
+  video_cursor_park((video_rect_t){0, 0, framebuffer_info.width,
+                                   framebuffer_info.height});
+
+  flip_pages = pages;
+  flip_page = 1;
+  flags |= FLAGS_PAGE_FLIP;
+
+  // Pages are scanned out directly, so they are drawn in the hardware layout
+  video_format = hw_format;
+  flip_retarget();
+  return 0;
+}
+
+// Show page 0 again and draw where drawing went before flipping
+void video_disable_page_flip(void) {
+  if (!(flags & FLAGS_PAGE_FLIP))
+    return;
+
+  bga_set_y_offset(0);
+  flags &= ~FLAGS_PAGE_FLIP;
+
+  if (flags & FLAGS_BACK_BUFFER) {
+    video_target.addr = back_buffer;
+    video_target.pitch = back_pitch;
+    video_target.is_framebuffer = false;
+    use_canonical_format();
+
+    // Page 0 holds an older frame, present everything once
+    dirty_count = 0;
+    video_mark_dirty(0, 0, screen_width, screen_height);
+  } else {
+    video_target.addr = (uint8_t *)(uintptr_t)framebuffer_info.addr;
+    video_target.pitch = framebuffer_info.pitch;
+    video_target.is_framebuffer = true;
+  }
+  video_cursor_redraw();
+}
+
+// Copy damaged regions of the back buffer to the framebuffer, or flip pages.
+// A virtio-gpu framebuffer then has the same regions transferred to the host
+void video_present(void) {
+  if (flags & FLAGS_PAGE_FLIP) {
+    // With only two pages the next one is still on screen until the retrace
+    if (flip_pages == 2)
+      wait_retrace();
+
+    bga_set_y_offset(flip_page * framebuffer_info.height);
+    flip_page = (flip_page + 1) % flip_pages;
+    flip_retarget();
+    return;
+  }
+
+  bool back = flags & (FLAGS_BACK_BUFFER | FLAGS_INDEXED);
+  if (!back && !virtio_display) {
+    video_cursor_redraw();
+    return;
+  }
+
+  // Many narrow rects can cost more than the whole frame in long rows
+  uint32_t overhead = video_probe_result.row_overhead;
+  if (back && overhead != 0 && dirty_count > 1) {
+    uint32_t row_scale = scale * hw_format.bytes_pp;
+    uint32_t full = screen_height * (overhead + screen_width * row_scale);
+    uint32_t cost = 0;
+    for (uint8_t i = 0; i < dirty_count && cost < full; ++i)
+      cost += dirty_rects[i].h * (overhead + dirty_rects[i].w * row_scale);
+
+    if (cost >= full) {
+      dirty_rects[0] = (video_rect_t){0, 0, screen_width, screen_height};
+      dirty_count = 1;
     }
-    break;
   }
+
+  // Cursors come off what is copied and go back on top, each pixel is
+  // converted once per frame, however often it was drawn. Suspending keeps
+  // console output from an interrupt from drawing them in between
+  if (back) {
+    video_cursor_suspend();
+    for (uint8_t i = 0; i < dirty_count; ++i)
+      video_cursor_park(to_screen(&dirty_rects[i]));
+    for (uint8_t i = 0; i < dirty_count; ++i)
+      present_rect(&dirty_rects[i]);
+    video_cursor_resume();
+  } else {
+    video_cursor_redraw();
+  }
+
+  if (virtio_display)
+    transfer_dirty();
+  dirty_count = 0;
+}
+
+// Clear video framebuffer
+void clear_screen(color_t color) {
+  video_fill_rect(0, 0, video_target.width, video_target.height, color);
+}
+
+// Fill a rectangle, clipped to the clip rect
+void video_fill_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                     color_t color) {
+  video_fill(x, y, w, h, video_pack_color(color));
+}
+
+// Fill a rectangle with a pre-packed pixel
+void video_fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                pixel_t pixel) {
+  uint32_t x0 = x > video_target.clip_x0 ? x : video_target.clip_x0;
+  uint32_t y0 = y > video_target.clip_y0 ? y : video_target.clip_y0;
+  uint32_t x1 = (uint32_t)x + w;
+  uint32_t y1 = (uint32_t)y + h;
+  if (x1 > video_target.clip_x1)
+    x1 = video_target.clip_x1;
+  if (y1 > video_target.clip_y1)
+    y1 = video_target.clip_y1;
+
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  x = x0;
+  y = y0;
+  w = x1 - x0;
+  h = y1 - y0;
+
+  uint32_t row_bytes = w * video_format.bytes_pp;
+  uint8_t *dest = target_pixel(x, y);
+
+  fill_pattern_t pattern;
+  kernel_make_pattern(&pattern, pixel, video_format.bytes_pp);
+
+  // Large fills straight to the framebuffer bypass the cache, unless the
+  // probe found cached stores faster
+  bool nontemporal = video_target.is_framebuffer &&
+                     video_probe_result.stream_fills &&
+                     (uint32_t)row_bytes * h >= 4096;
+
+  for (uint16_t row = 0; row < h; ++row) {
+    kernel_fill_row(dest, row_bytes, &pattern, nontemporal);
+    dest += video_target.pitch;
+  }
+
+  video_mark_dirty(x, y, w, h);
+}
+
+// Scroll a full-width band of rows up
+void video_scroll_up(uint16_t y, uint16_t h, uint16_t dy, pixel_t fill) {
+  uint16_t width = video_target.width;
+  if (y >= video_target.height) {
+    return;
+  }
+  if (h > video_target.height - y)
+    h = video_target.height - y;
+
+  // Everything scrolls out of view, nothing to move
+  if (dy >= h) {
+    video_fill(0, y, width, h, fill);
+    return;
   }
+
+  // Full-width rows are contiguous, so the band moves in one bulk copy
+  uint8_t *top = video_target.addr + (y * video_target.pitch);
+  memmove(top, top + (dy * video_target.pitch),
+          (uint32_t)(h - dy) * video_target.pitch);
+  video_mark_dirty(0, y, width, h - dy);
+
+  // Only the exposed rows at the bottom need clearing
+  video_fill(0, y + h - dy, width, dy, fill);
 }
 
 // Draw pixel to screen
 void video_draw_pixel(uint16_t x, uint16_t y, color_t color) {
-  // Calculate address
-  uint8_t bpp = framebuffer_info.bitsPerPixel;
-  volatile uint8_t *pixel_addr =
-      (volatile uint8_t *)(uintptr_t)framebuffer_info.addr +
-      (y * framebuffer_info.pitch) + (x * (bpp >> 3));
-
-  // Re-pack color based on hardware masks
-  // Shifting right by (8 - mask_size) scales the 8-bit color down to hardware
-  // depth
-  uint32_t packed_color =
-      ((uint32_t)(color.r >> (8 - framebuffer_info.red_mask_size))
-       << framebuffer_info.red_pos) |
-      ((uint32_t)(color.g >> (8 - framebuffer_info.green_mask_size))
-       << framebuffer_info.green_pos) |
-      ((uint32_t)(color.b >> (8 - framebuffer_info.blue_mask_size))
-       << framebuffer_info.blue_pos);
-
-  // Handle different cases for different modes
-
-  if (bpp == 32) {
-    *(volatile uint32_t *)pixel_addr = packed_color;
-  } else if (bpp == 16 || bpp == 15) {
-    *(volatile uint16_t *)pixel_addr = (uint16_t)packed_color;
-  } else if (bpp == 24) {
-    // 24-bit is rare but dangerous; must write 3 bytes to avoid buffer overflow
-    pixel_addr[0] = (packed_color >> 0) & 0xFF;
-    pixel_addr[1] = (packed_color >> 8) & 0xFF;
-    pixel_addr[2] = (packed_color >> 16) & 0xFF;
-  }
-}
-
-// Draw character to screen
-void video_draw_char(char c, uint16_t x, uint16_t y, color_t color) {
-  // Safety Bounds Check: Ensure we don't draw outside the framebuffer
-  // 8U -> So that x is casted up to int before adding
-  if (x + 8U > framebuffer_info.width || y + 8U > framebuffer_info.height) {
+  video_plot(x, y, video_pack_color(color));
+}
+
+// Plot a pre-packed pixel
+void video_plot(uint16_t x, uint16_t y, pixel_t pixel) {
+  if (x >= video_target.width || y >= video_target.height) {
     return;
   }
-  if (c == ' ') {
-    return video_clear_char(x, y, color);
-  }
-
-  uint8_t *glyph = font8x8_basic[(uint8_t)c];
-
-  uint8_t bpp = framebuffer_info.bitsPerPixel;
-
-  // Calculate base byte address once for all modes
-  uint8_t *base_addr = (uint8_t *)(uintptr_t)framebuffer_info.addr +
-                       (y * framebuffer_info.pitch) + (x * (bpp >> 3));
-
-  switch (bpp) {
-  case 32: {
-    // 32bpp (True Color / Aligned)
-    volatile uint32_t *dest = (volatile uint32_t *)base_addr;
-    uint32_t stride = framebuffer_info.pitch >> 2; // Pixel-stride
-
-    uint32_t packed_col = (color.r << framebuffer_info.red_pos) |
-                          (color.g << framebuffer_info.green_pos) |
-                          (color.b << framebuffer_info.blue_pos);
-
-    for (int i = 0; i < 8; i++) {
-      uint8_t row = glyph[i];
-
-      // Calculate current pixel to set or not
-      if ((row >> 0) & 1)
-        dest[0] = packed_col;
-      if ((row >> 1) & 1)
-        dest[1] = packed_col;
-      if ((row >> 2) & 1)
-        dest[2] = packed_col;
-      if ((row >> 3) & 1)
-        dest[3] = packed_col;
-      if ((row >> 4) & 1)
-        dest[4] = packed_col;
-      if ((row >> 5) & 1)
-        dest[5] = packed_col;
-      if ((row >> 6) & 1)
-        dest[6] = packed_col;
-      if ((row >> 7) & 1)
-        dest[7] = packed_col;
-
-      // Add stride to go to next row
-      dest += stride;
+
+  video_format.ops->put_pixel(target_pixel(x, y), pixel);
+  video_mark_dirty(x, y, 1, 1);
+}
+
+// 32bpp (True Color / Aligned)
+static void put_pixel32(uint8_t *dest, pixel_t pixel) {
+  *(uint32_t *)dest = pixel;
+}
+
+static void draw_glyph32(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque) {
+  kernel_glyph32(dest, pitch, glyph, FONT_HEIGHT, fg, bg, opaque);
+}
+
+// 24bpp (Packed Pixels / Unaligned)
+static void put_pixel24(uint8_t *dest, pixel_t pixel) {
+  // Must write 3 bytes to avoid buffer overflow
+  dest[0] = (pixel >> 0) & 0xFF;
+  dest[1] = (pixel >> 8) & 0xFF;
+  dest[2] = (pixel >> 16) & 0xFF;
+}
+
+static void draw_glyph24(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque) {
+  for (int i = 0; i < FONT_HEIGHT; i++) {
+    const uint32_t *mask = kernel_glyph_mask(glyph[i]);
+
+    // Select between fg and the old (or bg) pixel without branching
+    for (int col = 0; col < 8; col++) {
+      uint8_t *p = dest + col * 3;
+      pixel_t under =
+          opaque ? bg : (pixel_t)(p[0] | (p[1] << 8) | (p[2] << 16));
+      put_pixel24(p, (fg & mask[col]) | (under & ~mask[col]));
     }
-    break;
+    dest += pitch;
   }
+}
+
+// 16bpp and 15bpp (High Color / Aligned)
+static void put_pixel16(uint8_t *dest, pixel_t pixel) {
+  *(uint16_t *)dest = (uint16_t)pixel;
+}
+
+static void draw_glyph16(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                         pixel_t fg, pixel_t bg, bool opaque) {
+  kernel_glyph16(dest, pitch, glyph, FONT_HEIGHT, (uint16_t)fg, (uint16_t)bg,
+                 opaque);
+}
 
-  case 16: {
-    // 16bpp (High Color / Aligned)
-    volatile uint16_t *dest = (volatile uint16_t *)base_addr;
-    uint32_t stride = framebuffer_info.pitch >> 1; // Pixel-stride
-
-    uint16_t col = (uint16_t)((((color.r >> 16) & 0xFF) >>
-                               (8 - framebuffer_info.red_mask_size)
-                                   << framebuffer_info.red_pos) |
-                              (((color.g >> 8) & 0xFF) >>
-                               (8 - framebuffer_info.green_mask_size)
-                                   << framebuffer_info.green_pos) |
-                              (((color.b >> 0) & 0xFF) >>
-                               (8 - framebuffer_info.blue_mask_size)
-                                   << framebuffer_info.blue_pos));
-
-    for (int i = 0; i < 8; i++) {
-      uint8_t row = glyph[i];
-      if ((row >> 0) & 1)
-        dest[0] = col;
-      if ((row >> 1) & 1)
-        dest[1] = col;
-      if ((row >> 2) & 1)
-        dest[2] = col;
-      if ((row >> 3) & 1)
-        dest[3] = col;
-      if ((row >> 4) & 1)
-        dest[4] = col;
-      if ((row >> 5) & 1)
-        dest[5] = col;
-      if ((row >> 6) & 1)
-        dest[6] = col;
-      if ((row >> 7) & 1)
-        dest[7] = col;
-
-      // Go to next row
-      dest += stride;
+// 8bpp (Palette indices)
+static void put_pixel8(uint8_t *dest, pixel_t pixel) {
+  *dest = (uint8_t)pixel;
+}
+
+static void draw_glyph8(uint8_t *dest, uint32_t pitch, const uint8_t *glyph,
+                        pixel_t fg, pixel_t bg, bool opaque) {
+  for (int i = 0; i < FONT_HEIGHT; i++) {
+    const uint32_t *mask = kernel_glyph_mask(glyph[i]);
+
+    for (int col = 0; col < 8; col++) {
+      pixel_t under = opaque ? bg : dest[col];
+      dest[col] = (uint8_t)((fg & mask[col]) | (under & ~mask[col]));
     }
-    break;
+    dest += pitch;
   }
+}
 
-  case 24: {
-    // 24bpp (Packed Pixels / Unaligned)
-    volatile uint8_t *dest = (volatile uint8_t *)base_addr;
+// Smallest rect covering both a and b
+static video_rect_t rect_union(video_rect_t a, video_rect_t b) {
+  uint16_t x0 = a.x < b.x ? a.x : b.x;
+  uint16_t y0 = a.y < b.y ? a.y : b.y;
+  uint16_t x1 = (a.x + a.w) > (b.x + b.w) ? (a.x + a.w) : (b.x + b.w);
+  uint16_t y1 = (a.y + a.h) > (b.y + b.h) ? (a.y + a.h) : (b.y + b.h);
+  return (video_rect_t){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+}
 
-    for (int i = 0; i < 8; i++) {
-      uint8_t row = glyph[i];
-      for (int col = 0; col < 8; col++) {
-        uint8_t mask = (row >> col) & 1;
+// Record a damaged region so the next present copies it to the screen
+void video_mark_dirty(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  // Off-screen damage only matters to whoever owns the memory
+  if (flags & FLAGS_OFFSCREEN) {
+    if (video_target.damage)
+      video_target.damage(video_target.damage_context, x, y, w, h);
+    return;
+  }
+  if (!(flags & (FLAGS_BACK_BUFFER | FLAGS_INDEXED)) && !virtio_display)
+    return;
+  if (flags & FLAGS_PAGE_FLIP)
+    return;
+
+  video_damage_add(dirty_rects, &dirty_count, MAX_DIRTY_RECTS,
+                   (video_rect_t){.x = x, .y = y, .w = w, .h = h});
+}
+
+// Merge a rect into a damage list
+void video_damage_add(video_rect_t *rects, uint8_t *count, uint8_t max,
+                      video_rect_t rect) {
+  uint32_t rect_area = (uint32_t)rect.w * rect.h;
+  uint8_t best = 0;
+  uint32_t best_growth = UINT32_MAX;
+
+  // Newest rects are the likeliest neighbours, so walk the list backwards
+  for (uint8_t i = *count; i-- > 0;) {
+    video_rect_t merged = rect_union(rects[i], rect);
+    uint32_t merged_area = (uint32_t)merged.w * merged.h;
+    uint32_t old_area = (uint32_t)rects[i].w * rects[i].h;
 
-        if (mask) {
-          dest[col * 3 + 0] = color.b;
-          dest[col * 3 + 1] = color.g;
-          dest[col * 3 + 2] = color.r;
-        }
-      }
-      dest += framebuffer_info.pitch;
+    // Merge when the union covers no more than the two rects would
+    if (merged_area <= old_area + rect_area) {
+      rects[i] = merged;
+      return;
+    }
+
+    if (merged_area - old_area < best_growth) {
+      best_growth = merged_area - old_area;
+      best = i;
     }
-    break;
   }
+
+  if (*count < max) {
+    rects[(*count)++] = rect;
+    return;
+  }
+
+  // List is full, grow whichever rect absorbs this one most cheaply
+  rects[best] = rect_union(rects[best], rect);
+}
+
+// Copy a row into the framebuffer with the kernel the probe picked
+void video_copy_to_screen(uint8_t *dest, const uint8_t *src, uint32_t bytes) {
+  switch (video_probe_result.copy) {
+  case VIDEO_COPY_REP:
+    kernel_copy_row_rep(dest, src, bytes);
+    break;
+  case VIDEO_COPY_SSE:
+    kernel_copy_row(dest, src, bytes, false);
+    break;
+  default:
+    kernel_copy_row(dest, src, bytes, true);
+    break;
   }
 }
 
-void video_clear_char(uint16_t x, uint16_t y,
-                      color_t color) { // Safety Bounds Check: Ensure we don't
-                                       // draw outside the framebuffer
-  // 8U -> So that x is casted up to int before adding
-  if (x + 8U > framebuffer_info.width || y + 8U > framebuffer_info.height) {
+// Point drawing at caller memory until video_end_offscreen()
+int8_t video_begin_offscreen(uint8_t *addr, uint32_t pitch, uint16_t width,
+                             uint16_t height) {
+  if (offscreen_depth == MAX_OFFSCREEN)
+    return -1;
+
+  saved_targets[offscreen_depth++] = video_target;
+  video_target = (draw_target_t){
+      .addr = addr,
+      .pitch = pitch,
+      .width = width,
+      .height = height,
+      .clip_x1 = width,
+      .clip_y1 = height,
+      .is_framebuffer = false,
+  };
+  flags |= FLAGS_OFFSCREEN;
+  return 0;
+}
+
+void video_end_offscreen(void) {
+  if (offscreen_depth == 0)
     return;
+
+  video_target = saved_targets[--offscreen_depth];
+  if (offscreen_depth == 0)
+    flags &= ~FLAGS_OFFSCREEN;
+}
+
+// Memory the screen is showing
+const uint8_t *video_visible_frame(uint32_t *pitch,
+                                   const pixel_format_t **format) {
+  if (!(flags & FLAGS_INIT))
+    return 0;
+
+  const uint8_t *lfb = (const uint8_t *)(uintptr_t)framebuffer_info.addr;
+  if (flags & FLAGS_PAGE_FLIP) {
+    // The page before the one being drawn is on screen
+    uint8_t shown = (flip_page + flip_pages - 1) % flip_pages;
+    *pitch = framebuffer_info.pitch;
+    *format = &hw_format;
+    return lfb + shown * framebuffer_info.height * framebuffer_info.pitch;
+  }
+
+  // Presented back buffer contents match the screen and are cheap to read,
+  // and hold the picture before it is scaled up. The losses tell how many
+  // low bits the screen drops when presenting
+  static pixel_format_t presented;
+  presented = (pixel_format_t){
+      .red_loss = hw_format.red_loss,
+      .green_loss = hw_format.green_loss,
+      .blue_loss = hw_format.blue_loss,
+  };
+  if (flags & FLAGS_INDEXED) {
+    presented.bytes_pp = 1;
+    presented.palette = palette;
+    *pitch = indexed_pitch;
+    *format = &presented;
+    return indexed_buffer;
+  }
+  if (flags & FLAGS_BACK_BUFFER) {
+    presented.bytes_pp = 4;
+    presented.red_shift = 16;
+    presented.green_shift = 8;
+    presented.xrgb8888 = true;
+    *pitch = back_pitch;
+    *format = &presented;
+    return back_buffer;
   }
-  uint8_t bpp = framebuffer_info.bitsPerPixel;
-
-  // Calculate base byte address once for all modes
-  uint8_t *base_addr = (uint8_t *)(uintptr_t)framebuffer_info.addr +
-                       (y * framebuffer_info.pitch) + (x * (bpp >> 3));
-
-  switch (bpp) {
-  case 32: {
-    // 32bpp (True Color / Aligned)
-    volatile uint32_t *dest = (volatile uint32_t *)base_addr;
-    uint32_t stride = framebuffer_info.pitch >> 2; // Pixel-stride
-
-    uint32_t packed_col = (color.r << framebuffer_info.red_pos) |
-                          (color.g << framebuffer_info.green_pos) |
-                          (color.b << framebuffer_info.blue_pos);
-
-    for (int i = 0; i < 8; i++) {
-      dest[0] = packed_col;
-      dest[1] = packed_col;
-      dest[2] = packed_col;
-      dest[3] = packed_col;
-      dest[4] = packed_col;
-      dest[5] = packed_col;
-      dest[6] = packed_col;
-      dest[7] = packed_col;
-      dest += stride;
+
+  *pitch = framebuffer_info.pitch;
+  *format = &hw_format;
+  return lfb;
+}
+
+// Framebuffer and picture placement for the cursors
+const video_screen_t *video_screen(void) {
+  if (!(flags & FLAGS_INIT) || (flags & FLAGS_PAGE_FLIP))
+    return 0;
+
+  static video_screen_t screen;
+  screen = (video_screen_t){
+      .addr = (uint8_t *)(uintptr_t)framebuffer_info.addr,
+      .pitch = framebuffer_info.pitch,
+      .format = &hw_format,
+      .width = framebuffer_info.width,
+      .height = framebuffer_info.height,
+      .view_x = view_x,
+      .view_y = view_y,
+      .view_w = screen_width * scale,
+      .view_h = screen_height * scale,
+      .scale = scale,
+      .direct = !(flags & (FLAGS_BACK_BUFFER | FLAGS_INDEXED)),
+      .virtio = virtio_display,
+  };
+  return &screen;
+}
+
+// Draw in XRGB8888, the back buffer layout
+static void use_canonical_format(void) {
+  video_format = (pixel_format_t){
+      .bytes_pp = 4,
+      .red_shift = 16,
+      .green_shift = 8,
+      .blue_shift = 0,
+      .xrgb8888 = true,
+      .ops = &ops32,
+  };
+}
+
+// Draw palette indices, the indexed back buffer layout
+static void use_indexed_format(void) {
+  video_format = (pixel_format_t){
+      .bytes_pp = 1,
+      .palette = palette,
+      .ops = &ops8,
+  };
+}
+
+// RGB 3-3-2, every channel spread over the full 0 - 255 range
+static void default_palette(void) {
+  palette_ready = true;
+
+  color_t colors[PALETTE_SIZE];
+  for (uint16_t i = 0; i < PALETTE_SIZE; ++i) {
+    colors[i] = COLOR((i >> 5) * 255 / 7, ((i >> 2) & 7) * 255 / 7,
+                      (i & 3) * 85);
+  }
+  video_set_palette(0, PALETTE_SIZE, colors);
+}
+
+// Pack an XRGB8888 color in the framebuffer layout
+static pixel_t pack_hw(uint32_t xrgb) {
+  const pixel_format_t *f = &hw_format;
+  return ((pixel_t)(((xrgb >> 16) & 0xFF) >> f->red_loss) << f->red_shift) |
+         ((pixel_t)(((xrgb >> 8) & 0xFF) >> f->green_loss) << f->green_shift) |
+         ((pixel_t)((xrgb & 0xFF) >> f->blue_loss) << f->blue_shift);
+}
+
+// Palette entry closest to a color by squared distance
+static uint8_t nearest_entry(color_t color) {
+  uint32_t key = (1U << 24) | ((uint32_t)color.r << 16) | (color.g << 8) |
+                 color.b;
+  uint32_t slot = (key * 2654435761U) >> 24;
+  if (nearest_keys[slot] == key)
+    return nearest_index[slot];
+
+  uint8_t best = 0;
+  uint32_t best_distance = UINT32_MAX;
+  for (uint16_t i = 0; i < PALETTE_SIZE; ++i) {
+    int32_t dr = (int32_t)((palette[i] >> 16) & 0xFF) - color.r;
+    int32_t dg = (int32_t)((palette[i] >> 8) & 0xFF) - color.g;
+    int32_t db = (int32_t)(palette[i] & 0xFF) - color.b;
+    uint32_t distance = dr * dr + dg * dg + db * db;
+    if (distance < best_distance) {
+      best_distance = distance;
+      best = i;
     }
-    break;
   }
 
-  case 16: {
-    // 16bpp (High Color / Aligned)
-    volatile uint16_t *dest = (volatile uint16_t *)base_addr;
-    uint32_t stride = framebuffer_info.pitch >> 1; // Pixel-stride
-
-    uint16_t col = (uint16_t)((((color.r >> 16) & 0xFF) >>
-                               (8 - framebuffer_info.red_mask_size)
-                                   << framebuffer_info.red_pos) |
-                              (((color.g >> 8) & 0xFF) >>
-                               (8 - framebuffer_info.green_mask_size)
-                                   << framebuffer_info.green_pos) |
-                              (((color.b >> 0) & 0xFF) >>
-                               (8 - framebuffer_info.blue_mask_size)
-                                   << framebuffer_info.blue_pos));
-
-    for (int i = 0; i < 8; i++) {
-      dest[0] = col;
-      dest[1] = col;
-      dest[2] = col;
-      dest[3] = col;
-      dest[4] = col;
-      dest[5] = col;
-      dest[6] = col;
-      dest[7] = col;
-      dest += stride;
+  nearest_keys[slot] = key;
+  nearest_index[slot] = best;
+  return best;
+}
+
+// Copy one damaged rect to the screen, scaled up by whole pixels
+static void present_rect(const video_rect_t *r) {
+  uint8_t bytes_pp = hw_format.bytes_pp;
+  uint32_t fb_pitch = framebuffer_info.pitch;
+  uint8_t *dest = (uint8_t *)(uintptr_t)framebuffer_info.addr +
+                  (view_y + r->y * scale) * fb_pitch +
+                  (view_x + r->x * scale) * bytes_pp;
+
+  const uint8_t *src = back_buffer + r->y * back_pitch + r->x * 4;
+  uint32_t src_pitch = back_pitch;
+  if (flags & FLAGS_INDEXED) {
+    src = indexed_buffer + r->y * indexed_pitch + r->x;
+    src_pitch = indexed_pitch;
+  }
+
+  for (uint16_t row = 0; row < r->h; ++row, src += src_pitch) {
+    if (scale == 1) {
+      convert_row(dest, src, r->w, true);
+      dest += fb_pitch;
+      continue;
     }
-    break;
+
+    // Converted and widened in RAM once, then streamed to 'scale' rows.
+    // XRGB8888 back buffer rows are widened as they are
+    const uint8_t *row = src;
+    if ((flags & FLAGS_INDEXED) || present_mode != PRESENT_COPY) {
+      convert_row(scale_row, src, r->w, false);
+      row = scale_row;
+    }
+    kernel_scale_row(scale_wide, row, r->w, bytes_pp, scale);
+    for (uint8_t i = 0; i < scale; ++i, dest += fb_pitch)
+      video_copy_to_screen(dest, scale_wide, r->w * scale * bytes_pp);
   }
+}
 
-  case 24: {
-    // 24bpp (Packed Pixels / Unaligned)
-    volatile uint8_t *dest = (volatile uint8_t *)base_addr;
+// Screen pixels a rect of the picture is presented to
+static video_rect_t to_screen(const video_rect_t *r) {
+  return (video_rect_t){view_x + r->x * scale, view_y + r->y * scale,
+                        r->w * scale, r->h * scale};
+}
+
+// Transfer the presented rects to the host in screen pixels, one batch of
+// commands and a single flush of their bounds
+static void transfer_dirty(void) {
+  video_rect_t bounds = {0};
+  for (uint8_t i = 0; i < dirty_count; ++i) {
+    video_rect_t s = to_screen(&dirty_rects[i]);
+    virtio_gpu_transfer(s.x, s.y, s.w, s.h);
+    bounds = i == 0 ? s : rect_union(bounds, s);
+  }
 
-    for (int i = 0; i < 8; i++) {
-      for (int col = 0; col < 8; col++) {
-        dest[col * 3 + 0] = color.b;
-        dest[col * 3 + 1] = color.g;
-        dest[col * 3 + 2] = color.r;
-      }
-      dest += framebuffer_info.pitch;
+  if (dirty_count > 0)
+    virtio_gpu_flush(bounds.x, bounds.y, bounds.w, bounds.h);
+}
+
+// Convert one back buffer row into the framebuffer layout
+static void convert_row(uint8_t *dest, const uint8_t *src, uint16_t count,
+                        bool nontemporal) {
+  const uint32_t *pixels = (const uint32_t *)src;
+
+  if (flags & FLAGS_INDEXED) {
+    kernel_expand_row8(
+        dest, src, count, palette_packed, hw_format.bytes_pp,
+        nontemporal && video_probe_result.copy == VIDEO_COPY_STREAM);
+    return;
+  }
+
+  switch (present_mode) {
+  case PRESENT_COPY:
+    if (nontemporal)
+      video_copy_to_screen(dest, src, count * 4);
+    else
+      kernel_copy_row(dest, src, count * 4, false);
+    break;
+  case PRESENT_RGB565:
+    kernel_pack_row16(dest, pixels, count, false);
+    break;
+  case PRESENT_RGB555:
+    kernel_pack_row16(dest, pixels, count, true);
+    break;
+  case PRESENT_RGB888:
+    kernel_pack_row24(dest, pixels, count);
+    break;
+  default: {
+    const pixel_format_t *f = &hw_format;
+    for (uint16_t i = 0; i < count; ++i, dest += f->bytes_pp) {
+      uint32_t p = pixels[i];
+      pixel_t packed =
+          ((pixel_t)(((p >> 16) & 0xFF) >> f->red_loss) << f->red_shift) |
+          ((pixel_t)(((p >> 8) & 0xFF) >> f->green_loss) << f->green_shift) |
+          ((pixel_t)((p & 0xFF) >> f->blue_loss) << f->blue_shift);
+      for (uint8_t b = 0; b < f->bytes_pp; ++b)
+        dest[b] = (uint8_t)(packed >> (b * 8));
     }
     break;
   }
   }
 }
+
+// Point drawing at the hidden page being built
+static void flip_retarget(void) {
+  uint8_t *lfb = (uint8_t *)(uintptr_t)framebuffer_info.addr;
+  uint32_t page_bytes = framebuffer_info.height * framebuffer_info.pitch;
+  video_target.addr = lfb + flip_page * page_bytes;
+  video_target.pitch = framebuffer_info.pitch;
+  video_target.is_framebuffer = true;
+}
+
+// Wait for the start of the next vertical retrace. Spins are bounded in case
+// the adapter does not emulate the status register
+static void wait_retrace(void) {
+  uint32_t spins = 0;
+  while ((inByte(VGA_INPUT_STATUS) & VGA_RETRACE) && spins < RETRACE_SPINS)
+    spins++;
+  while (!(inByte(VGA_INPUT_STATUS) & VGA_RETRACE) && spins < RETRACE_SPINS)
+    spins++;
+}
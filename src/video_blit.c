@@ -0,0 +1,508 @@
+#include "video.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define AFFINE_MAX_SIZE 0x7FFF // Image sides, so 16.16 positions fit 32 bits
+#define AFFINE_MAX_STEP 0x7FFF // Texels per pixel
+#define AFFINE_CHUNK 256       // Pixels sampled per bounce buffer fill
+#define FIXED_ONE 0x10000
+#define FIXED_HALF 0x8000
+
+// Blit modes
+enum blit_mode { BLIT_OPAQUE, BLIT_COLORKEY, BLIT_ALPHA };
+
+// Source and destination of a blit after clipping
+struct blit_rect {
+  int32_t src_x, src_y;
+  int32_t dest_x, dest_y;
+  int32_t w, h;
+};
+
+// Texel positions a span may sample, 16.16 from 'u0' up to 'u1' and from
+// 'v0' up to 'v1'
+struct texel_bounds {
+  int32_t u0, u1;
+  int32_t v0, v1;
+};
+
+// Row of a transformed blit. Texel positions are 16.16, 'u' and 'v' are
+// those of the first pixel of the bounding box row, exact to the bit with
+// what the kernels step through
+struct affine_row {
+  const video_image_t *image;
+  enum video_filter filter;
+  int64_t u, v;
+  int32_t du, dv;
+
+  // Bilinear pixels from 'inner0' up to 'inner1' have all 2x2 texels inside
+  // the image, the others are clamped to its edge
+  int32_t inner0, inner1;
+};
+
+// Bounce buffer for sampled pixels that are blended or converted
+static uint32_t affine_pixels[AFFINE_CHUNK] __attribute__((aligned(16)));
+
+// Helper function declaration
+static bool clip(uint16_t width, uint16_t height, int16_t x, int16_t y,
+                 struct blit_rect *r);
+static void blit(const video_image_t *image, int16_t x, int16_t y,
+                 enum blit_mode mode, uint32_t key);
+static void blit_row_generic(uint8_t *dest, const uint32_t *src,
+                             uint16_t count, enum blit_mode mode,
+                             uint32_t key);
+static void blit_indexed(const video_indexed_image_t *image, int16_t x,
+                         int16_t y, bool keyed, uint8_t key);
+static void expand_row_colorkey(uint8_t *dest, const uint8_t *src,
+                                uint16_t count, const pixel_t *lut,
+                                uint8_t key);
+static void blit_affine(const video_image_t *image, const video_affine_t *m,
+                        enum video_filter filter, enum blit_mode mode);
+static bool span_inside(const struct affine_row *row,
+                        const struct texel_bounds *b, int32_t count,
+                        int32_t *first, int32_t *last);
+static void draw_span(const struct affine_row *row, uint8_t *dest,
+                      int32_t first, int32_t count, enum blit_mode mode);
+static void sample(const struct affine_row *row, uint32_t *out, int32_t first,
+                   int32_t count);
+static uint32_t sample_edge(const struct affine_row *row, int32_t k);
+
+// Copy the image as is
+void video_blit(const video_image_t *image, int16_t x, int16_t y) {
+  blit(image, x, y, BLIT_OPAQUE, 0);
+}
+
+// Skip pixels equal to the key
+void video_blit_colorkey(const video_image_t *image, int16_t x, int16_t y,
+                         uint32_t key) {
+  blit(image, x, y, BLIT_COLORKEY, key);
+}
+
+// Blend with per-pixel alpha
+void video_blit_alpha(const video_image_t *image, int16_t x, int16_t y) {
+  blit(image, x, y, BLIT_ALPHA, 0);
+}
+
+// Copy a paletted image
+void video_blit_indexed(const video_indexed_image_t *image, int16_t x,
+                        int16_t y) {
+  blit_indexed(image, x, y, false, 0);
+}
+
+// Skip pixels with the key index
+void video_blit_indexed_colorkey(const video_indexed_image_t *image,
+                                 int16_t x, int16_t y, uint8_t key) {
+  blit_indexed(image, x, y, true, key);
+}
+
+// Transformed copy
+void video_blit_affine(const video_image_t *image, const video_affine_t *m,
+                       enum video_filter filter) {
+  blit_affine(image, m, filter, BLIT_OPAQUE);
+}
+
+// Transformed blend with per-pixel alpha
+void video_blit_affine_alpha(const video_image_t *image,
+                             const video_affine_t *m,
+                             enum video_filter filter) {
+  blit_affine(image, m, filter, BLIT_ALPHA);
+}
+
+// Clip an image placed at (x, y) to the clip rect
+// Returns: false when nothing is left
+static bool clip(uint16_t width, uint16_t height, int16_t x, int16_t y,
+                 struct blit_rect *r) {
+  *r = (struct blit_rect){.dest_x = x, .dest_y = y, .w = width, .h = height};
+
+  // Cut off whatever hangs over the left/top edge of the clip rect
+  if (r->dest_x < video_target.clip_x0) {
+    r->src_x = video_target.clip_x0 - r->dest_x;
+    r->w -= r->src_x;
+    r->dest_x = video_target.clip_x0;
+  }
+  if (r->dest_y < video_target.clip_y0) {
+    r->src_y = video_target.clip_y0 - r->dest_y;
+    r->h -= r->src_y;
+    r->dest_y = video_target.clip_y0;
+  }
+
+  // ...and the right/bottom edge
+  if (r->dest_x + r->w > video_target.clip_x1)
+    r->w = video_target.clip_x1 - r->dest_x;
+  if (r->dest_y + r->h > video_target.clip_y1)
+    r->h = video_target.clip_y1 - r->dest_y;
+
+  return r->w > 0 && r->h > 0;
+}
+
+// Clip the image once, then hand whole rows to the kernels
+static void blit(const video_image_t *image, int16_t x, int16_t y,
+                 enum blit_mode mode, uint32_t key) {
+  struct blit_rect r;
+  if (!clip(image->width, image->height, x, y, &r))
+    return;
+
+  const uint32_t *src = image->pixels + r.src_y * image->stride + r.src_x;
+  uint8_t *dest = target_pixel(r.dest_x, r.dest_y);
+
+  for (int32_t row = 0; row < r.h; ++row) {
+    if (!video_format.xrgb8888) {
+      blit_row_generic(dest, src, r.w, mode, key);
+    } else if (mode == BLIT_OPAQUE) {
+      kernel_copy_row(dest, (const uint8_t *)src, r.w * 4, false);
+    } else if (mode == BLIT_COLORKEY) {
+      kernel_blit_colorkey32(dest, src, r.w, key);
+    } else {
+      kernel_blit_alpha32(dest, src, r.w);
+    }
+
+    src += image->stride;
+    dest += video_target.pitch;
+  }
+
+  video_mark_dirty(r.dest_x, r.dest_y, r.w, r.h);
+}
+
+// Indices are copied into indexed targets and looked up for all others
+static void blit_indexed(const video_indexed_image_t *image, int16_t x,
+                         int16_t y, bool keyed, uint8_t key) {
+  struct blit_rect r;
+  if (!clip(image->width, image->height, x, y, &r))
+    return;
+
+  const pixel_t *lut = video_palette_pixels();
+  const uint8_t *src = image->pixels + r.src_y * image->stride + r.src_x;
+  uint8_t *dest = target_pixel(r.dest_x, r.dest_y);
+
+  for (int32_t row = 0; row < r.h; ++row) {
+    if (lut == 0 && keyed)
+      kernel_blit_colorkey8(dest, src, r.w, key);
+    else if (lut == 0)
+      kernel_copy_row(dest, src, r.w, false);
+    else if (keyed)
+      expand_row_colorkey(dest, src, r.w, lut, key);
+    else
+      kernel_expand_row8(dest, src, r.w, lut, video_format.bytes_pp, false);
+
+    src += image->stride;
+    dest += video_target.pitch;
+  }
+
+  video_mark_dirty(r.dest_x, r.dest_y, r.w, r.h);
+}
+
+// Read a native pixel back
+static pixel_t read_pixel(const uint8_t *src) {
+  switch (video_format.bytes_pp) {
+  case 4:
+    return *(const uint32_t *)src;
+  case 3:
+    return src[0] | (src[1] << 8) | (src[2] << 16);
+  case 2:
+    return *(const uint16_t *)src;
+  default:
+    return *src;
+  }
+}
+
+// Unpack a native pixel into 8-bit channels
+static color_t unpack_pixel(pixel_t pixel) {
+  if (video_format.palette) {
+    uint32_t p = video_format.palette[pixel];
+    return COLOR(p >> 16, (p >> 8) & 0xFF, p & 0xFF);
+  }
+  return COLOR(
+      ((pixel >> video_format.red_shift) << video_format.red_loss) & 0xFF,
+      ((pixel >> video_format.green_shift) << video_format.green_loss) & 0xFF,
+      ((pixel >> video_format.blue_shift) << video_format.blue_loss) & 0xFF);
+}
+
+// Slow path for layouts other than XRGB8888, one pixel at a time
+static void blit_row_generic(uint8_t *dest, const uint32_t *src,
+                             uint16_t count, enum blit_mode mode,
+                             uint32_t key) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+
+  for (uint16_t i = 0; i < count; ++i, dest += bytes_pp) {
+    uint32_t s = src[i];
+    color_t color = COLOR((s >> 16) & 0xFF, (s >> 8) & 0xFF, s & 0xFF);
+
+    if (mode == BLIT_COLORKEY && s == key)
+      continue;
+
+    if (mode == BLIT_ALPHA) {
+      uint32_t a = s >> 24;
+      if (a == 0)
+        continue;
+      color_t under = unpack_pixel(read_pixel(dest));
+      color.r = (color.r * a + under.r * (255 - a) + 127) / 255;
+      color.g = (color.g * a + under.g * (255 - a) + 127) / 255;
+      color.b = (color.b * a + under.b * (255 - a) + 127) / 255;
+    }
+
+    video_format.ops->put_pixel(dest, video_pack_color(color));
+  }
+}
+
+// Palette lookup that skips the key index, for targets that are not indexed
+static void expand_row_colorkey(uint8_t *dest, const uint8_t *src,
+                                uint16_t count, const pixel_t *lut,
+                                uint8_t key) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+
+  for (uint16_t i = 0; i < count; ++i, dest += bytes_pp) {
+    if (src[i] != key)
+      video_format.ops->put_pixel(dest, lut[src[i]]);
+  }
+}
+
+// Floor of 'v', clamped to 'lo' - 'hi'. 'lo' is never negative
+static int32_t floor_clamp(double v, int32_t lo, int32_t hi) {
+  if (!(v > lo))
+    return lo;
+  if (v >= hi)
+    return hi;
+  return (int32_t)v;
+}
+
+// Ceiling of 'v', clamped to 'lo' - 'hi'
+static int32_t ceil_clamp(double v, int32_t lo, int32_t hi) {
+  if (!(v > lo))
+    return lo;
+  if (v >= hi)
+    return hi;
+  int32_t i = (int32_t)v;
+  return i < v ? i + 1 : i;
+}
+
+// Round to 16.16 fixed point
+static int64_t to_fixed(double v) {
+  v *= FIXED_ONE;
+  return (int64_t)(v < 0 ? v - 0.5 : v + 0.5);
+}
+
+static double absolute(double v) { return v < 0 ? -v : v; }
+
+// The transform is inverted to map screen pixels back to texels. Its
+// bounding box on screen is scanned row by row, each row clipped to the
+// pixels that land in the image, then sampled and drawn as one span
+static void blit_affine(const video_image_t *image, const video_affine_t *m,
+                        enum video_filter filter, enum blit_mode mode) {
+  int32_t w = image->width, h = image->height;
+  if (w == 0 || h == 0 || w > AFFINE_MAX_SIZE || h > AFFINE_MAX_SIZE)
+    return;
+
+  // Set up in floating point like the rasterizer (the FPU is set up at boot)
+  double a = m->a / (double)FIXED_ONE, b = m->b / (double)FIXED_ONE;
+  double c = m->c / (double)FIXED_ONE, d = m->d / (double)FIXED_ONE;
+  double tx = m->tx / (double)FIXED_ONE, ty = m->ty / (double)FIXED_ONE;
+  double det = a * d - b * c;
+  if (det == 0)
+    return;
+
+  // Texel steps per pixel along x and y. Steps over AFFINE_MAX_STEP texels
+  // shrink the image far below a pixel, so nothing is drawn
+  double u_dx = d / det, u_dy = -b / det;
+  double v_dx = -c / det, v_dy = a / det;
+  if (absolute(u_dx) > AFFINE_MAX_STEP || absolute(v_dx) > AFFINE_MAX_STEP ||
+      absolute(u_dy) > AFFINE_MAX_STEP || absolute(v_dy) > AFFINE_MAX_STEP)
+    return;
+
+  // Bounding box of the image corners, clipped
+  double xs[4] = {tx, tx + a * w, tx + b * h, tx + a * w + b * h};
+  double ys[4] = {ty, ty + c * w, ty + d * h, ty + c * w + d * h};
+  double min_x = xs[0], max_x = xs[0], min_y = ys[0], max_y = ys[0];
+  for (uint8_t i = 1; i < 4; ++i) {
+    min_x = xs[i] < min_x ? xs[i] : min_x;
+    max_x = xs[i] > max_x ? xs[i] : max_x;
+    min_y = ys[i] < min_y ? ys[i] : min_y;
+    max_y = ys[i] > max_y ? ys[i] : max_y;
+  }
+
+  int32_t x0 = floor_clamp(min_x, video_target.clip_x0, video_target.clip_x1);
+  int32_t x1 =
+      floor_clamp(max_x + 1, video_target.clip_x0, video_target.clip_x1);
+  int32_t y0 = floor_clamp(min_y, video_target.clip_y0, video_target.clip_y1);
+  int32_t y1 =
+      floor_clamp(max_y + 1, video_target.clip_y0, video_target.clip_y1);
+  if (x0 >= x1 || y0 >= y1)
+    return;
+
+  // Nearest samples anywhere in the image. Bilinear samples half a texel up
+  // and left of the position, all 2x2 texels are inside from half a texel
+  // in from each edge
+  struct texel_bounds outer = {0, w * FIXED_ONE, 0, h * FIXED_ONE};
+  struct texel_bounds inner = {FIXED_HALF, w * FIXED_ONE - FIXED_HALF,
+                               FIXED_HALF, h * FIXED_ONE - FIXED_HALF};
+  struct affine_row row = {
+      .image = image,
+      .filter = filter,
+      .du = (int32_t)to_fixed(u_dx),
+      .dv = (int32_t)to_fixed(v_dx),
+  };
+
+  int32_t dirty_x0 = x1, dirty_x1 = x0, dirty_y0 = y1, dirty_y1 = y0;
+  double cx = x0 + 0.5 - tx;
+
+  for (int32_t y = y0; y < y1; ++y) {
+    // Pixel centers are sampled
+    double cy = y + 0.5 - ty;
+    row.u = to_fixed(u_dx * cx + u_dy * cy);
+    row.v = to_fixed(v_dx * cx + v_dy * cy);
+
+    int32_t first, last;
+    if (!span_inside(&row, &outer, x1 - x0, &first, &last))
+      continue;
+    if (filter == VIDEO_FILTER_BILINEAR &&
+        !span_inside(&row, &inner, x1 - x0, &row.inner0, &row.inner1))
+      row.inner0 = row.inner1 = last;
+
+    draw_span(&row, target_pixel(x0 + first, y), first, last - first, mode);
+
+    dirty_x0 = x0 + first < dirty_x0 ? x0 + first : dirty_x0;
+    dirty_x1 = x0 + last > dirty_x1 ? x0 + last : dirty_x1;
+    dirty_y0 = y < dirty_y0 ? y : dirty_y0;
+    dirty_y1 = y + 1;
+  }
+
+  if (dirty_x0 < dirty_x1)
+    video_mark_dirty(dirty_x0, dirty_y0, dirty_x1 - dirty_x0,
+                     dirty_y1 - dirty_y0);
+}
+
+// Whether pixel 'k' of the row samples within 'b'
+static inline bool texel_inside(const struct affine_row *row,
+                                const struct texel_bounds *b, int32_t k) {
+  int64_t u = row->u + (int64_t)k * row->du;
+  int64_t v = row->v + (int64_t)k * row->dv;
+  return u >= b->u0 && u < b->u1 && v >= b->v0 && v < b->v1;
+}
+
+// Narrow [lo, hi) to where p + k * step lies in [b0, b1)
+static void axis_range(int64_t p, int32_t step, int32_t b0, int32_t b1,
+                       double *lo, double *hi) {
+  if (step == 0) {
+    if (p < b0 || p >= b1)
+      *hi = *lo;
+    return;
+  }
+
+  double t0 = (double)(b0 - p) / step, t1 = (double)(b1 - p) / step;
+  if (step < 0) {
+    double t = t0;
+    t0 = t1;
+    t1 = t;
+  }
+  *lo = t0 > *lo ? t0 : *lo;
+  *hi = t1 < *hi ? t1 : *hi;
+}
+
+// Pixels 'first' up to 'last' of a row of 'count' whose texel positions lie
+// within 'b'. Each axis is solved in floating point, then both ends are
+// settled on the fixed point positions, so the kernels never step outside
+// Returns: false when there are none
+static bool span_inside(const struct affine_row *row,
+                        const struct texel_bounds *b, int32_t count,
+                        int32_t *first, int32_t *last) {
+  double lo = 0, hi = count;
+  axis_range(row->u, row->du, b->u0, b->u1, &lo, &hi);
+  axis_range(row->v, row->dv, b->v0, b->v1, &lo, &hi);
+
+  // The pixels inside are one run, so the ends move by a pixel at most
+  int32_t k0 = ceil_clamp(lo, 0, count);
+  int32_t k1 = ceil_clamp(hi, k0, count);
+  while (k0 < k1 && !texel_inside(row, b, k0))
+    k0++;
+  while (k0 > 0 && texel_inside(row, b, k0 - 1))
+    k0--;
+  while (k1 > k0 && !texel_inside(row, b, k1 - 1))
+    k1--;
+  while (k1 < count && texel_inside(row, b, k1))
+    k1++;
+
+  *first = k0;
+  *last = k1;
+  return k0 < k1;
+}
+
+// Sample a span and draw it. Opaque XRGB spans are sampled straight into
+// the target, others go through the bounce buffer
+static void draw_span(const struct affine_row *row, uint8_t *dest,
+                      int32_t first, int32_t count, enum blit_mode mode) {
+  bool direct = video_format.xrgb8888 && mode == BLIT_OPAQUE;
+
+  while (count > 0) {
+    int32_t n = count < AFFINE_CHUNK ? count : AFFINE_CHUNK;
+    sample(row, direct ? (uint32_t *)dest : affine_pixels, first, n);
+
+    if (!video_format.xrgb8888)
+      blit_row_generic(dest, affine_pixels, n, mode, 0);
+    else if (mode == BLIT_ALPHA)
+      kernel_blit_alpha32(dest, affine_pixels, n);
+
+    dest += n * video_format.bytes_pp;
+    first += n;
+    count -= n;
+  }
+}
+
+// Sample pixels 'first' up to 'first + count' of the row. Bilinear pixels
+// outside the inner run are clamped one at a time
+static void sample(const struct affine_row *row, uint32_t *out, int32_t first,
+                   int32_t count) {
+  const video_image_t *image = row->image;
+  int32_t k = first, end = first + count;
+
+  if (row->filter == VIDEO_FILTER_NEAREST) {
+    affine_span_t span = {image->pixels,
+                          image->stride,
+                          (int32_t)(row->u + (int64_t)k * row->du),
+                          (int32_t)(row->v + (int64_t)k * row->dv),
+                          row->du,
+                          row->dv};
+    kernel_affine_nearest(out, &span, count);
+    return;
+  }
+
+  for (; k < end && k < row->inner0; ++k)
+    *out++ = sample_edge(row, k);
+
+  int32_t stop = end < row->inner1 ? end : row->inner1;
+  if (k < stop) {
+    affine_span_t span = {image->pixels,
+                          image->stride,
+                          (int32_t)(row->u + (int64_t)k * row->du) - FIXED_HALF,
+                          (int32_t)(row->v + (int64_t)k * row->dv) - FIXED_HALF,
+                          row->du,
+                          row->dv};
+    kernel_affine_bilinear(out, &span, stop - k);
+    out += stop - k;
+    k = stop;
+  }
+
+  for (; k < end; ++k)
+    *out++ = sample_edge(row, k);
+}
+
+static inline int32_t clamp_texel(int32_t i, int32_t size) {
+  return i < 0 ? 0 : (i >= size ? size - 1 : i);
+}
+
+// Bilinear sample of pixel 'k' with the texels clamped to the image
+static uint32_t sample_edge(const struct affine_row *row, int32_t k) {
+  const video_image_t *image = row->image;
+  int32_t s = (int32_t)(row->u + (int64_t)k * row->du) - FIXED_HALF;
+  int32_t t = (int32_t)(row->v + (int64_t)k * row->dv) - FIXED_HALF;
+
+  // Arithmetic shifts, so the texel left of or above the image is -1
+  int32_t i = s >> 16, j = t >> 16;
+  int32_t i0 = clamp_texel(i, image->width);
+  int32_t i1 = clamp_texel(i + 1, image->width);
+  const uint32_t *top = image->pixels + clamp_texel(j, image->height) *
+                                            image->stride;
+  const uint32_t *bottom = image->pixels + clamp_texel(j + 1, image->height) *
+                                               image->stride;
+
+  return kernel_bilinear_pixel(top[i0], top[i1], bottom[i0], bottom[i1],
+                               (s >> 8) & 0xFF, (t >> 8) & 0xFF);
+}
@@ -0,0 +1,313 @@
+#include "serial.h"
+#include "video.h"
+#include "video_internal.h"
+
+/*
+ * Dump stream, all values little endian:
+ *   "CCFB", version (1 byte), x, y, w, h (2 bytes each)
+ *   per row, packets of a header byte followed by their data:
+ *     bits 7-6: 00 = literal pixels, 01 = one pixel repeated,
+ *               10 = pixels equal to the row above
+ *     bits 5-0: count - 1, or 63 when a 2 byte count - 1 follows
+ *     literals carry count pixels, repeats one, as R, G, B bytes
+ *   CRC32 (4 bytes) of the RGB rows, as video_capture_crc() computes it
+ * CRC records: "CCCR", x, y, w, h (2 bytes each), CRC32 (4 bytes)
+ * tools/fbdump.py turns a capture log into PNG files.
+ */
+
+// Macros
+#define CAPTURE_MAX_WIDTH 4096
+#define DUMP_VERSION 1
+
+#define PACKET_LITERAL 0x00
+#define PACKET_RUN 0x40
+#define PACKET_COPY_UP 0x80
+#define PACKET_LONG 0x3F
+
+#define CRC32_POLY 0xEDB88320
+
+// Two converted rows, the one being encoded and the one above it
+static uint32_t rows[2][CAPTURE_MAX_WIDTH];
+
+// Slicing-by-4 tables, built on first use
+static uint32_t crc_table[4][256];
+static bool crc_ready = false;
+
+// Serial output is batched to fill the UART FIFO in bursts
+static uint8_t out_buffer[256];
+static uint16_t out_length = 0;
+
+// Helper function declaration
+static bool visible_rect(const video_rect_t *rect, video_rect_t *out);
+static void read_row(const uint8_t *frame, uint32_t pitch,
+                     const pixel_format_t *format, const video_rect_t *r,
+                     uint16_t y, uint32_t *dest);
+static void crc_init(void);
+static uint32_t crc_rgb(uint32_t crc, const uint32_t *pixels, uint16_t count);
+static void encode_row(const uint32_t *row, const uint32_t *above,
+                       uint16_t count);
+static void put_packet(uint8_t type, uint16_t count);
+static void put_pixel(uint32_t pixel);
+static void put_byte(uint8_t value);
+static void put_u16(uint16_t value);
+static void put_u32(uint32_t value);
+static void put_rect(const video_rect_t *r);
+static void flush(void);
+
+// Cursors are left out, so captures do not depend on where the pointer is
+uint32_t video_capture_crc(const video_rect_t *rect) {
+  uint32_t pitch;
+  const pixel_format_t *format;
+  const uint8_t *frame = video_visible_frame(&pitch, &format);
+
+  video_rect_t r;
+  if (frame == 0 || !visible_rect(rect, &r))
+    return 0;
+
+  video_cursor_suspend();
+  crc_init();
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint16_t y = 0; y < r.h; ++y) {
+    read_row(frame, pitch, format, &r, y, rows[0]);
+    crc = crc_rgb(crc, rows[0], r.w);
+  }
+  video_cursor_resume();
+  return ~crc;
+}
+
+void video_capture_send_crc(const video_rect_t *rect) {
+  video_rect_t r;
+  if (!visible_rect(rect, &r))
+    return;
+
+  uint32_t crc = video_capture_crc(&r);
+  put_byte('C');
+  put_byte('C');
+  put_byte('C');
+  put_byte('R');
+  put_rect(&r);
+  put_u32(crc);
+  flush();
+}
+
+int8_t video_capture_dump(const video_rect_t *rect) {
+  uint32_t pitch;
+  const pixel_format_t *format;
+  const uint8_t *frame = video_visible_frame(&pitch, &format);
+
+  video_rect_t r;
+  if (frame == 0 || !visible_rect(rect, &r))
+    return -1;
+
+  put_byte('C');
+  put_byte('C');
+  put_byte('F');
+  put_byte('B');
+  put_byte(DUMP_VERSION);
+  put_rect(&r);
+
+  video_cursor_suspend();
+  crc_init();
+  uint32_t crc = 0xFFFFFFFF;
+  for (uint16_t y = 0; y < r.h; ++y) {
+    uint32_t *row = rows[y & 1];
+    read_row(frame, pitch, format, &r, y, row);
+    encode_row(row, y ? rows[(y - 1) & 1] : 0, r.w);
+    crc = crc_rgb(crc, row, r.w);
+  }
+  video_cursor_resume();
+
+  put_u32(~crc);
+  flush();
+  return 0;
+}
+
+// Helper functions
+// Clip to the screen, NULL means all of it
+static bool visible_rect(const video_rect_t *rect, video_rect_t *out) {
+  video_rect_t r = {0, 0, video_target.width, video_target.height};
+  if (rect) {
+    r = *rect;
+    if (r.x >= video_target.width || r.y >= video_target.height)
+      return false;
+    if (r.w > video_target.width - r.x)
+      r.w = video_target.width - r.x;
+    if (r.h > video_target.height - r.y)
+      r.h = video_target.height - r.y;
+  }
+
+  if (r.w > CAPTURE_MAX_WIDTH)
+    r.w = CAPTURE_MAX_WIDTH;
+  *out = r;
+  return r.w > 0 && r.h > 0;
+}
+
+// Row 'y' of the rect as XRGB8888 with the X byte cleared
+static void read_row(const uint8_t *frame, uint32_t pitch,
+                     const pixel_format_t *format, const video_rect_t *r,
+                     uint16_t y, uint32_t *dest) {
+  const uint8_t *src =
+      frame + (r->y + y) * pitch + (uint32_t)r->x * format->bytes_pp;
+
+  // Full 8-bit channels only need the bits the screen keeps
+  uint32_t keep = ((0xFFU << format->red_loss) & 0xFF) << 16 |
+                  ((0xFFU << format->green_loss) & 0xFF) << 8 |
+                  ((0xFFU << format->blue_loss) & 0xFF);
+  if (format->xrgb8888) {
+    const uint32_t *pixels = (const uint32_t *)src;
+    for (uint16_t i = 0; i < r->w; ++i)
+      dest[i] = pixels[i] & keep;
+    return;
+  }
+  if (format->palette) {
+    for (uint16_t i = 0; i < r->w; ++i)
+      dest[i] = format->palette[src[i]] & keep;
+    return;
+  }
+
+  for (uint16_t i = 0; i < r->w; ++i, src += format->bytes_pp)
+    dest[i] = pixel_to_xrgb(src, format);
+}
+
+static void crc_init(void) {
+  if (crc_ready)
+    return;
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (uint8_t k = 0; k < 8; ++k)
+      c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+    crc_table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; ++i) {
+    for (uint8_t t = 1; t < 4; ++t) {
+      uint32_t c = crc_table[t - 1][i];
+      crc_table[t][i] = (c >> 8) ^ crc_table[0][c & 0xFF];
+    }
+  }
+  crc_ready = true;
+}
+
+// One little endian word through the slicing tables
+static inline uint32_t crc_word(uint32_t crc, uint32_t word) {
+  crc ^= word;
+  return crc_table[3][crc & 0xFF] ^ crc_table[2][(crc >> 8) & 0xFF] ^
+         crc_table[1][(crc >> 16) & 0xFF] ^ crc_table[0][crc >> 24];
+}
+
+static inline uint32_t crc_byte(uint32_t crc, uint8_t byte) {
+  return crc_table[0][(crc ^ byte) & 0xFF] ^ (crc >> 8);
+}
+
+// CRC of the pixels as R, G, B bytes. Four pixels are twelve bytes, which
+// go through the tables as three words
+static uint32_t crc_rgb(uint32_t crc, const uint32_t *pixels, uint16_t count) {
+  while (count >= 4) {
+    uint32_t p0 = pixels[0], p1 = pixels[1], p2 = pixels[2], p3 = pixels[3];
+    crc = crc_word(crc, ((p0 >> 16) & 0xFF) | (p0 & 0xFF00) |
+                            ((p0 & 0xFF) << 16) | (p1 & 0xFF0000) << 8);
+    crc = crc_word(crc, ((p1 >> 8) & 0xFF) | ((p1 & 0xFF) << 8) |
+                            (p2 & 0xFF0000) | (p2 & 0xFF00) << 16);
+    crc = crc_word(crc, (p2 & 0xFF) | ((p3 >> 8) & 0xFF00) |
+                            ((p3 & 0xFF00) << 8) | (p3 & 0xFF) << 24);
+    pixels += 4;
+    count -= 4;
+  }
+
+  for (uint16_t i = 0; i < count; ++i) {
+    crc = crc_byte(crc, (pixels[i] >> 16) & 0xFF);
+    crc = crc_byte(crc, (pixels[i] >> 8) & 0xFF);
+    crc = crc_byte(crc, pixels[i] & 0xFF);
+  }
+  return crc;
+}
+
+static void put_packet(uint8_t type, uint16_t count) {
+  if (count - 1 < PACKET_LONG) {
+    put_byte(type | (count - 1));
+  } else {
+    put_byte(type | PACKET_LONG);
+    put_u16(count - 1);
+  }
+}
+
+static void put_pixel(uint32_t pixel) {
+  put_byte((pixel >> 16) & 0xFF);
+  put_byte((pixel >> 8) & 0xFF);
+  put_byte(pixel & 0xFF);
+}
+
+// Greedy packets: copy from above or repeat where at least two pixels
+// match, literals in between
+static void encode_row(const uint32_t *row, const uint32_t *above,
+                       uint16_t count) {
+  uint16_t i = 0;
+  while (i < count) {
+    uint16_t up = 0;
+    if (above) {
+      while (i + up < count && row[i + up] == above[i + up])
+        up++;
+    }
+
+    uint16_t run = 1;
+    while (i + run < count && row[i + run] == row[i])
+      run++;
+
+    if (up >= 2 && up >= run) {
+      put_packet(PACKET_COPY_UP, up);
+      i += up;
+      continue;
+    }
+    if (run >= 2) {
+      put_packet(PACKET_RUN, run);
+      put_pixel(row[i]);
+      i += run;
+      continue;
+    }
+
+    // Literal up to where a repeat or a copy would start
+    uint16_t n = 1;
+    while (i + n + 1 < count) {
+      uint16_t j = i + n;
+      if (row[j] == row[j + 1] ||
+          (above && row[j] == above[j] && row[j + 1] == above[j + 1]))
+        break;
+      n++;
+    }
+    if (i + n + 1 == count)
+      n++;
+
+    put_packet(PACKET_LITERAL, n);
+    for (uint16_t k = 0; k < n; ++k)
+      put_pixel(row[i + k]);
+    i += n;
+  }
+}
+
+static void put_byte(uint8_t value) {
+  out_buffer[out_length++] = value;
+  if (out_length == sizeof(out_buffer))
+    flush();
+}
+
+static void put_u16(uint16_t value) {
+  put_byte(value & 0xFF);
+  put_byte(value >> 8);
+}
+
+static void put_u32(uint32_t value) {
+  put_u16(value & 0xFFFF);
+  put_u16(value >> 16);
+}
+
+static void put_rect(const video_rect_t *r) {
+  put_u16(r->x);
+  put_u16(r->y);
+  put_u16(r->w);
+  put_u16(r->h);
+}
+
+static void flush(void) {
+  serial_write(out_buffer, out_length);
+  out_length = 0;
+}
@@ -0,0 +1,366 @@
+#include "cpu.h"
+#include "memory.h"
+#include "video.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+#include "virtio_gpu.h"
+
+// Macros
+// Widest cursor row in screen pixels, at the largest scale of 8
+#define CURSOR_ROW (VIDEO_CURSOR_MAX * 8)
+#define CURSOR_CHANGES 8
+
+// Cursors from the bottom up
+static video_cursor_t *cursors = 0;
+
+// Console output from the keyboard interrupt moves cursors off the screen and
+// back, so every entry point runs with interrupts disabled
+
+// Nesting of video_cursor_suspend(), cursors stay off the screen meanwhile
+static uint8_t suspended = 0;
+
+// Screen rects cursors changed, transferred to a virtio-gpu host
+static video_rect_t changes[CURSOR_CHANGES];
+static uint8_t change_count = 0;
+
+// A row of the pixels under a cursor as XRGB8888, and the image row widened
+// to screen pixels
+static uint32_t row_under[CURSOR_ROW];
+static uint32_t row_image[CURSOR_ROW];
+
+// Helper function declaration
+static bool listed(const video_cursor_t *cursor);
+static void begin_change(video_cursor_t *cursor);
+static bool place(const video_cursor_t *cursor, const video_screen_t *screen,
+                  video_rect_t *out);
+static void park(video_cursor_t *cursor, const video_screen_t *screen);
+static void park_over(video_cursor_t *from, video_rect_t rect,
+                      const video_screen_t *screen);
+static void draw(video_cursor_t *cursor, const video_screen_t *screen);
+static void widen_row(const video_cursor_t *cursor, uint32_t row,
+                      uint32_t skip, uint16_t count, uint8_t scale);
+static void write_row(uint8_t *dest, const uint32_t *src, uint16_t count,
+                      const pixel_format_t *f);
+static void send_changes(const video_screen_t *screen);
+static bool overlap(video_rect_t a, video_rect_t b);
+
+int8_t video_cursor_set(video_cursor_t *cursor, const video_image_t *image,
+                        uint16_t hot_x, uint16_t hot_y) {
+  if (image->width == 0 || image->height == 0 ||
+      image->width > VIDEO_CURSOR_MAX || image->height > VIDEO_CURSOR_MAX)
+    return -1;
+
+  uint32_t eflags = irq_save();
+
+  // New cursors go on top
+  if (!listed(cursor)) {
+    *cursor = (video_cursor_t){0};
+    video_cursor_t **at = &cursors;
+    while (*at != 0)
+      at = &(*at)->next;
+    *at = cursor;
+  }
+
+  begin_change(cursor);
+  cursor->image = image;
+  cursor->hot_x = hot_x;
+  cursor->hot_y = hot_y;
+  video_cursor_redraw();
+  irq_restore(eflags);
+  return 0;
+}
+
+void video_cursor_remove(video_cursor_t *cursor) {
+  uint32_t eflags = irq_save();
+  if (!listed(cursor)) {
+    irq_restore(eflags);
+    return;
+  }
+
+  begin_change(cursor);
+  if (cursor->parked)
+    video_damage_add(changes, &change_count, CURSOR_CHANGES, cursor->rect);
+  cursor->parked = false;
+
+  video_cursor_t **at = &cursors;
+  while (*at != cursor)
+    at = &(*at)->next;
+  *at = cursor->next;
+  cursor->next = 0;
+  video_cursor_redraw();
+  irq_restore(eflags);
+}
+
+void video_cursor_move(video_cursor_t *cursor, int16_t x, int16_t y) {
+  uint32_t eflags = irq_save();
+  if (cursor->x != x || cursor->y != y) {
+    begin_change(cursor);
+    cursor->x = x;
+    cursor->y = y;
+    video_cursor_redraw();
+  }
+  irq_restore(eflags);
+}
+
+void video_cursor_show(video_cursor_t *cursor, bool visible) {
+  uint32_t eflags = irq_save();
+  if (cursor->visible != visible) {
+    begin_change(cursor);
+    cursor->visible = visible;
+    video_cursor_redraw();
+  }
+  irq_restore(eflags);
+}
+
+// Drawing into a back buffer never touches the screen, only the cursor
+// changes wait
+void video_cursor_suspend(void) {
+  uint32_t eflags = irq_save();
+  const video_screen_t *screen = video_screen();
+  if (suspended++ == 0 && screen != 0 && screen->direct)
+    park_over(cursors, (video_rect_t){0, 0, screen->width, screen->height},
+              screen);
+  irq_restore(eflags);
+}
+
+void video_cursor_resume(void) {
+  uint32_t eflags = irq_save();
+  if (suspended > 0 && --suspended == 0)
+    video_cursor_redraw();
+  irq_restore(eflags);
+}
+
+void video_cursor_park(video_rect_t rect) {
+  uint32_t eflags = irq_save();
+  const video_screen_t *screen = video_screen();
+  if (screen != 0)
+    park_over(cursors, rect, screen);
+  irq_restore(eflags);
+}
+
+// Bottom up, so every cursor saves the ones below it as part of the screen
+void video_cursor_redraw(void) {
+  uint32_t eflags = irq_save();
+  const video_screen_t *screen = video_screen();
+  if (screen != 0 && !suspended) {
+    for (video_cursor_t *c = cursors; c != 0; c = c->next)
+      draw(c, screen);
+    send_changes(screen);
+  }
+  irq_restore(eflags);
+}
+
+void video_cursor_reset(void) {
+  for (video_cursor_t *c = cursors; c != 0; c = c->next) {
+    c->shown = false;
+    c->parked = false;
+  }
+  change_count = 0;
+}
+
+// Helper functions
+static bool listed(const video_cursor_t *cursor) {
+  for (const video_cursor_t *c = cursors; c != 0; c = c->next) {
+    if (c == cursor)
+      return true;
+  }
+  return false;
+}
+
+// Take a cursor off the screen before changing it, it is drawn again with
+// video_cursor_redraw()
+static void begin_change(video_cursor_t *cursor) {
+  const video_screen_t *screen = video_screen();
+  if (screen != 0)
+    park(cursor, screen);
+}
+
+// Screen pixels a visible cursor covers, clipped to the picture
+// Returns: false when none
+static bool place(const video_cursor_t *cursor, const video_screen_t *screen,
+                  video_rect_t *out) {
+  int32_t scale = screen->scale;
+  int32_t x0 = screen->view_x + (cursor->x - (int32_t)cursor->hot_x) * scale;
+  int32_t y0 = screen->view_y + (cursor->y - (int32_t)cursor->hot_y) * scale;
+  int32_t x1 = x0 + cursor->image->width * scale;
+  int32_t y1 = y0 + cursor->image->height * scale;
+
+  int32_t view_x1 = screen->view_x + screen->view_w;
+  int32_t view_y1 = screen->view_y + screen->view_h;
+  if (x0 < screen->view_x)
+    x0 = screen->view_x;
+  if (y0 < screen->view_y)
+    y0 = screen->view_y;
+  if (x1 > view_x1)
+    x1 = view_x1;
+  if (y1 > view_y1)
+    y1 = view_y1;
+  if (x0 >= x1 || y0 >= y1)
+    return false;
+
+  *out = (video_rect_t){.x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0};
+  return true;
+}
+
+// Put back the pixels a shown cursor covers, after taking off the cursors
+// above that saved some of it as the screen
+static void park(video_cursor_t *cursor, const video_screen_t *screen) {
+  if (!cursor->shown)
+    return;
+  park_over(cursor->next, cursor->rect, screen);
+
+  uint32_t row_bytes = cursor->rect.w * screen->format->bytes_pp;
+  const uint8_t *src = cursor->saved;
+  uint8_t *dest = screen->addr + cursor->rect.y * screen->pitch +
+                  cursor->rect.x * screen->format->bytes_pp;
+  for (uint16_t row = 0; row < cursor->rect.h; ++row) {
+    memcpy(dest, src, row_bytes);
+    src += row_bytes;
+    dest += screen->pitch;
+  }
+
+  cursor->shown = false;
+  cursor->parked = true;
+}
+
+static void park_over(video_cursor_t *from, video_rect_t rect,
+                      const video_screen_t *screen) {
+  for (video_cursor_t *c = from; c != 0; c = c->next) {
+    if (c->shown && overlap(c->rect, rect))
+      park(c, screen);
+  }
+}
+
+// Save what a cursor covers and blend its image over it
+static void draw(video_cursor_t *cursor, const video_screen_t *screen) {
+  if (cursor->shown)
+    return;
+
+  const pixel_format_t *f = screen->format;
+  video_rect_t rect;
+  bool on_screen = cursor->visible && place(cursor, screen, &rect);
+
+  // Grow-only save-under buffer
+  uint32_t row_bytes = on_screen ? rect.w * f->bytes_pp : 0;
+  if (on_screen && row_bytes * rect.h > cursor->capacity) {
+    uint8_t *saved = mem_alloc(row_bytes * rect.h, sizeof(uint32_t));
+    on_screen = saved != 0;
+    if (saved != 0) {
+      cursor->saved = saved;
+      cursor->capacity = row_bytes * rect.h;
+    }
+  }
+
+  // A cursor put back where it was taken off leaves the screen unchanged
+  // around what was drawn under it meanwhile
+  bool moved = !cursor->parked || !on_screen || rect.x != cursor->rect.x ||
+               rect.y != cursor->rect.y || rect.w != cursor->rect.w ||
+               rect.h != cursor->rect.h;
+  if (cursor->parked && moved)
+    video_damage_add(changes, &change_count, CURSOR_CHANGES, cursor->rect);
+  cursor->parked = false;
+  if (!on_screen)
+    return;
+
+  // Cursors above may cover the new place
+  park_over(cursor->next, rect, screen);
+
+  // Image pixel of the top left corner, and how many screen pixels of it
+  // are clipped off
+  uint8_t scale = screen->scale;
+  int32_t origin_x =
+      screen->view_x + (cursor->x - (int32_t)cursor->hot_x) * scale;
+  int32_t origin_y =
+      screen->view_y + (cursor->y - (int32_t)cursor->hot_y) * scale;
+  uint32_t skip_x = rect.x - origin_x;
+  uint32_t skip_y = rect.y - origin_y;
+
+  uint8_t *saved = cursor->saved;
+  uint8_t *dest = screen->addr + rect.y * screen->pitch + rect.x * f->bytes_pp;
+  for (uint16_t row = 0; row < rect.h; ++row) {
+    memcpy(saved, dest, row_bytes);
+
+    // Rows of the image repeat 'scale' times
+    if (row == 0 || (skip_y + row) % scale == 0)
+      widen_row(cursor, (skip_y + row) / scale, skip_x, rect.w, scale);
+
+    if (f->xrgb8888) {
+      memcpy(row_under, saved, row_bytes);
+    } else {
+      for (uint16_t i = 0; i < rect.w; ++i)
+        row_under[i] = pixel_to_xrgb(saved + i * f->bytes_pp, f);
+    }
+    kernel_blit_alpha32((uint8_t *)row_under, row_image, rect.w);
+    write_row(dest, row_under, rect.w, f);
+
+    saved += row_bytes;
+    dest += screen->pitch;
+  }
+
+  cursor->rect = rect;
+  cursor->shown = true;
+  if (moved)
+    video_damage_add(changes, &change_count, CURSOR_CHANGES, rect);
+}
+
+// Image row 'row' from screen pixel 'skip' on, every pixel 'scale' wide
+static void widen_row(const video_cursor_t *cursor, uint32_t row,
+                      uint32_t skip, uint16_t count, uint8_t scale) {
+  const uint32_t *src =
+      cursor->image->pixels + row * cursor->image->stride + skip / scale;
+  uint8_t repeat = scale - skip % scale;
+
+  for (uint16_t i = 0; i < count; ++i) {
+    row_image[i] = *src;
+    if (--repeat == 0) {
+      src++;
+      repeat = scale;
+    }
+  }
+}
+
+// Store XRGB8888 pixels in the screen layout
+static void write_row(uint8_t *dest, const uint32_t *src, uint16_t count,
+                      const pixel_format_t *f) {
+  if (f->xrgb8888) {
+    memcpy(dest, src, count * 4);
+    return;
+  }
+
+  for (uint16_t i = 0; i < count; ++i, dest += f->bytes_pp) {
+    uint32_t p = src[i];
+    pixel_t packed =
+        ((pixel_t)(((p >> 16) & 0xFF) >> f->red_loss) << f->red_shift) |
+        ((pixel_t)(((p >> 8) & 0xFF) >> f->green_loss) << f->green_shift) |
+        ((pixel_t)((p & 0xFF) >> f->blue_loss) << f->blue_shift);
+    for (uint8_t b = 0; b < f->bytes_pp; ++b)
+      dest[b] = (uint8_t)(packed >> (b * 8));
+  }
+}
+
+// The host only shows what is transferred to it
+static void send_changes(const video_screen_t *screen) {
+  if (screen->virtio && change_count > 0) {
+    video_rect_t bounds = changes[0];
+    for (uint8_t i = 0; i < change_count; ++i) {
+      video_rect_t r = changes[i];
+      virtio_gpu_transfer(r.x, r.y, r.w, r.h);
+
+      uint16_t x1 = bounds.x + bounds.w > r.x + r.w ? bounds.x + bounds.w
+                                                    : r.x + r.w;
+      uint16_t y1 = bounds.y + bounds.h > r.y + r.h ? bounds.y + bounds.h
+                                                    : r.y + r.h;
+      bounds.x = bounds.x < r.x ? bounds.x : r.x;
+      bounds.y = bounds.y < r.y ? bounds.y : r.y;
+      bounds.w = x1 - bounds.x;
+      bounds.h = y1 - bounds.y;
+    }
+    virtio_gpu_flush(bounds.x, bounds.y, bounds.w, bounds.h);
+  }
+  change_count = 0;
+}
+
+static bool overlap(video_rect_t a, video_rect_t b) {
+  return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h &&
+         b.y < a.y + a.h;
+}
@@ -0,0 +1,366 @@
+#include "video.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define MAX_POLYGON_POINTS 64
+#define COORD_LIMIT 16383
+
+// Clamp coordinates so the fixed point math below stays within 32 bits
+#define CLAMP_COORD(v)                                                         \
+  ((v) < -COORD_LIMIT ? -COORD_LIMIT : ((v) > COORD_LIMIT ? COORD_LIMIT : (v)))
+
+// Outcodes for line clipping
+#define OUT_LEFT 0x01
+#define OUT_RIGHT 0x02
+#define OUT_TOP 0x04
+#define OUT_BOTTOM 0x08
+
+// Helper function declaration
+static void span(int32_t x0, int32_t x1, int32_t y, const fill_pattern_t *pat);
+static void vspan(int32_t x, int32_t y0, int32_t y1, pixel_t pixel);
+static void mark_bounds(int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+static uint8_t outcode(int32_t x, int32_t y);
+static void ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                    color_t color, bool filled);
+
+// Draw a line, clipped as a segment so the inner loop has no bounds tests
+void video_draw_line(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                     color_t color) {
+  int32_t ax = CLAMP_COORD(x0), ay = CLAMP_COORD(y0);
+  int32_t bx = CLAMP_COORD(x1), by = CLAMP_COORD(y1);
+  int32_t left = video_target.clip_x0, right = video_target.clip_x1 - 1;
+  int32_t top = video_target.clip_y0, bottom = video_target.clip_y1 - 1;
+  pixel_t pixel = video_pack_color(color);
+
+  // Cohen-Sutherland: pull the endpoints onto the clip rect
+  uint8_t code_a = outcode(ax, ay);
+  uint8_t code_b = outcode(bx, by);
+  while (code_a | code_b) {
+    // Both ends on the same outside side
+    if (code_a & code_b)
+      return;
+
+    uint8_t code = code_a ? code_a : code_b;
+    int32_t x, y;
+    if (code & OUT_TOP) {
+      x = ax + (bx - ax) * (top - ay) / (by - ay);
+      y = top;
+    } else if (code & OUT_BOTTOM) {
+      x = ax + (bx - ax) * (bottom - ay) / (by - ay);
+      y = bottom;
+    } else if (code & OUT_LEFT) {
+      y = ay + (by - ay) * (left - ax) / (bx - ax);
+      x = left;
+    } else {
+      y = ay + (by - ay) * (right - ax) / (bx - ax);
+      x = right;
+    }
+
+    if (code == code_a) {
+      ax = x;
+      ay = y;
+      code_a = outcode(ax, ay);
+    } else {
+      bx = x;
+      by = y;
+      code_b = outcode(bx, by);
+    }
+  }
+
+  // Straight lines go through the span paths
+  if (ay == by) {
+    fill_pattern_t pattern;
+    kernel_make_pattern(&pattern, pixel, video_format.bytes_pp);
+    span(ax < bx ? ax : bx, ax < bx ? bx : ax, ay, &pattern);
+    mark_bounds(ax, ay, bx, by);
+    return;
+  }
+  if (ax == bx) {
+    vspan(ax, ay, by, pixel);
+    mark_bounds(ax, ay, bx, by);
+    return;
+  }
+
+  // Bresenham, stepping the destination pointer instead of recomputing it
+  int32_t dx = bx > ax ? bx - ax : ax - bx;
+  int32_t dy = by > ay ? by - ay : ay - by;
+  int32_t step_x = bx > ax ? video_format.bytes_pp : -video_format.bytes_pp;
+  int32_t step_y = by > ay ? (int32_t)video_target.pitch
+                           : -(int32_t)video_target.pitch;
+  int32_t err = dx - dy;
+  uint8_t *dest = target_pixel(ax, ay);
+  void (*put_pixel)(uint8_t *, pixel_t) = video_format.ops->put_pixel;
+
+  for (int32_t n = (dx > dy ? dx : dy); n >= 0; --n) {
+    put_pixel(dest, pixel);
+    int32_t e2 = err * 2;
+    if (e2 > -dy) {
+      err -= dy;
+      dest += step_x;
+    }
+    if (e2 < dx) {
+      err += dx;
+      dest += step_y;
+    }
+  }
+
+  mark_bounds(ax, ay, bx, by);
+}
+
+// Draw a rectangle outline
+void video_draw_rect(int16_t x, int16_t y, uint16_t w, uint16_t h,
+                     color_t color) {
+  if (w == 0 || h == 0)
+    return;
+
+  int32_t x0 = CLAMP_COORD(x), y0 = CLAMP_COORD(y);
+  int32_t x1 = CLAMP_COORD(x0 + w - 1), y1 = CLAMP_COORD(y0 + h - 1);
+  pixel_t pixel = video_pack_color(color);
+
+  fill_pattern_t pattern;
+  kernel_make_pattern(&pattern, pixel, video_format.bytes_pp);
+
+  // Rects one or two pixels across have no sides, or only one edge each way
+  span(x0, x1, y0, &pattern);
+  if (y1 > y0)
+    span(x0, x1, y1, &pattern);
+  if (y1 > y0 + 1) {
+    vspan(x0, y0 + 1, y1 - 1, pixel);
+    if (x1 > x0)
+      vspan(x1, y0 + 1, y1 - 1, pixel);
+  }
+  mark_bounds(x0, y0, x1, y1);
+}
+
+// Ellipse and circle wrappers
+void video_draw_ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                        color_t color) {
+  ellipse(cx, cy, rx, ry, color, false);
+}
+
+void video_fill_ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                        color_t color) {
+  ellipse(cx, cy, rx, ry, color, true);
+}
+
+void video_draw_circle(int16_t cx, int16_t cy, uint16_t r, color_t color) {
+  ellipse(cx, cy, r, r, color, false);
+}
+
+void video_fill_circle(int16_t cx, int16_t cy, uint16_t r, color_t color) {
+  ellipse(cx, cy, r, r, color, true);
+}
+
+// Fill a convex polygon one scanline at a time
+void video_fill_polygon(const video_point_t *points, uint8_t count,
+                        color_t color) {
+  if (count < 3 || count > MAX_POLYGON_POINTS)
+    return;
+
+  // Per edge: top vertex (x in 16.16), top/bottom row and slope in 16.16
+  int32_t edge_x[MAX_POLYGON_POINTS], edge_slope[MAX_POLYGON_POINTS];
+  int32_t edge_top[MAX_POLYGON_POINTS], edge_bottom[MAX_POLYGON_POINTS];
+  uint8_t edges = 0;
+  int32_t min_y = COORD_LIMIT, max_y = -COORD_LIMIT;
+
+  for (uint8_t i = 0; i < count; ++i) {
+    const video_point_t *a = &points[i];
+    const video_point_t *b = &points[(i + 1) % count];
+    int32_t ax = CLAMP_COORD(a->x), ay = CLAMP_COORD(a->y);
+    int32_t bx = CLAMP_COORD(b->x), by = CLAMP_COORD(b->y);
+
+    // Horizontal edges never cross a scanline center
+    if (ay == by)
+      continue;
+    if (ay > by) {
+      int32_t t = ax;
+      ax = bx;
+      bx = t;
+      t = ay;
+      ay = by;
+      by = t;
+    }
+
+    edge_x[edges] = ax * 65536;
+    edge_slope[edges] = (bx - ax) * 65536 / (by - ay);
+    edge_top[edges] = ay;
+    edge_bottom[edges] = by;
+    edges++;
+
+    min_y = ay < min_y ? ay : min_y;
+    max_y = by > max_y ? by : max_y;
+  }
+
+  if (edges == 0)
+    return;
+
+  // Only the rows inside the clip rect are walked
+  if (min_y < video_target.clip_y0)
+    min_y = video_target.clip_y0;
+  if (max_y > video_target.clip_y1)
+    max_y = video_target.clip_y1;
+
+  fill_pattern_t pattern;
+  kernel_make_pattern(&pattern, video_pack_color(color),
+                      video_format.bytes_pp);
+
+  int32_t bound_x0 = COORD_LIMIT, bound_x1 = -COORD_LIMIT;
+  for (int32_t y = min_y; y < max_y; ++y) {
+    int32_t left = INT32_MAX, right = INT32_MIN;
+
+    // Edges are sampled at the scanline center, top row inclusive
+    for (uint8_t e = 0; e < edges; ++e) {
+      if (y < edge_top[e] || y >= edge_bottom[e])
+        continue;
+      int32_t x = edge_x[e] + edge_slope[e] * (y - edge_top[e]) +
+                  edge_slope[e] / 2;
+      left = x < left ? x : left;
+      right = x > right ? x : right;
+    }
+    if (left > right)
+      continue;
+
+    // Cover the pixels whose centers fall in [left, right)
+    int32_t x0 = (left + 0x7FFF) >> 16;
+    int32_t x1 = ((right + 0x7FFF) >> 16) - 1;
+    span(x0, x1, y, &pattern);
+
+    bound_x0 = x0 < bound_x0 ? x0 : bound_x0;
+    bound_x1 = x1 > bound_x1 ? x1 : bound_x1;
+  }
+
+  if (bound_x0 <= bound_x1)
+    mark_bounds(bound_x0, min_y, bound_x1, max_y - 1);
+}
+
+// Fill [x0, x1] on row y through the row fill kernel, clipped once per span
+static void span(int32_t x0, int32_t x1, int32_t y,
+                 const fill_pattern_t *pat) {
+  if (y < video_target.clip_y0 || y >= video_target.clip_y1)
+    return;
+  if (x0 < video_target.clip_x0)
+    x0 = video_target.clip_x0;
+  if (x1 >= video_target.clip_x1)
+    x1 = video_target.clip_x1 - 1;
+  if (x0 > x1)
+    return;
+
+  kernel_fill_row(target_pixel(x0, y), (x1 - x0 + 1) * video_format.bytes_pp,
+                  pat, false);
+}
+
+// Vertical run [y0, y1] in column x, clipped once
+static void vspan(int32_t x, int32_t y0, int32_t y1, pixel_t pixel) {
+  if (y0 > y1) {
+    int32_t t = y0;
+    y0 = y1;
+    y1 = t;
+  }
+  if (x < video_target.clip_x0 || x >= video_target.clip_x1)
+    return;
+  if (y0 < video_target.clip_y0)
+    y0 = video_target.clip_y0;
+  if (y1 >= video_target.clip_y1)
+    y1 = video_target.clip_y1 - 1;
+
+  uint8_t *dest = target_pixel(x, y0);
+  for (int32_t y = y0; y <= y1; ++y) {
+    video_format.ops->put_pixel(dest, pixel);
+    dest += video_target.pitch;
+  }
+}
+
+// Mark the clipped bounding box of a primitive as damaged
+static void mark_bounds(int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+  if (x0 > x1) {
+    int32_t t = x0;
+    x0 = x1;
+    x1 = t;
+  }
+  if (y0 > y1) {
+    int32_t t = y0;
+    y0 = y1;
+    y1 = t;
+  }
+  if (x0 < video_target.clip_x0)
+    x0 = video_target.clip_x0;
+  if (y0 < video_target.clip_y0)
+    y0 = video_target.clip_y0;
+  if (x1 >= video_target.clip_x1)
+    x1 = video_target.clip_x1 - 1;
+  if (y1 >= video_target.clip_y1)
+    y1 = video_target.clip_y1 - 1;
+
+  if (x0 <= x1 && y0 <= y1)
+    video_mark_dirty(x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+}
+
+// Which sides of the clip rect a point lies beyond
+static uint8_t outcode(int32_t x, int32_t y) {
+  uint8_t code = 0;
+  if (x < video_target.clip_x0)
+    code |= OUT_LEFT;
+  else if (x >= video_target.clip_x1)
+    code |= OUT_RIGHT;
+  if (y < video_target.clip_y0)
+    code |= OUT_TOP;
+  else if (y >= video_target.clip_y1)
+    code |= OUT_BOTTOM;
+  return code;
+}
+
+/**
+ * Ellipse as horizontal spans, one quadrant mirrored four ways.
+ * x(y) is the widest column still inside an ellipse with radii grown by half
+ * a pixel, walked down from rx as y grows so no square roots are needed.
+ * Outlines use the spans between x(y + 1) and x(y), which keeps flat parts
+ * of the curve connected.
+ */
+static void ellipse(int16_t cx, int16_t cy, uint16_t rx, uint16_t ry,
+                    color_t color, bool filled) {
+  int32_t ccx = CLAMP_COORD(cx), ccy = CLAMP_COORD(cy);
+  int64_t a2 = (2 * (int64_t)(rx > COORD_LIMIT ? COORD_LIMIT : rx) + 1);
+  int64_t b2 = (2 * (int64_t)(ry > COORD_LIMIT ? COORD_LIMIT : ry) + 1);
+  a2 *= a2;
+  b2 *= b2;
+  int64_t limit = a2 * b2;
+  int32_t height = ry > COORD_LIMIT ? COORD_LIMIT : ry;
+
+  fill_pattern_t pattern;
+  kernel_make_pattern(&pattern, video_pack_color(color),
+                      video_format.bytes_pp);
+
+  // Inside test in doubled coordinates: (2x)^2 b2 + (2y)^2 a2 <= a2 b2
+  int32_t x = rx > COORD_LIMIT ? COORD_LIMIT : rx;
+  int32_t next_x = x;
+  for (int32_t y = 0; y <= height; ++y) {
+    int32_t cur_x = next_x;
+
+    if (y < height) {
+      int64_t y_term = 4 * (int64_t)(y + 1) * (y + 1) * a2;
+      while (next_x > 0 && 4 * (int64_t)next_x * next_x * b2 + y_term > limit)
+        next_x--;
+    }
+
+    if (filled) {
+      span(ccx - cur_x, ccx + cur_x, ccy + y, &pattern);
+      if (y > 0)
+        span(ccx - cur_x, ccx + cur_x, ccy - y, &pattern);
+      continue;
+    }
+
+    int32_t inner = (y == height) ? 0 : next_x + 1;
+    if (inner > cur_x)
+      inner = cur_x;
+
+    span(ccx + inner, ccx + cur_x, ccy + y, &pattern);
+    span(ccx - cur_x, ccx - inner, ccy + y, &pattern);
+    if (y > 0) {
+      span(ccx + inner, ccx + cur_x, ccy - y, &pattern);
+      span(ccx - cur_x, ccx - inner, ccy - y, &pattern);
+    }
+  }
+
+  mark_bounds(ccx - x, ccy - height, ccx + x, ccy + height);
+}
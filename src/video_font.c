@@ -0,0 +1,536 @@
+#include "font.h"
+#include "font8x8_basic.h"
+#include "memory.h"
+#include "video.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define MAX_FONT_SCALE 4
+#define MAX_CELL_SIZE 255 // The console keeps cell sizes in a byte
+#define MAX_ATLAS_GLYPHS 256
+#define RUN_CHUNK 64 // Glyphs per pass of a text run
+#define BLEND_SLOTS_MAX 1024 // Pre-blended glyphs of anti-aliased fonts
+#define BLEND_CACHE_BYTES (1024 * 1024)
+
+// Font in use, the built-in one until video_set_font() is called
+static font_t font;
+static uint8_t font_scale = 0;
+static uint16_t cell_w = 0;
+static uint16_t cell_h = 0;
+
+/*
+ * Pre-rasterized glyphs. Every font pixel is widened to 'scale' target pixels
+ * of 0xFF or 0x00 bytes, so a glyph row becomes one mask select against the
+ * fg and bg patterns, drawn 'scale' times for the vertical scaling. The
+ * atlas holds only unscaled rows and is rebuilt when the target pixel size
+ * changes, the allocation covers 4 bytes per pixel for that reason.
+ * Anti-aliased fonts keep one coverage byte per pixel instead.
+ */
+static uint8_t *atlas = 0;
+static uint32_t atlas_capacity = 0;
+static uint16_t atlas_glyphs = 0;
+static uint8_t atlas_bpp = 0; // 0 = not built for the current target
+static bool use_atlas = false;
+
+// Fill patterns of the last colors drawn, rebuilt only when they change
+struct pattern_cache {
+  fill_pattern_t pattern;
+  pixel_t pixel;
+  uint8_t bytes_pp;
+};
+static struct pattern_cache fg_cache;
+static struct pattern_cache bg_cache;
+
+/*
+ * Anti-aliased glyphs in the colors they were last drawn with, converted to
+ * the target pixel format. Text on a known background is copied from here,
+ * only glyphs drawn over whatever is on screen are blended. Slots are direct
+ * mapped by glyph and colors, each holds the unscaled rows of one cell. As
+ * many as fit in BLEND_CACHE_BYTES, a power of two.
+ */
+struct blend_tag {
+  uint16_t glyph; // Index + 1, 0 = empty
+  pixel_t fg;
+  pixel_t bg;
+};
+static struct blend_tag blend_tags[BLEND_SLOTS_MAX];
+static uint32_t blend_pass[BLEND_SLOTS_MAX]; // Run pass that last used it
+static uint32_t blend_passes = 0;
+static uint16_t blend_slots = 0; // 0 = no memory, blend every time
+static uint8_t *blend_cache = 0;
+static uint32_t blend_capacity = 0;
+static uint32_t blend_format = 0; // 0 = every slot is stale
+
+// Every coverage level blended from bg to fg, for filling slots
+static pixel_t ramp[256];
+static pixel_t ramp_fg, ramp_bg;
+static uint32_t ramp_format = 0;
+
+// Helper function declaration
+static bool font_ready(void);
+static void build_atlas(void);
+static const fill_pattern_t *cached_pattern(struct pattern_cache *cache,
+                                            pixel_t pixel);
+static void draw_cell(char c, uint16_t x, uint16_t y, pixel_t fg, pixel_t bg,
+                      bool opaque);
+static uint32_t blend_slot_bytes(void);
+static uint16_t blend_slot(uint8_t index, pixel_t fg, pixel_t bg);
+static bool blend_slot_holds(uint16_t slot, uint8_t index, pixel_t fg,
+                             pixel_t bg);
+static const uint8_t *blended_glyph(uint8_t index, pixel_t fg, pixel_t bg);
+static void build_ramp(pixel_t fg, pixel_t bg);
+static void ramp_row(uint8_t *dest, const uint8_t *coverage, uint16_t count);
+static void blend_row(uint8_t *dest, const uint8_t *coverage, uint16_t count,
+                      pixel_t fg);
+static void draw_smooth_cell(uint8_t index, uint16_t x, uint16_t y,
+                             pixel_t fg, pixel_t bg, bool opaque);
+static void draw_smooth_run(const char *str, uint16_t count, uint16_t x,
+                            uint16_t y, pixel_t fg, pixel_t bg);
+
+// Select the font used for text, NULL selects the built-in 8x8 font
+int8_t video_set_font(const font_t *new_font, uint8_t scale) {
+  font_t f;
+  if (new_font)
+    f = *new_font;
+  else
+    font_builtin(&f);
+
+  if (scale == 0 || scale > MAX_FONT_SCALE)
+    return -1;
+
+  uint32_t width = (uint32_t)f.width * scale;
+  uint32_t height = (uint32_t)f.height * scale;
+  if (width > MAX_CELL_SIZE || height > MAX_CELL_SIZE)
+    return -1;
+
+  // Without memory for an atlas, the built-in font at its own size can
+  // still be drawn by the per-format glyph kernels
+  bool direct = !f.coverage && f.lsb_left && f.row_bytes == 1 &&
+                f.width == FONT_WIDTH && f.height == FONT_HEIGHT && scale == 1;
+
+  // A large enough atlas is reused
+  uint16_t glyphs =
+      f.glyph_count < MAX_ATLAS_GLYPHS ? f.glyph_count : MAX_ATLAS_GLYPHS;
+  uint32_t size = (uint32_t)glyphs * f.height * width * 4;
+  bool have_atlas = size <= atlas_capacity;
+  if (!have_atlas) {
+    uint8_t *buffer = mem_alloc(size, 16);
+    if (buffer) {
+      atlas = buffer;
+      atlas_capacity = size;
+      have_atlas = true;
+    } else if (!direct) {
+      return -1;
+    }
+  }
+
+  // Without pre-blended glyphs anti-aliased text is blended every time
+  uint16_t slots = 0;
+  if (f.coverage) {
+    uint32_t slot_bytes = f.height * width * 4;
+    slots = BLEND_SLOTS_MAX;
+    while (slots > 1 && slots * slot_bytes > BLEND_CACHE_BYTES)
+      slots /= 2;
+
+    if (slots * slot_bytes > blend_capacity) {
+      uint8_t *buffer = mem_alloc(slots * slot_bytes, 16);
+      if (buffer) {
+        blend_cache = buffer;
+        blend_capacity = slots * slot_bytes;
+      } else {
+        slots = 0;
+      }
+    }
+  }
+
+  font = f;
+  font_scale = scale;
+  cell_w = width;
+  cell_h = height;
+  use_atlas = have_atlas;
+  atlas_glyphs = glyphs;
+  atlas_bpp = 0;
+  blend_slots = slots;
+  blend_format = 0;
+  return 0;
+}
+
+uint16_t video_font_width(void) { return cell_w ? cell_w : FONT_WIDTH; }
+
+uint16_t video_font_height(void) { return cell_h ? cell_h : FONT_HEIGHT; }
+
+// Draw character to screen
+void video_draw_char(char c, uint16_t x, uint16_t y, color_t color) {
+  video_draw_glyph(c, x, y, video_pack_color(color));
+}
+
+// Draw character with a pre-packed pixel
+void video_draw_glyph(char c, uint16_t x, uint16_t y, pixel_t pixel) {
+  if (!font_ready())
+    return;
+
+  // Safety Bounds Check: Ensure we don't draw outside the framebuffer
+  // (uint32_t) -> So that x is casted up to int before adding
+  if ((uint32_t)x + cell_w > video_target.width ||
+      (uint32_t)y + cell_h > video_target.height) {
+    return;
+  }
+  if (c == ' ') {
+    return video_fill(x, y, cell_w, cell_h, pixel);
+  }
+
+  draw_cell(c, x, y, pixel, 0, false);
+}
+
+// Draw character with its background, overwriting the whole cell
+void video_draw_glyph_opaque(char c, uint16_t x, uint16_t y, pixel_t fg,
+                             pixel_t bg) {
+  if (!font_ready())
+    return;
+
+  if ((uint32_t)x + cell_w > video_target.width ||
+      (uint32_t)y + cell_h > video_target.height) {
+    return;
+  }
+
+  draw_cell(c, x, y, fg, bg, true);
+}
+
+// Draw a run of characters with their background
+void video_draw_text(const char *str, uint16_t len, uint16_t x, uint16_t y,
+                     color_t fg, color_t bg) {
+  video_draw_glyph_run(str, len, x, y, video_pack_color(fg),
+                       video_pack_color(bg));
+}
+
+// Draw the run one scanline at a time across all its glyphs, so every target
+// row is written front to back in a single pass
+void video_draw_glyph_run(const char *str, uint16_t len, uint16_t x,
+                          uint16_t y, pixel_t fg, pixel_t bg) {
+  if (!font_ready())
+    return;
+
+  // Only whole cells are drawn, like single glyphs
+  if ((uint32_t)x + cell_w > video_target.width ||
+      (uint32_t)y + cell_h > video_target.height) {
+    return;
+  }
+  uint16_t fit = (video_target.width - x) / cell_w;
+  uint16_t count = len < fit ? len : fit;
+  if (count == 0)
+    return;
+
+  if (font.coverage) {
+    draw_smooth_run(str, count, x, y, fg, bg);
+    return;
+  }
+
+  if (!use_atlas) {
+    for (uint16_t i = 0; i < count; ++i)
+      draw_cell(str[i], x + i * cell_w, y, fg, bg, true);
+    return;
+  }
+
+  uint8_t bytes_pp = video_format.bytes_pp;
+  uint32_t row_bytes = (uint32_t)cell_w * bytes_pp;
+  uint32_t glyph_stride = font.height * row_bytes;
+  const fill_pattern_t *fg_pattern = cached_pattern(&fg_cache, fg);
+  const fill_pattern_t *bg_pattern = cached_pattern(&bg_cache, bg);
+  const uint8_t *masks[RUN_CHUNK];
+
+  for (uint16_t start = 0; start < count; start += RUN_CHUNK) {
+    uint16_t n = count - start < RUN_CHUNK ? count - start : RUN_CHUNK;
+    for (uint16_t i = 0; i < n; ++i) {
+      uint8_t index = (uint8_t)str[start + i];
+      masks[i] = index < atlas_glyphs ? atlas + index * glyph_stride : 0;
+    }
+
+    uint8_t *dest = target_pixel(x + start * cell_w, y);
+    for (uint16_t row = 0; row < font.height; ++row) {
+      for (uint8_t i = 0; i < font_scale; ++i) {
+        kernel_glyph_run(dest, masks, n, row_bytes, row * row_bytes,
+                         fg_pattern, bg_pattern);
+        dest += video_target.pitch;
+      }
+    }
+  }
+
+  video_mark_dirty(x, y, count * cell_w, cell_h);
+}
+
+void video_clear_char(uint16_t x, uint16_t y, color_t color) {
+  if (!font_ready())
+    return;
+
+  if ((uint32_t)x + cell_w > video_target.width ||
+      (uint32_t)y + cell_h > video_target.height) {
+    return;
+  }
+
+  video_fill(x, y, cell_w, cell_h, video_pack_color(color));
+}
+
+// Helper functions
+// Pick the built-in font on first use and keep the atlas in the pixel size of
+// the draw target
+static bool font_ready(void) {
+  if (font_scale == 0 && video_set_font(0, 1) != 0)
+    return false;
+
+  uint8_t bytes_pp = font.coverage ? 1 : video_format.bytes_pp;
+  if (use_atlas && atlas_bpp != bytes_pp)
+    build_atlas();
+  return true;
+}
+
+static void build_atlas(void) {
+  uint8_t bytes_pp = font.coverage ? 1 : video_format.bytes_pp;
+  uint8_t *dest = atlas;
+
+  for (uint16_t g = 0; g < atlas_glyphs; ++g) {
+    const uint8_t *glyph = font.glyphs + (uint32_t)g * font.glyph_bytes;
+
+    for (uint16_t y = 0; y < font.height; ++y) {
+      for (uint16_t x = 0; x < font.width; ++x) {
+        uint8_t value = font_coverage(&font, glyph, x, y);
+        for (uint16_t i = 0; i < font_scale * bytes_pp; ++i)
+          *dest++ = value;
+      }
+    }
+  }
+
+  atlas_bpp = bytes_pp;
+}
+
+static const fill_pattern_t *cached_pattern(struct pattern_cache *cache,
+                                            pixel_t pixel) {
+  if (cache->pixel != pixel || cache->bytes_pp != video_format.bytes_pp) {
+    kernel_make_pattern(&cache->pattern, pixel, video_format.bytes_pp);
+    cache->pixel = pixel;
+    cache->bytes_pp = video_format.bytes_pp;
+  }
+  return &cache->pattern;
+}
+
+// Draw one cell already known to be inside the target. Characters the font
+// has no glyph for leave only their background
+static void draw_cell(char c, uint16_t x, uint16_t y, pixel_t fg, pixel_t bg,
+                      bool opaque) {
+  uint8_t index = (uint8_t)c;
+  if (index >= atlas_glyphs) {
+    if (opaque)
+      video_fill(x, y, cell_w, cell_h, bg);
+    return;
+  }
+
+  if (font.coverage) {
+    draw_smooth_cell(index, x, y, fg, bg, opaque);
+    return;
+  }
+
+  uint8_t *dest = target_pixel(x, y);
+
+  if (!use_atlas) {
+    video_format.ops->draw_glyph(dest, video_target.pitch,
+                                 font.glyphs + index * font.glyph_bytes, fg,
+                                 bg, opaque);
+    video_mark_dirty(x, y, cell_w, cell_h);
+    return;
+  }
+
+  uint32_t row_bytes = (uint32_t)cell_w * video_format.bytes_pp;
+  const uint8_t *mask = atlas + (uint32_t)index * font.height * row_bytes;
+  const fill_pattern_t *fg_pattern = cached_pattern(&fg_cache, fg);
+  const fill_pattern_t *bg_pattern =
+      opaque ? cached_pattern(&bg_cache, bg) : 0;
+
+  for (uint16_t row = 0; row < font.height; ++row, mask += row_bytes) {
+    for (uint8_t i = 0; i < font_scale; ++i) {
+      kernel_glyph_row(dest, mask, row_bytes, fg_pattern, bg_pattern);
+      dest += video_target.pitch;
+    }
+  }
+
+  video_mark_dirty(x, y, cell_w, cell_h);
+}
+
+// Slots are sized for 4 bytes per pixel, whatever the target uses
+static uint32_t blend_slot_bytes(void) {
+  return (uint32_t)font.height * cell_w * 4;
+}
+
+static uint16_t blend_slot(uint8_t index, pixel_t fg, pixel_t bg) {
+  uint32_t hash = index * 0x9E3779B1 ^ fg * 0x85EBCA6B ^ bg * 0xC2B2AE35;
+  return (hash >> 16) & (blend_slots - 1);
+}
+
+static bool blend_slot_holds(uint16_t slot, uint8_t index, pixel_t fg,
+                             pixel_t bg) {
+  const struct blend_tag *tag = &blend_tags[slot];
+  return tag->glyph == index + 1 && tag->fg == fg && tag->bg == bg;
+}
+
+// Rows of the glyph blended onto 'bg', NULL without memory for the slots
+static const uint8_t *blended_glyph(uint8_t index, pixel_t fg, pixel_t bg) {
+  if (blend_slots == 0)
+    return 0;
+
+  uint32_t format = pixel_format_key(&video_format);
+  if (blend_format != format) {
+    for (uint16_t i = 0; i < blend_slots; ++i)
+      blend_tags[i].glyph = 0;
+    blend_format = format;
+  }
+
+  uint32_t slot_bytes = blend_slot_bytes();
+  uint16_t slot = blend_slot(index, fg, bg);
+  uint8_t *pixels = blend_cache + slot * slot_bytes;
+  if (blend_slot_holds(slot, index, fg, bg))
+    return pixels;
+
+  build_ramp(fg, bg);
+  const uint8_t *coverage = atlas + (uint32_t)index * font.height * cell_w;
+  uint32_t row_bytes = (uint32_t)cell_w * video_format.bytes_pp;
+  for (uint16_t row = 0; row < font.height; ++row)
+    ramp_row(pixels + row * row_bytes, coverage + row * cell_w, cell_w);
+
+  blend_tags[slot] = (struct blend_tag){.glyph = index + 1, .fg = fg, .bg = bg};
+  return pixels;
+}
+
+// Each level is packed from the exact blend, ends included
+static void build_ramp(pixel_t fg, pixel_t bg) {
+  uint32_t format = pixel_format_key(&video_format);
+  if (ramp_format == format && ramp_fg == fg && ramp_bg == bg)
+    return;
+
+  uint32_t f = pixel_to_xrgb((const uint8_t *)&fg, &video_format);
+  uint32_t b = pixel_to_xrgb((const uint8_t *)&bg, &video_format);
+  ramp[0] = bg;
+  ramp[255] = fg;
+  for (uint16_t a = 1; a < 255; ++a) {
+    color_t color;
+    uint8_t *channels[3] = {&color.b, &color.g, &color.r};
+    for (uint8_t c = 0; c < 3; ++c) {
+      uint32_t t = ((f >> (c * 8)) & 0xFF) * a +
+                   ((b >> (c * 8)) & 0xFF) * (255 - a) + 128;
+      *channels[c] = (t + (t >> 8)) >> 8;
+    }
+    ramp[a] = video_pack_color(color);
+  }
+
+  ramp_fg = fg;
+  ramp_bg = bg;
+  ramp_format = format;
+}
+
+static void ramp_row(uint8_t *dest, const uint8_t *coverage, uint16_t count) {
+  uint8_t bytes_pp = video_format.bytes_pp;
+  for (uint16_t i = 0; i < count; ++i) {
+    pixel_t pixel = ramp[coverage[i]];
+    for (uint8_t b = 0; b < bytes_pp; ++b)
+      *dest++ = (uint8_t)(pixel >> (b * 8));
+  }
+}
+
+// Blend over the pixels already there, with SSE2 on 32bpp targets
+static void blend_row(uint8_t *dest, const uint8_t *coverage, uint16_t count,
+                      pixel_t fg) {
+  if (video_format.xrgb8888) {
+    kernel_blend_coverage32(dest, coverage, count, fg);
+    return;
+  }
+
+  uint8_t bytes_pp = video_format.bytes_pp;
+  uint32_t f = pixel_to_xrgb((const uint8_t *)&fg, &video_format);
+  for (uint16_t i = 0; i < count; ++i, dest += bytes_pp) {
+    uint32_t a = coverage[i];
+    if (a == 0)
+      continue;
+    if (a == 255) {
+      video_format.ops->put_pixel(dest, fg);
+      continue;
+    }
+
+    uint32_t d = pixel_to_xrgb(dest, &video_format);
+    color_t color;
+    uint8_t *channels[3] = {&color.b, &color.g, &color.r};
+    for (uint8_t c = 0; c < 3; ++c) {
+      uint32_t t = ((f >> (c * 8)) & 0xFF) * a +
+                   ((d >> (c * 8)) & 0xFF) * (255 - a) + 128;
+      *channels[c] = (t + (t >> 8)) >> 8;
+    }
+    video_format.ops->put_pixel(dest, video_pack_color(color));
+  }
+}
+
+// Opaque cells are copied from their pre-blended slot
+static void draw_smooth_cell(uint8_t index, uint16_t x, uint16_t y,
+                             pixel_t fg, pixel_t bg, bool opaque) {
+  uint8_t *dest = target_pixel(x, y);
+  uint32_t row_bytes = (uint32_t)cell_w * video_format.bytes_pp;
+  const uint8_t *coverage = atlas + (uint32_t)index * font.height * cell_w;
+  const uint8_t *blended = opaque ? blended_glyph(index, fg, bg) : 0;
+  if (opaque && blended == 0)
+    build_ramp(fg, bg);
+
+  for (uint16_t row = 0; row < font.height; ++row, coverage += cell_w) {
+    for (uint8_t i = 0; i < font_scale; ++i) {
+      if (blended)
+        kernel_copy_row(dest, blended + row * row_bytes, row_bytes, false);
+      else if (opaque)
+        ramp_row(dest, coverage, cell_w);
+      else
+        blend_row(dest, coverage, cell_w, fg);
+      dest += video_target.pitch;
+    }
+  }
+
+  video_mark_dirty(x, y, cell_w, cell_h);
+}
+
+// Like the 1-bit run, a scanline at a time over all glyphs. A pass ends
+// early where a glyph would evict the slot of another one in it
+static void draw_smooth_run(const char *str, uint16_t count, uint16_t x,
+                            uint16_t y, pixel_t fg, pixel_t bg) {
+  if (blend_slots == 0) {
+    for (uint16_t i = 0; i < count; ++i)
+      draw_cell(str[i], x + i * cell_w, y, fg, bg, true);
+    return;
+  }
+
+  uint32_t row_bytes = (uint32_t)cell_w * video_format.bytes_pp;
+  const fill_pattern_t *bg_pattern = cached_pattern(&bg_cache, bg);
+  const uint8_t *sources[RUN_CHUNK];
+
+  for (uint16_t start = 0; start < count;) {
+    uint32_t pass = ++blend_passes;
+    uint16_t n = 0;
+    while (n < RUN_CHUNK && start + n < count) {
+      uint8_t index = (uint8_t)str[start + n];
+      if (index >= atlas_glyphs) {
+        sources[n++] = 0;
+        continue;
+      }
+
+      uint16_t slot = blend_slot(index, fg, bg);
+      if (blend_pass[slot] == pass && !blend_slot_holds(slot, index, fg, bg))
+        break;
+      blend_pass[slot] = pass;
+      sources[n++] = blended_glyph(index, fg, bg);
+    }
+
+    uint8_t *dest = target_pixel(x + start * cell_w, y);
+    for (uint16_t row = 0; row < font.height; ++row) {
+      for (uint8_t i = 0; i < font_scale; ++i) {
+        kernel_copy_run(dest, sources, n, row_bytes, row * row_bytes,
+                        bg_pattern);
+        dest += video_target.pitch;
+      }
+    }
+    start += n;
+  }
+
+  video_mark_dirty(x, y, count * cell_w, cell_h);
+}
@@ -0,0 +1,911 @@
+#include "video_kernels.h"
+
+// Only these functions are compiled with SSE2, the rest of the kernel stays
+// free of XMM code
+#define SSE2 __attribute__((target("sse2")))
+
+// Vector types
+typedef long long v2di __attribute__((vector_size(16)));
+typedef long long v2di_u __attribute__((vector_size(16), aligned(1)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef unsigned v4su __attribute__((vector_size(16)));
+typedef short v8hi __attribute__((vector_size(16)));
+typedef unsigned short v8hu __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+
+// Glyph row expansion table, 8 KiB
+static uint32_t glyph_masks[256][8] __attribute__((aligned(16)));
+
+// Helpers
+static inline SSE2 v2di load_unaligned(const uint8_t *src) {
+  return *(const v2di_u *)src;
+}
+
+static inline SSE2 void store(uint8_t *dest, v2di value, bool nontemporal) {
+  if (nontemporal)
+    __builtin_ia32_movntdq((v2di *)dest, value);
+  else
+    *(v2di *)dest = value;
+}
+
+// Build the repeating byte pattern for one pixel value
+void kernel_make_pattern(fill_pattern_t *pat, uint32_t pixel,
+                         uint8_t bytes_pp) {
+  for (uint8_t i = 0; i < sizeof(pat->bytes); ++i) {
+    pat->bytes[i] = (uint8_t)(pixel >> ((i % bytes_pp) * 8));
+  }
+}
+
+// Fill a row with the pattern: byte head, aligned 48-byte body, byte tail
+SSE2 void kernel_fill_row(uint8_t *dest, uint32_t bytes,
+                          const fill_pattern_t *pat, bool nontemporal) {
+  const uint8_t *p = pat->bytes;
+
+  // Bytes needed to reach a 16-byte boundary
+  uint32_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+  if (head > bytes)
+    head = bytes;
+
+  for (uint32_t i = 0; i < head; ++i)
+    dest[i] = p[i];
+  dest += head;
+  bytes -= head;
+
+  // The head shifted the phase of the pattern, load the body from there
+  uint32_t phase = head;
+  v2di v0 = load_unaligned(p + phase);
+  v2di v1 = load_unaligned(p + phase + 16);
+  v2di v2 = load_unaligned(p + phase + 32);
+
+  if (nontemporal) {
+    while (bytes >= 48) {
+      __builtin_ia32_movntdq((v2di *)dest, v0);
+      __builtin_ia32_movntdq((v2di *)(dest + 16), v1);
+      __builtin_ia32_movntdq((v2di *)(dest + 32), v2);
+      dest += 48;
+      bytes -= 48;
+    }
+  } else {
+    while (bytes >= 48) {
+      *(v2di *)dest = v0;
+      *(v2di *)(dest + 16) = v1;
+      *(v2di *)(dest + 32) = v2;
+      dest += 48;
+      bytes -= 48;
+    }
+  }
+
+  // At most two whole vectors remain
+  if (bytes >= 16) {
+    store(dest, v0, nontemporal);
+    dest += 16;
+    bytes -= 16;
+    phase += 16;
+  }
+  if (bytes >= 16) {
+    store(dest, v1, nontemporal);
+    dest += 16;
+    bytes -= 16;
+    phase += 16;
+  }
+
+  for (uint32_t i = 0; i < bytes; ++i)
+    dest[i] = p[phase + i];
+
+  if (nontemporal)
+    __builtin_ia32_sfence();
+}
+
+// Copy a row: byte head, aligned 64-byte body, byte tail
+SSE2 void kernel_copy_row(uint8_t *dest, const uint8_t *src, uint32_t bytes,
+                          bool nontemporal) {
+  uint32_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+  if (head > bytes)
+    head = bytes;
+
+  for (uint32_t i = 0; i < head; ++i)
+    dest[i] = src[i];
+  dest += head;
+  src += head;
+  bytes -= head;
+
+  if (nontemporal) {
+    while (bytes >= 64) {
+      v2di a = load_unaligned(src);
+      v2di b = load_unaligned(src + 16);
+      v2di c = load_unaligned(src + 32);
+      v2di d = load_unaligned(src + 48);
+      __builtin_ia32_movntdq((v2di *)dest, a);
+      __builtin_ia32_movntdq((v2di *)(dest + 16), b);
+      __builtin_ia32_movntdq((v2di *)(dest + 32), c);
+      __builtin_ia32_movntdq((v2di *)(dest + 48), d);
+      dest += 64;
+      src += 64;
+      bytes -= 64;
+    }
+  } else {
+    while (bytes >= 64) {
+      v2di a = load_unaligned(src);
+      v2di b = load_unaligned(src + 16);
+      v2di c = load_unaligned(src + 32);
+      v2di d = load_unaligned(src + 48);
+      *(v2di *)dest = a;
+      *(v2di *)(dest + 16) = b;
+      *(v2di *)(dest + 32) = c;
+      *(v2di *)(dest + 48) = d;
+      dest += 64;
+      src += 64;
+      bytes -= 64;
+    }
+  }
+
+  while (bytes >= 16) {
+    store(dest, load_unaligned(src), nontemporal);
+    dest += 16;
+    src += 16;
+    bytes -= 16;
+  }
+
+  for (uint32_t i = 0; i < bytes; ++i)
+    dest[i] = src[i];
+
+  if (nontemporal)
+    __builtin_ia32_sfence();
+}
+
+// The string unit picks its own store width, which on some machines beats
+// 16-byte stores into write-combined memory
+void kernel_copy_row_rep(uint8_t *dest, const uint8_t *src, uint32_t bytes) {
+  uint32_t dwords = bytes >> 2;
+  asm volatile("rep movsl"
+               : "+D"(dest), "+S"(src), "+c"(dwords)
+               :
+               : "memory");
+
+  for (uint32_t i = 0; i < (bytes & 3); ++i)
+    dest[i] = src[i];
+}
+
+// Expand every possible glyph row into lane masks
+void kernel_init_glyph_masks(void) {
+  for (uint32_t row = 0; row < 256; ++row) {
+    for (uint8_t col = 0; col < 8; ++col) {
+      glyph_masks[row][col] = (row >> col) & 1 ? 0xFFFFFFFF : 0;
+    }
+  }
+}
+
+const uint32_t *kernel_glyph_mask(uint8_t row) { return glyph_masks[row]; }
+
+// 32bpp glyph: two 4-pixel blends per row
+SSE2 void kernel_glyph32(uint8_t *dest, uint32_t pitch, const uint8_t *rows,
+                         uint8_t height, uint32_t fg, uint32_t bg,
+                         bool opaque) {
+  v2di f = (v2di)(v4si){(int)fg, (int)fg, (int)fg, (int)fg};
+  v2di b = (v2di)(v4si){(int)bg, (int)bg, (int)bg, (int)bg};
+
+  for (uint8_t i = 0; i < height; ++i) {
+    const v2di *m = (const v2di *)glyph_masks[rows[i]];
+    v2di_u *d = (v2di_u *)dest;
+
+    // Transparent glyphs blend over what is already there
+    v2di b0 = opaque ? b : d[0];
+    v2di b1 = opaque ? b : d[1];
+    d[0] = (f & m[0]) | (b0 & ~m[0]);
+    d[1] = (f & m[1]) | (b1 & ~m[1]);
+
+    dest += pitch;
+  }
+}
+
+// 16bpp glyph: the 32-bit masks narrow to 16-bit lanes with a signed pack,
+// so a whole row is a single blend
+SSE2 void kernel_glyph16(uint8_t *dest, uint32_t pitch, const uint8_t *rows,
+                         uint8_t height, uint16_t fg, uint16_t bg,
+                         bool opaque) {
+  short f16 = (short)fg;
+  short b16 = (short)bg;
+  v2di f = (v2di)(v8hi){f16, f16, f16, f16, f16, f16, f16, f16};
+  v2di b = (v2di)(v8hi){b16, b16, b16, b16, b16, b16, b16, b16};
+
+  for (uint8_t i = 0; i < height; ++i) {
+    const v4si *m32 = (const v4si *)glyph_masks[rows[i]];
+    v2di m = (v2di)__builtin_ia32_packssdw128(m32[0], m32[1]);
+    v2di_u *d = (v2di_u *)dest;
+
+    v2di b0 = opaque ? b : d[0];
+    d[0] = (f & m) | (b0 & ~m);
+
+    dest += pitch;
+  }
+}
+
+// Atlas glyph row: the mask bytes select the fg pattern, clear bytes keep
+// dest or take the bg pattern. Rows start on a pixel boundary, so the pattern
+// phase only has to follow the 48-byte period. A NULL mask draws no pixels
+static inline SSE2 void glyph_span(uint8_t *dest, const uint8_t *mask,
+                                   uint32_t bytes, const fill_pattern_t *fg,
+                                   const fill_pattern_t *bg) {
+  uint32_t phase = 0;
+
+  while (bytes >= 16) {
+    v2di m = mask ? load_unaligned(mask) : (v2di){0, 0};
+    v2di f = load_unaligned(fg->bytes + phase);
+    v2di_u *d = (v2di_u *)dest;
+    v2di under = bg ? load_unaligned(bg->bytes + phase) : d[0];
+    d[0] = (f & m) | (under & ~m);
+
+    phase = phase == 32 ? 0 : phase + 16;
+    dest += 16;
+    if (mask)
+      mask += 16;
+    bytes -= 16;
+  }
+
+  for (uint32_t i = 0; i < bytes; ++i) {
+    uint8_t m = mask ? mask[i] : 0;
+    uint8_t under = bg ? bg->bytes[phase + i] : dest[i];
+    dest[i] = (fg->bytes[phase + i] & m) | (under & ~m);
+  }
+}
+
+SSE2 void kernel_glyph_row(uint8_t *dest, const uint8_t *mask, uint32_t bytes,
+                           const fill_pattern_t *fg,
+                           const fill_pattern_t *bg) {
+  glyph_span(dest, mask, bytes, fg, bg);
+}
+
+// One scanline across a run of glyphs, each glyph continues where the
+// previous one ended
+SSE2 void kernel_glyph_run(uint8_t *dest, const uint8_t *const *masks,
+                           uint16_t count, uint32_t glyph_bytes,
+                           uint32_t offset, const fill_pattern_t *fg,
+                           const fill_pattern_t *bg) {
+  for (uint16_t i = 0; i < count; ++i, dest += glyph_bytes) {
+    const uint8_t *mask = masks[i] ? masks[i] + offset : 0;
+    glyph_span(dest, mask, glyph_bytes, fg, bg);
+  }
+}
+
+// Same walk for pre-blended glyphs, whose rows are copied as they are
+SSE2 void kernel_copy_run(uint8_t *dest, const uint8_t *const *sources,
+                          uint16_t count, uint32_t glyph_bytes,
+                          uint32_t offset, const fill_pattern_t *bg) {
+  for (uint16_t i = 0; i < count; ++i, dest += glyph_bytes) {
+    if (sources[i] == 0) {
+      glyph_span(dest, 0, glyph_bytes, bg, bg);
+      continue;
+    }
+
+    const uint8_t *src = sources[i] + offset;
+    uint8_t *d = dest;
+    uint32_t bytes = glyph_bytes;
+    while (bytes >= 16) {
+      *(v2di_u *)d = load_unaligned(src);
+      src += 16;
+      d += 16;
+      bytes -= 16;
+    }
+    for (uint32_t k = 0; k < bytes; ++k)
+      d[k] = src[k];
+  }
+}
+
+// Color key: pcmpeqd picks the pixels to keep from dest
+SSE2 void kernel_blit_colorkey32(uint8_t *dest, const uint32_t *src,
+                                 uint32_t count, uint32_t key) {
+  v4si k = {(int)key, (int)key, (int)key, (int)key};
+
+  while (count >= 4) {
+    v2di s = load_unaligned((const uint8_t *)src);
+    v2di_u *d = (v2di_u *)dest;
+    v2di keep = (v2di)((v4si)s == k);
+    d[0] = (d[0] & keep) | (s & ~keep);
+
+    dest += 16;
+    src += 4;
+    count -= 4;
+  }
+
+  uint32_t *d32 = (uint32_t *)dest;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (src[i] != key)
+      d32[i] = src[i];
+  }
+}
+
+// Paletted color key: pcmpeqb picks the bytes to keep from dest
+SSE2 void kernel_blit_colorkey8(uint8_t *dest, const uint8_t *src,
+                                uint32_t count, uint8_t key) {
+  v16qi k = {0};
+  k += (char)key;
+
+  while (count >= 16) {
+    v2di s = load_unaligned(src);
+    v2di_u *d = (v2di_u *)dest;
+    v2di keep = (v2di)((v16qi)s == k);
+    d[0] = (d[0] & keep) | (s & ~keep);
+
+    dest += 16;
+    src += 16;
+    count -= 16;
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    if (src[i] != key)
+      dest[i] = src[i];
+  }
+}
+
+// Scalar version of one alpha blended channel, matches the SSE2 path
+static inline uint32_t blend_channel(uint32_t s, uint32_t d, uint32_t a) {
+  uint32_t t = s * a + d * (255 - a) + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// Blend 2 pixels widened to 16-bit lanes
+static inline SSE2 v8hu blend_lanes(v8hu s, v8hu d) {
+  // Broadcast each pixel's alpha (lane 3 and 7) over its 4 lanes
+  v8hu a = (v8hu)__builtin_ia32_pshufhw(
+      __builtin_ia32_pshuflw((v8hi)s, 0xFF), 0xFF);
+  v8hu inv = (v8hu){255, 255, 255, 255, 255, 255, 255, 255} - a;
+
+  // s*a + d*(255-a) never exceeds 255*255, so 16-bit lanes are exact
+  v8hu t = s * a + d * inv + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+// Alpha blend, skipping the work for fully opaque or transparent groups
+SSE2 void kernel_blit_alpha32(uint8_t *dest, const uint32_t *src,
+                              uint32_t count) {
+  const v4si alpha_bits = {(int)0xFF000000, (int)0xFF000000, (int)0xFF000000,
+                           (int)0xFF000000};
+  const v16qi zero = {0};
+
+  while (count >= 4) {
+    v2di s = load_unaligned((const uint8_t *)src);
+    v2di_u *d = (v2di_u *)dest;
+    v4si alpha = (v4si)s & alpha_bits;
+
+    int opaque = __builtin_ia32_pmovmskb128((v16qi)(alpha == alpha_bits));
+    int clear = __builtin_ia32_pmovmskb128((v16qi)(alpha == (v4si){0}));
+
+    if (opaque == 0xFFFF) {
+      d[0] = s;
+    } else if (clear != 0xFFFF) {
+      v2di dv = d[0];
+      v8hu s_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)s, zero);
+      v8hu s_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)s, zero);
+      v8hu d_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)dv, zero);
+      v8hu d_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)dv, zero);
+
+      d[0] = (v2di)__builtin_ia32_packuswb128((v8hi)blend_lanes(s_lo, d_lo),
+                                              (v8hi)blend_lanes(s_hi, d_hi));
+    }
+
+    dest += 16;
+    src += 4;
+    count -= 4;
+  }
+
+  uint8_t *d8 = dest;
+  for (uint32_t i = 0; i < count; ++i, d8 += 4) {
+    uint32_t s = src[i];
+    uint32_t a = s >> 24;
+    for (uint8_t c = 0; c < 4; ++c) {
+      d8[c] = (uint8_t)blend_channel((s >> (c * 8)) & 0xFF, d8[c], a);
+    }
+  }
+}
+
+// The coverage becomes the alpha of an ARGB source, so 4 pixels go through
+// the same lanes as an alpha blit. X comes out 0 like in packed pixels
+SSE2 void kernel_blend_coverage32(uint8_t *dest, const uint8_t *coverage,
+                                  uint32_t count, uint32_t fg) {
+  const v16qi zero = {0};
+  int color = fg & 0xFFFFFF;
+  const v4si fg_bits = {color, color, color, color};
+  const v4si rgb_bits = {0xFFFFFF, 0xFFFFFF, 0xFFFFFF, 0xFFFFFF};
+
+  while (count >= 4) {
+    uint32_t c = coverage[0] | coverage[1] << 8 | coverage[2] << 16 |
+                 (uint32_t)coverage[3] << 24;
+    v2di_u *d = (v2di_u *)dest;
+
+    if (c == 0xFFFFFFFF) {
+      d[0] = (v2di)fg_bits;
+    } else if (c != 0) {
+      // Widen the 4 coverage bytes to the top byte of each pixel
+      v8hi c16 = (v8hi)__builtin_ia32_punpcklbw128((v16qi)(v4si){(int)c},
+                                                   zero);
+      v4si c32 = (v4si)__builtin_ia32_punpcklwd128(c16, (v8hi)zero);
+      v2di s = (v2di)(fg_bits | c32 << 24);
+
+      v2di dv = d[0];
+      v8hu s_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)s, zero);
+      v8hu s_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)s, zero);
+      v8hu d_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)dv, zero);
+      v8hu d_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)dv, zero);
+
+      v4si blended = (v4si)__builtin_ia32_packuswb128(
+          (v8hi)blend_lanes(s_lo, d_lo), (v8hi)blend_lanes(s_hi, d_hi));
+      d[0] = (v2di)(blended & rgb_bits);
+    }
+
+    dest += 16;
+    coverage += 4;
+    count -= 4;
+  }
+
+  for (uint32_t i = 0; i < count; ++i, dest += 4) {
+    for (uint8_t k = 0; k < 3; ++k) {
+      dest[k] = (uint8_t)blend_channel((fg >> (k * 8)) & 0xFF, dest[k],
+                                       coverage[i]);
+    }
+    dest[3] = 0;
+  }
+}
+
+// Four lanes of 'value' stepped by 'step' each. Interpolants wrap around
+// outside the triangle, only covered pixels need to be in range
+static inline SSE2 v4si lanes(uint32_t value, uint32_t step) {
+  return (v4si){(int32_t)value, (int32_t)(value + step),
+                (int32_t)(value + 2 * step), (int32_t)(value + 3 * step)};
+}
+
+static inline SSE2 v4si broadcast(int32_t value) {
+  return (v4si){value, value, value, value};
+}
+
+static inline SSE2 v4si advance(v4si lanes, v4si step) {
+  return (v4si)((v4su)lanes + (v4su)step);
+}
+
+// Interpolated 8.16 channels clamped to 0 - 255 and packed as XRGB
+static inline SSE2 v4si shade_pixels(v4si b, v4si g, v4si r) {
+  const v4si top = broadcast(0xFFFFFF);
+  b &= ~(b >> 31);
+  g &= ~(g >> 31);
+  r &= ~(r >> 31);
+  b = (b & ~(b > top)) | (top & (b > top));
+  g = (g & ~(g > top)) | (top & (g > top));
+  r = (r & ~(r > top)) | (top & (r > top));
+  return (r & broadcast(0xFF0000)) | ((g >> 8) & broadcast(0xFF00)) |
+         ((b >> 16) & broadcast(0xFF));
+}
+
+// Texels times shade / 255, channel by channel in 16-bit lanes
+static inline SSE2 v4si modulate(v4si texels, v4si shade) {
+  const v16qi zero = {0};
+  const v8hu round = {255, 255, 255, 255, 255, 255, 255, 255};
+  v8hu t_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)texels, zero);
+  v8hu t_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)texels, zero);
+  v8hu s_lo = (v8hu)__builtin_ia32_punpcklbw128((v16qi)shade, zero);
+  v8hu s_hi = (v8hu)__builtin_ia32_punpckhbw128((v16qi)shade, zero);
+  v8hu lo = (t_lo * s_lo + round) >> 8;
+  v8hu hi = (t_hi * s_hi + round) >> 8;
+  return (v4si)__builtin_ia32_packuswb128((v8hi)lo, (v8hi)hi) &
+         broadcast(0xFFFFFF);
+}
+
+// Shade 4 pixels of a block row, 'keep' masks off lanes past its end
+static inline SSE2 void raster_quad(uint8_t *dest, int16_t *depth,
+                                    const v4si *edge, v4si z, const v4si *shade,
+                                    v4si u, v4si v, v4si keep,
+                                    const raster_block_t *b) {
+  v4si mask = keep;
+  if (!(b->flags & KERNEL_RASTER_COVERED))
+    mask &= ~((edge[0] | edge[1] | edge[2]) >> 31);
+
+  // Depths are loaded as 4 signed 16-bit values widened to 32 bits
+  v8hi old_depth = {0};
+  v4si z16 = z >> 12;
+  if (b->flags & KERNEL_RASTER_DEPTH) {
+    __builtin_memcpy(&old_depth, depth, 8);
+    v4si stored = (v4si)__builtin_ia32_punpcklwd128(old_depth, old_depth) >> 16;
+    mask &= z16 < stored;
+  }
+  if (__builtin_ia32_pmovmskb128((v16qi)mask) == 0)
+    return;
+
+  v4si color = broadcast(b->pixel);
+  if (b->flags & KERNEL_RASTER_GOURAUD)
+    color = shade_pixels(shade[0], shade[1], shade[2]);
+
+  if (b->flags & KERNEL_RASTER_TEXTURED) {
+    union {
+      v4si v;
+      int32_t i[4];
+    } tu = {(u >> 16) & broadcast(b->u_mask)},
+      tv = {(v >> 16) & broadcast(b->v_mask)}, texels;
+    for (uint8_t i = 0; i < 4; ++i)
+      texels.i[i] = b->texels[tv.i[i] * b->texture_stride + tu.i[i]];
+    if (b->flags & KERNEL_RASTER_MODULATE)
+      color = modulate(texels.v, color);
+    else
+      color = texels.v & broadcast(0xFFFFFF);
+  }
+
+  v2di_u *d = (v2di_u *)dest;
+  d[0] = (v2di)((color & mask) | ((v4si)d[0] & ~mask));
+
+  if (b->flags & KERNEL_RASTER_DEPTH) {
+    v8hi mask16 = __builtin_ia32_packssdw128(mask, mask);
+    v8hi new_depth = __builtin_ia32_packssdw128(z16, z16);
+    v8hi merged = (new_depth & mask16) | (old_depth & ~mask16);
+    __builtin_memcpy(depth, &merged, 8);
+  }
+}
+
+// Rows of whole quads, a partial quad at the end goes through a bounce
+// buffer so nothing past the block is touched
+SSE2 void kernel_raster_block(uint8_t *dest, uint32_t pitch, int16_t *depth,
+                              uint32_t depth_pitch, uint8_t w, uint8_t h,
+                              const raster_block_t *b) {
+  const v4si all = broadcast(-1);
+  v4si edge_step[3], shade_step[3];
+  uint32_t edge_row[3], shade_row[3];
+  for (uint8_t k = 0; k < 3; ++k) {
+    edge_step[k] = broadcast(b->edge_dx[k] * 4);
+    shade_step[k] = broadcast((uint32_t)b->shade_dx[k] * 4);
+    edge_row[k] = b->edge[k];
+    shade_row[k] = b->shade[k];
+  }
+  v4si z_step = broadcast((uint32_t)b->z_dx * 4);
+  v4si u_step = broadcast((uint32_t)b->u_dx * 4);
+  v4si v_step = broadcast((uint32_t)b->v_dx * 4);
+  uint32_t z_row = b->z, u_row = b->u, v_row = b->v;
+
+  for (uint8_t row = 0; row < h; ++row) {
+    v4si edge[3], shade[3];
+    for (uint8_t k = 0; k < 3; ++k) {
+      edge[k] = lanes(edge_row[k], b->edge_dx[k]);
+      shade[k] = lanes(shade_row[k], b->shade_dx[k]);
+    }
+    v4si z = lanes(z_row, b->z_dx);
+    v4si u = lanes(u_row, b->u_dx);
+    v4si v = lanes(v_row, b->v_dx);
+
+    uint8_t x = 0;
+    for (; x + 4 <= w; x += 4) {
+      raster_quad(dest + x * 4, depth + x, edge, z, shade, u, v, all, b);
+      for (uint8_t k = 0; k < 3; ++k) {
+        edge[k] = advance(edge[k], edge_step[k]);
+        shade[k] = advance(shade[k], shade_step[k]);
+      }
+      z = advance(z, z_step);
+      u = advance(u, u_step);
+      v = advance(v, v_step);
+    }
+
+    if (x < w) {
+      uint32_t pixels[4];
+      int16_t depths[4];
+      uint8_t n = w - x;
+      for (uint8_t i = 0; i < n; ++i) {
+        pixels[i] = ((uint32_t *)dest)[x + i];
+        depths[i] = depth[x + i];
+      }
+      v4si keep = lanes(0, 1) < broadcast(n);
+      raster_quad((uint8_t *)pixels, depths, edge, z, shade, u, v, keep, b);
+      for (uint8_t i = 0; i < n; ++i) {
+        ((uint32_t *)dest)[x + i] = pixels[i];
+        depth[x + i] = depths[i];
+      }
+    }
+
+    for (uint8_t k = 0; k < 3; ++k) {
+      edge_row[k] += b->edge_dy[k];
+      shade_row[k] += b->shade_dy[k];
+    }
+    z_row += b->z_dy;
+    u_row += b->u_dy;
+    v_row += b->v_dy;
+    dest += pitch;
+    depth = (int16_t *)((uint8_t *)depth + depth_pitch);
+  }
+}
+
+// pmaddwd turns a lane holding the texel column in its low and the row in
+// its high 16 bits into row * stride + column, 4 texel offsets at once
+SSE2 void kernel_affine_nearest(uint32_t *dest, const affine_span_t *span,
+                                uint32_t count) {
+  const uint32_t *texels = span->texels;
+  uint32_t stride = span->stride;
+  uint32_t u = span->u, v = span->v;
+
+  // Columns, rows and the stride must fit signed 16-bit lanes
+  if (stride < 0x8000 && count >= 4) {
+    const v4si row_bits = broadcast((int32_t)0xFFFF0000);
+    const short s = (short)stride;
+    const v8hi weights = {1, s, 1, s, 1, s, 1, s};
+    v4si step_u = broadcast(4 * span->du), step_v = broadcast(4 * span->dv);
+    v4si lu = lanes(u, span->du), lv = lanes(v, span->dv);
+
+    for (; count >= 4; count -= 4, dest += 4) {
+      v4si packed = (lv & row_bits) | (v4si)((v4su)lu >> 16);
+      union {
+        v4si v;
+        int32_t i[4];
+      } offset = {__builtin_ia32_pmaddwd128((v8hi)packed, weights)};
+
+      dest[0] = texels[offset.i[0]];
+      dest[1] = texels[offset.i[1]];
+      dest[2] = texels[offset.i[2]];
+      dest[3] = texels[offset.i[3]];
+      lu = advance(lu, step_u);
+      lv = advance(lv, step_v);
+    }
+    u = lu[0];
+    v = lv[0];
+  }
+
+  for (; count > 0; --count, ++dest) {
+    *dest = texels[(v >> 16) * stride + (u >> 16)];
+    u += span->du;
+    v += span->dv;
+  }
+}
+
+// Both texel pairs of a pixel share a register, top pair in the low half.
+// The vertical lerp weighs the halves against each other, then the left
+// and right texels of 2 pixels are regrouped for the horizontal lerp. The
+// weights are 1 - 256, so every product and sum fits a 16-bit lane
+static inline SSE2 v8hu texel_pairs(const uint32_t *t, uint32_t stride,
+                                    v8hu wv) {
+  const v16qi zero = {0};
+  const v8hu full = {256, 256, 256, 256, 256, 256, 256, 256};
+  const v8hu round = {128, 128, 128, 128, 128, 128, 128, 128};
+  union {
+    v2di v;
+    uint32_t i[4];
+  } pairs;
+  __builtin_memcpy(&pairs.i[0], t, 8);
+  __builtin_memcpy(&pairs.i[2], t + stride, 8);
+
+  v8hu top = (v8hu)__builtin_ia32_punpcklbw128((v16qi)pairs.v, zero);
+  v8hu bottom = (v8hu)__builtin_ia32_punpckhbw128((v16qi)pairs.v, zero);
+  return (top * (full - wv) + bottom * wv + round) >> 8;
+}
+
+// 16-bit weights from the fraction bits of a lane, over the 32-bit lanes
+// picked by 'order'
+#define WEIGHTS(fractions, order)                                              \
+  ({                                                                           \
+    v4si w_ = __builtin_ia32_pshufd((fractions), (order));                     \
+    (v8hu)(w_ | (w_ << 16));                                                   \
+  })
+
+SSE2 void kernel_affine_bilinear(uint32_t *dest, const affine_span_t *span,
+                                 uint32_t count) {
+  const v8hu full = {256, 256, 256, 256, 256, 256, 256, 256};
+  const v8hu round = {128, 128, 128, 128, 128, 128, 128, 128};
+  const v4si low_byte = broadcast(0xFF);
+  const uint32_t *texels = span->texels;
+  uint32_t stride = span->stride;
+
+  // Positions of the next 2 pixels as {u0, u1, v0, v1}
+  v4si pos = {span->u, span->u + span->du, span->v, span->v + span->dv};
+  v4si step = {2 * span->du, 2 * span->du, 2 * span->dv, 2 * span->dv};
+
+  for (; count >= 2; count -= 2, dest += 2) {
+    union {
+      v4si v;
+      uint32_t i[4];
+    } p = {pos};
+    v4si fractions = (v4si)((v4su)pos >> 8) & low_byte;
+
+    v8hu col0 = texel_pairs(texels + (p.i[2] >> 16) * stride + (p.i[0] >> 16),
+                            stride, WEIGHTS(fractions, 0xAA));
+    v8hu col1 = texel_pairs(texels + (p.i[3] >> 16) * stride + (p.i[1] >> 16),
+                            stride, WEIGHTS(fractions, 0xFF));
+
+    // Left texels of both pixels against their right texels
+    v8hu left = (v8hu)__builtin_ia32_punpcklqdq128((v2di)col0, (v2di)col1);
+    v8hu right = (v8hu)__builtin_ia32_punpckhqdq128((v2di)col0, (v2di)col1);
+    v8hu wu = WEIGHTS(fractions, 0x50);
+    v8hu sum = (left * (full - wu) + right * wu + round) >> 8;
+
+    union {
+      v2di v;
+      uint32_t i[4];
+    } out = {(v2di)__builtin_ia32_packuswb128((v8hi)sum, (v8hi)sum)};
+    dest[0] = out.i[0];
+    dest[1] = out.i[1];
+    pos = advance(pos, step);
+  }
+
+  if (count > 0) {
+    uint32_t u = pos[0], v = pos[2];
+    const uint32_t *t = texels + (v >> 16) * stride + (u >> 16);
+    *dest = kernel_bilinear_pixel(t[0], t[1], t[stride], t[stride + 1],
+                                  (u >> 8) & 0xFF, (v >> 8) & 0xFF);
+  }
+}
+
+uint32_t kernel_bilinear_pixel(uint32_t t00, uint32_t t01, uint32_t t10,
+                               uint32_t t11, uint32_t fu, uint32_t fv) {
+  uint32_t pixel = 0;
+
+  for (uint8_t shift = 0; shift < 32; shift += 8) {
+    uint32_t left = (((t00 >> shift) & 0xFF) * (256 - fv) +
+                     ((t10 >> shift) & 0xFF) * fv + 128) >>
+                    8;
+    uint32_t right = (((t01 >> shift) & 0xFF) * (256 - fv) +
+                      ((t11 >> shift) & 0xFF) * fv + 128) >>
+                     8;
+    pixel |= ((left * (256 - fu) + right * fu + 128) >> 8) << shift;
+  }
+  return pixel;
+}
+
+// RGB565/555: shift and mask the channels in 32-bit lanes, then narrow
+SSE2 void kernel_pack_row16(uint8_t *dest, const uint32_t *src, uint32_t count,
+                           bool rgb555) {
+  uint8_t red_shift = rgb555 ? 9 : 8;
+  uint8_t green_shift = rgb555 ? 6 : 5;
+  int red_mask = rgb555 ? 0x7C00 : 0xF800;
+  int green_mask = rgb555 ? 0x03E0 : 0x07E0;
+  v4si r_mask = {red_mask, red_mask, red_mask, red_mask};
+  v4si g_mask = {green_mask, green_mask, green_mask, green_mask};
+  v4si b_mask = {0x1F, 0x1F, 0x1F, 0x1F};
+
+  while (count >= 8) {
+    v4si a = (v4si)load_unaligned((const uint8_t *)src);
+    v4si b = (v4si)load_unaligned((const uint8_t *)(src + 4));
+
+    a = ((a >> red_shift) & r_mask) | ((a >> green_shift) & g_mask) |
+        ((a >> 3) & b_mask);
+    b = ((b >> red_shift) & r_mask) | ((b >> green_shift) & g_mask) |
+        ((b >> 3) & b_mask);
+
+    // Sign extend the 16-bit result so the saturating pack keeps it exact
+    a = (a << 16) >> 16;
+    b = (b << 16) >> 16;
+    *(v2di_u *)dest = (v2di)__builtin_ia32_packssdw128(a, b);
+
+    dest += 16;
+    src += 8;
+    count -= 8;
+  }
+
+  uint16_t *d16 = (uint16_t *)dest;
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t p = src[i];
+    d16[i] = ((p >> red_shift) & red_mask) | ((p >> green_shift) & green_mask) |
+             ((p >> 3) & 0x1F);
+  }
+}
+
+/*
+ * 24bpp: drop the X byte of 4 pixels and close the gaps.
+ * Within each 64-bit half the second pixel moves down one byte next to the
+ * first, then the upper half moves down two bytes next to the lower one.
+ * Each step stores 16 bytes of which 12 are valid, the next step overwrites
+ * the rest, so the last pixels of a row are written one at a time.
+ */
+SSE2 void kernel_pack_row24(uint8_t *dest, const uint32_t *src,
+                            uint32_t count) {
+  const v4si rgb = {0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF, 0x00FFFFFF};
+  const v2di first = {0x00000000FFFFFFFFLL, 0x00000000FFFFFFFFLL};
+  const v2di second = {0x0000FFFFFF000000LL, 0x0000FFFFFF000000LL};
+  const v2di lower = {0x0000FFFFFFFFFFFFLL, 0};
+  const v2di upper = {(long long)0xFFFF000000000000ULL, 0x00000000FFFFFFFFLL};
+
+  while (count >= 6) {
+    v2di p = load_unaligned((const uint8_t *)src) & (v2di)rgb;
+    v2di q = (p & first) | (__builtin_ia32_psrlqi128(p, 8) & second);
+    *(v2di_u *)dest = (q & lower) | (__builtin_ia32_psrldqi128(q, 16) & upper);
+
+    dest += 12;
+    src += 4;
+    count -= 4;
+  }
+
+  for (uint32_t i = 0; i < count; ++i, dest += 3) {
+    dest[0] = (uint8_t)src[i];
+    dest[1] = (uint8_t)(src[i] >> 8);
+    dest[2] = (uint8_t)(src[i] >> 16);
+  }
+}
+
+// Palette expansion: SSE2 has no gather, so table lookups fill the lanes of
+// a register and only the stores are wide. A destination off the pixel grid
+// of its vectors is expanded one pixel at a time
+SSE2 void kernel_expand_row8(uint8_t *dest, const uint8_t *src, uint32_t count,
+                             const uint32_t *lut, uint8_t bytes_pp,
+                             bool nontemporal) {
+  // Pixels before the first 16-byte boundary, or all of them
+  uint32_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+  head = bytes_pp == 3 || head % bytes_pp ? count : head / bytes_pp;
+  if (head > count)
+    head = count;
+  count -= head;
+
+  for (; head > 0; --head) {
+    uint32_t pixel = lut[*src++];
+    for (uint8_t b = 0; b < bytes_pp; ++b)
+      *dest++ = (uint8_t)(pixel >> (b * 8));
+  }
+
+  if (bytes_pp == 4) {
+    for (; count >= 4; count -= 4, src += 4, dest += 16) {
+      v4si p = {(int)lut[src[0]], (int)lut[src[1]], (int)lut[src[2]],
+                (int)lut[src[3]]};
+      store(dest, (v2di)p, nontemporal);
+    }
+  } else if (bytes_pp == 2) {
+    for (; count >= 8; count -= 8, src += 8, dest += 16) {
+      v8hi p = {(short)lut[src[0]], (short)lut[src[1]], (short)lut[src[2]],
+                (short)lut[src[3]], (short)lut[src[4]], (short)lut[src[5]],
+                (short)lut[src[6]], (short)lut[src[7]]};
+      store(dest, (v2di)p, nontemporal);
+    }
+  }
+
+  for (; count > 0; --count) {
+    uint32_t pixel = lut[*src++];
+    for (uint8_t b = 0; b < bytes_pp; ++b)
+      *dest++ = (uint8_t)(pixel >> (b * 8));
+  }
+
+  if (nontemporal)
+    __builtin_ia32_sfence();
+}
+
+// Four 32-bit lanes each repeated 'factor' (2 - 4) times with pshufd
+static inline SSE2 void repeat_lanes(v4si p, uint8_t factor, v4si *out) {
+  switch (factor) {
+  case 2:
+    out[0] = __builtin_ia32_pshufd(p, 0x50);
+    out[1] = __builtin_ia32_pshufd(p, 0xFA);
+    break;
+  case 3:
+    out[0] = __builtin_ia32_pshufd(p, 0x40);
+    out[1] = __builtin_ia32_pshufd(p, 0xA5);
+    out[2] = __builtin_ia32_pshufd(p, 0xFE);
+    break;
+  default:
+    out[0] = __builtin_ia32_pshufd(p, 0x00);
+    out[1] = __builtin_ia32_pshufd(p, 0x55);
+    out[2] = __builtin_ia32_pshufd(p, 0xAA);
+    out[3] = __builtin_ia32_pshufd(p, 0xFF);
+    break;
+  }
+}
+
+// Nearest neighbour widening. 16bpp pixels are sign extended to 32-bit
+// lanes, repeated like 32bpp ones and narrowed again with packssdw, which
+// is exact for sign extended values
+SSE2 void kernel_scale_row(uint8_t *dest, const uint8_t *src, uint32_t count,
+                           uint8_t bytes_pp, uint8_t factor) {
+  uint32_t i = 0;
+  bool lanes = factor >= 2 && factor <= 4;
+
+  if (lanes && bytes_pp == 4) {
+    for (; i + 4 <= count; i += 4, dest += factor * 16) {
+      v4si out[4];
+      repeat_lanes((v4si)load_unaligned(src + i * 4), factor, out);
+      for (uint8_t k = 0; k < factor; ++k)
+        *(v2di_u *)(dest + k * 16) = (v2di)out[k];
+    }
+  } else if (lanes && bytes_pp == 2) {
+    for (; i + 8 <= count; i += 8, dest += factor * 16) {
+      v8hi p = (v8hi)load_unaligned(src + i * 2);
+      v4si out[8];
+      repeat_lanes((v4si)__builtin_ia32_punpcklwd128(p, p) >> 16, factor, out);
+      repeat_lanes((v4si)__builtin_ia32_punpckhwd128(p, p) >> 16, factor,
+                   out + factor);
+      for (uint8_t k = 0; k < factor; ++k)
+        *(v2di_u *)(dest + k * 16) =
+            (v2di)__builtin_ia32_packssdw128(out[2 * k], out[2 * k + 1]);
+    }
+  }
+
+  for (; i < count; ++i) {
+    const uint8_t *pixel = src + i * bytes_pp;
+    for (uint8_t k = 0; k < factor; ++k)
+      for (uint8_t b = 0; b < bytes_pp; ++b)
+        *dest++ = pixel[b];
+  }
+}
@@ -0,0 +1,195 @@
+#include "cpu.h"
+#include "io.h"
+#include "memory.h"
+#include "video.h"
+#include "video_internal.h"
+#include "video_kernels.h"
+
+// Macros
+#define PROBE_BYTES 0x10000 // Framebuffer bytes per run, RAM runs use half
+#define PROBE_RUNS 4        // Best of, after a warm-up run
+#define SHORT_ROWS 256
+#define SHORT_ROW_BYTES 64
+#define SHORT_ROW_OFFSET 4 // Off a 16-byte boundary, like most rects
+
+// The TSC is calibrated against PIT channel 2 counting down 10 ms. Port 0x61
+// gates the channel (bit 0), drives the speaker (bit 1) and reads its output
+// (bit 5)
+#define PIT_HZ 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_ONE_SHOT2 0xB0 // Channel 2, low then high byte, mode 0
+#define PIT_CONTROL 0x61
+#define PIT_GATE 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT 0x20
+#define CALIBRATE_MS 10
+#define CALIBRATE_SPINS 10000000
+
+// What the rest of the video module goes by, defaults until probed
+video_probe_t video_probe_result = {
+    .copy = VIDEO_COPY_STREAM,
+    .stream_fills = true,
+};
+
+// Timed operations
+enum probe_op {
+  PROBE_FILL,
+  PROBE_FILL_STREAM,
+  PROBE_COPY,
+  PROBE_SHORT_ROWS,
+};
+
+// RAM the framebuffer is copied from and read into, kept for later probes
+static uint8_t *ram = 0;
+
+// TSC ticks per millisecond
+static uint32_t tsc_khz = 0;
+
+// Helper function declaration
+static uint32_t calibrate_tsc(void);
+static uint32_t measure(enum probe_op op, enum video_copy kernel,
+                        uint8_t *dest, const uint8_t *src, uint32_t bytes);
+static void run(enum probe_op op, enum video_copy kernel, uint8_t *dest,
+                const uint8_t *src, uint32_t bytes);
+
+// Measure, then pick what the numbers favour
+int8_t video_probe(video_probe_t *result) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  if (!(edx & CPUID_FEAT_TSC) || !video_target.is_framebuffer ||
+      video_target.addr == 0)
+    return -1;
+
+  if (ram == 0) {
+    ram = mem_alloc(PROBE_BYTES, 16);
+    if (ram == 0)
+      return -1;
+  }
+
+  tsc_khz = calibrate_tsc();
+  if (tsc_khz == 0)
+    return -1;
+
+  // Top rows of the screen, whole kilobytes. Everything written is black
+  uint8_t *lfb = video_target.addr;
+  uint32_t lfb_bytes = video_target.pitch * video_target.height;
+  if (lfb_bytes > PROBE_BYTES)
+    lfb_bytes = PROBE_BYTES;
+  lfb_bytes &= ~1023U;
+  memset(ram, 0, PROBE_BYTES);
+
+  uint32_t half = PROBE_BYTES / 2;
+  video_probe_t p = {.tsc_mhz = tsc_khz / 1000};
+  p.ram_fill = measure(PROBE_FILL, 0, ram, 0, half);
+  p.ram_copy = measure(PROBE_COPY, VIDEO_COPY_SSE, ram + half, ram, half);
+  p.lfb_fill = measure(PROBE_FILL, 0, lfb, 0, lfb_bytes);
+  p.lfb_fill_stream = measure(PROBE_FILL_STREAM, 0, lfb, 0, lfb_bytes);
+  p.lfb_read = measure(PROBE_COPY, VIDEO_COPY_SSE, ram, lfb, lfb_bytes);
+
+  p.copy = VIDEO_COPY_REP;
+  for (uint8_t k = 0; k < VIDEO_COPY_COUNT; ++k) {
+    p.lfb_copy[k] = measure(PROBE_COPY, k, lfb, ram, lfb_bytes);
+    if (p.lfb_copy[k] > p.lfb_copy[p.copy])
+      p.copy = k;
+  }
+  p.stream_fills = p.lfb_fill_stream > p.lfb_fill;
+
+  uint32_t rows =
+      video_target.height < SHORT_ROWS ? video_target.height : SHORT_ROWS;
+  p.lfb_short_rows = measure(PROBE_SHORT_ROWS, p.copy, lfb, ram,
+                             rows * SHORT_ROW_BYTES);
+
+  // A console frame is mostly fills plus a scroll. Straight on screen that
+  // is three framebuffer writes and a read per pixel, with a back buffer two
+  // writes and a copy in RAM, then one present
+  double lfb_write =
+      p.lfb_fill > p.lfb_fill_stream ? p.lfb_fill : p.lfb_fill_stream;
+  double direct = 3.0 / lfb_write + 1.0 / p.lfb_read;
+  double back = 2.0 / p.ram_fill + 1.0 / p.ram_copy +
+                1.0 / p.lfb_copy[p.copy];
+  p.direct = direct < back;
+
+  // Whatever short rows lose against long ones is a fixed cost per row
+  uint32_t row_time = SHORT_ROW_BYTES * p.lfb_copy[p.copy] / p.lfb_short_rows;
+  if (row_time > SHORT_ROW_BYTES + UINT16_MAX)
+    row_time = SHORT_ROW_BYTES + UINT16_MAX;
+  p.row_overhead = row_time > SHORT_ROW_BYTES ? row_time - SHORT_ROW_BYTES : 0;
+
+  video_probe_result = p;
+  *result = p;
+  return 0;
+}
+
+// Count TSC ticks while PIT channel 2 runs out
+// Returns: ticks per millisecond, 0 when the PIT never fired
+static uint32_t calibrate_tsc(void) {
+  uint8_t control = inByte(PIT_CONTROL);
+  outByte(PIT_CONTROL, (control & ~PIT_SPEAKER) | PIT_GATE);
+
+  uint16_t count = PIT_HZ / (1000 / CALIBRATE_MS);
+  outByte(PIT_COMMAND, PIT_ONE_SHOT2);
+  outByte(PIT_CHANNEL2, count & 0xFF);
+  outByte(PIT_CHANNEL2, count >> 8);
+
+  uint64_t start = rdtsc();
+  uint32_t spins = 0;
+  while (!(inByte(PIT_CONTROL) & PIT_OUT) && spins < CALIBRATE_SPINS)
+    spins++;
+  uint32_t ticks = (uint32_t)(rdtsc() - start);
+
+  outByte(PIT_CONTROL, control);
+  if (spins == CALIBRATE_SPINS)
+    return 0;
+  return ticks / CALIBRATE_MS;
+}
+
+// Time the fastest of a few runs
+// Returns: MB/s, at least 1
+static uint32_t measure(enum probe_op op, enum video_copy kernel,
+                        uint8_t *dest, const uint8_t *src, uint32_t bytes) {
+  uint64_t best = UINT64_MAX;
+
+  for (uint8_t i = 0; i <= PROBE_RUNS; ++i) {
+    uint64_t start = rdtsc();
+    run(op, kernel, dest, src, bytes);
+
+    // Stores still sitting in write-combining buffers count too
+    asm volatile("sfence" : : : "memory");
+    uint64_t ticks = rdtsc() - start;
+    if (i > 0 && ticks < best)
+      best = ticks;
+  }
+
+  if (best == 0)
+    best = 1;
+  double mbps = (double)bytes * tsc_khz / (double)(int64_t)best / 1000;
+  return mbps < 1 ? 1 : (uint32_t)mbps;
+}
+
+static void run(enum probe_op op, enum video_copy kernel, uint8_t *dest,
+                const uint8_t *src, uint32_t bytes) {
+  fill_pattern_t black;
+
+  switch (op) {
+  case PROBE_FILL:
+  case PROBE_FILL_STREAM:
+    kernel_make_pattern(&black, 0, video_format.bytes_pp);
+    kernel_fill_row(dest, bytes, &black, op == PROBE_FILL_STREAM);
+    break;
+  case PROBE_COPY:
+    if (kernel == VIDEO_COPY_REP)
+      kernel_copy_row_rep(dest, src, bytes);
+    else
+      kernel_copy_row(dest, src, bytes, kernel == VIDEO_COPY_STREAM);
+    break;
+  case PROBE_SHORT_ROWS:
+    dest += SHORT_ROW_OFFSET;
+    for (; bytes >= SHORT_ROW_BYTES; bytes -= SHORT_ROW_BYTES) {
+      run(PROBE_COPY, kernel, dest, src, SHORT_ROW_BYTES);
+      dest += video_target.pitch;
+      src += SHORT_ROW_BYTES;
+    }
+    break;
+  }
+}
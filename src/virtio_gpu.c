@@ -0,0 +1,459 @@
+#include "virtio_gpu.h"
+#include "memory.h"
+#include "pci.h"
+
+// Vendor specific PCI capabilities point at the virtio structures. After the
+// ID and next pointer come the length, the structure type, its BAR, and its
+// offset and length inside the BAR. Notify structures add a multiplier
+#define PCI_CAP_VENDOR 0x09
+#define VIRTIO_CAP_BAR 4
+#define VIRTIO_CAP_OFFSET 8
+#define VIRTIO_CAP_NOTIFY_MULTIPLIER 16
+#define VIRTIO_CAP_COMMON 1
+#define VIRTIO_CAP_NOTIFY 2
+
+// Device status bits
+#define STATUS_ACKNOWLEDGE 0x01
+#define STATUS_DRIVER 0x02
+#define STATUS_DRIVER_OK 0x04
+#define STATUS_FEATURES_OK 0x08
+#define STATUS_FAILED 0x80
+
+// VIRTIO_F_VERSION_1 is feature bit 32, bit 0 of the second feature word
+#define FEATURE_VERSION_1 0x01
+
+// Split virtqueue flags
+#define DESC_NEXT 0x01
+#define DESC_WRITE 0x02
+#define AVAIL_NO_INTERRUPT 0x01
+
+// Control queue, two descriptors (request and response) per command
+#define CONTROL_QUEUE 0
+#define QUEUE_SIZE 64
+#define REQUEST_BYTES 64
+
+// Commands and responses
+#define CMD_GET_DISPLAY_INFO 0x0100
+#define CMD_RESOURCE_CREATE_2D 0x0101
+#define CMD_SET_SCANOUT 0x0103
+#define CMD_RESOURCE_FLUSH 0x0104
+#define CMD_TRANSFER_TO_HOST_2D 0x0105
+#define CMD_RESOURCE_ATTACH_BACKING 0x0106
+#define RESP_OK_FIRST 0x1100
+#define RESP_ERR_FIRST 0x1200
+
+#define FORMAT_B8G8R8X8 2 // XRGB8888 as little endian words
+#define RESOURCE_ID 1
+#define MAX_SCANOUTS 16
+
+// Used when the host reports no enabled scanout
+#define DEFAULT_WIDTH 1024
+#define DEFAULT_HEIGHT 768
+
+// The host works asynchronously, polls give up after this many reads
+#define SYNC_SPINS 200000000
+
+// Compiler barrier. x86 keeps stores in order, so ring updates reach memory
+// in program order as long as the compiler does not reorder them
+#define barrier() asm volatile("" : : : "memory")
+
+// virtio_pci_common_cfg, 64-bit fields split into two 32-bit halves
+struct virtio_common {
+  uint32_t device_feature_select;
+  uint32_t device_feature;
+  uint32_t driver_feature_select;
+  uint32_t driver_feature;
+  uint16_t msix_config;
+  uint16_t num_queues;
+  uint8_t device_status;
+  uint8_t config_generation;
+  uint16_t queue_select;
+  uint16_t queue_size;
+  uint16_t queue_msix_vector;
+  uint16_t queue_enable;
+  uint16_t queue_notify_off;
+  uint32_t queue_desc[2];
+  uint32_t queue_driver[2];
+  uint32_t queue_device[2];
+};
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct virtq_avail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[QUEUE_SIZE];
+};
+
+struct virtq_used {
+  uint16_t flags;
+  uint16_t idx;
+  struct {
+    uint32_t id;
+    uint32_t len;
+  } ring[QUEUE_SIZE];
+};
+
+struct gpu_header {
+  uint32_t type;
+  uint32_t flags;
+  uint64_t fence_id;
+  uint32_t ctx_id;
+  uint8_t ring_idx;
+  uint8_t padding[3];
+};
+
+struct gpu_rect {
+  uint32_t x, y, width, height;
+};
+
+struct display_info {
+  struct gpu_header header;
+  struct {
+    struct gpu_rect r;
+    uint32_t enabled;
+    uint32_t flags;
+  } modes[MAX_SCANOUTS];
+};
+
+struct resource_create_2d {
+  struct gpu_header header;
+  uint32_t resource_id;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+};
+
+struct attach_backing {
+  struct gpu_header header;
+  uint32_t resource_id;
+  uint32_t entries;
+  uint64_t addr; // The one entry, contiguous guest RAM
+  uint32_t length;
+  uint32_t padding;
+};
+
+struct set_scanout {
+  struct gpu_header header;
+  struct gpu_rect r;
+  uint32_t scanout_id;
+  uint32_t resource_id;
+};
+
+struct resource_flush {
+  struct gpu_header header;
+  struct gpu_rect r;
+  uint32_t resource_id;
+  uint32_t padding;
+};
+
+struct transfer_to_host_2d {
+  struct gpu_header header;
+  struct gpu_rect r;
+  uint64_t offset; // Of the rect's first pixel in guest RAM
+  uint32_t resource_id;
+  uint32_t padding;
+};
+
+// Buffers of one command in flight
+struct command {
+  uint8_t request[REQUEST_BYTES];
+  struct gpu_header response;
+};
+
+// Device registers
+static volatile struct virtio_common *common = 0;
+static volatile uint16_t *notify = 0;
+
+// Control queue. Command i owns descriptors 2i and 2i + 1, and commands are
+// used round robin, so the descriptor chains never change
+static struct virtq_desc *desc = 0;
+static struct virtq_avail *avail = 0;
+static volatile struct virtq_used *used = 0;
+static struct command *commands = 0;
+static uint16_t queue_size = 0;
+static uint16_t next_avail = 0;
+static uint16_t next_used = 0;
+static bool notified = true;
+
+// Scanout resource
+static uint8_t *framebuffer = 0;
+static uint16_t width = 0;
+static uint16_t height = 0;
+
+// Helper function declaration
+static int8_t setup_transport(pci_device_t dev);
+static int8_t setup_queue(void);
+static int8_t setup_scanout(void);
+static int8_t submit(const void *request, uint32_t request_bytes,
+                     void *response, uint32_t response_bytes);
+static int8_t sync(void);
+
+int8_t virtio_gpu_init(void) {
+  if (framebuffer != 0)
+    return 0;
+
+  pci_device_t dev;
+  if (pci_find_device(VIRTIO_GPU_PCI_VENDOR, VIRTIO_GPU_PCI_DEVICE, &dev) != 0)
+    return -1;
+  pci_enable_memory(dev);
+
+  if (setup_transport(dev) != 0 || setup_queue() != 0 ||
+      setup_scanout() != 0) {
+    if (common != 0)
+      common->device_status |= STATUS_FAILED;
+    framebuffer = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t *virtio_gpu_framebuffer(void) { return framebuffer; }
+
+uint16_t virtio_gpu_width(void) { return width; }
+
+uint16_t virtio_gpu_height(void) { return height; }
+
+int8_t virtio_gpu_transfer(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  if (framebuffer == 0)
+    return -1;
+
+  struct transfer_to_host_2d cmd = {
+      .header.type = CMD_TRANSFER_TO_HOST_2D,
+      .r = {x, y, w, h},
+      .offset = ((uint32_t)y * width + x) * 4,
+      .resource_id = RESOURCE_ID,
+  };
+  return submit(&cmd, sizeof(cmd), 0, 0);
+}
+
+int8_t virtio_gpu_flush(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  if (framebuffer == 0)
+    return -1;
+
+  struct resource_flush cmd = {
+      .header.type = CMD_RESOURCE_FLUSH,
+      .r = {x, y, w, h},
+      .resource_id = RESOURCE_ID,
+  };
+  if (submit(&cmd, sizeof(cmd), 0, 0) != 0)
+    return -1;
+  return sync();
+}
+
+// Helper functions
+// Find the common and notify structures and negotiate features
+static int8_t setup_transport(pci_device_t dev) {
+  uint32_t notify_base = 0;
+  uint32_t notify_multiplier = 0;
+
+  for (uint8_t cap = pci_find_capability(dev, PCI_CAP_VENDOR, 0); cap != 0;
+       cap = pci_find_capability(dev, PCI_CAP_VENDOR, cap)) {
+    uint8_t type = pci_read32(dev, cap) >> 24;
+    uint8_t bar = pci_read32(dev, cap + VIRTIO_CAP_BAR) & 0xFF;
+    if (bar > 5 || pci_bar_address(dev, bar) == 0)
+      continue;
+
+    uint32_t addr =
+        pci_bar_address(dev, bar) + pci_read32(dev, cap + VIRTIO_CAP_OFFSET);
+    if (type == VIRTIO_CAP_COMMON && common == 0) {
+      common = (volatile struct virtio_common *)(uintptr_t)addr;
+    } else if (type == VIRTIO_CAP_NOTIFY && notify_base == 0) {
+      notify_base = addr;
+      notify_multiplier =
+          pci_read32(dev, cap + VIRTIO_CAP_NOTIFY_MULTIPLIER);
+    }
+  }
+  if (common == 0 || notify_base == 0)
+    return -1;
+
+  // Reset, then introduce the driver
+  common->device_status = 0;
+  for (uint32_t spins = 0; common->device_status != 0; ++spins) {
+    if (spins == SYNC_SPINS)
+      return -1;
+  }
+  common->device_status = STATUS_ACKNOWLEDGE;
+  common->device_status |= STATUS_DRIVER;
+
+  // Only the modern interface is used, no optional features
+  common->device_feature_select = 1;
+  if (!(common->device_feature & FEATURE_VERSION_1))
+    return -1;
+  common->driver_feature_select = 0;
+  common->driver_feature = 0;
+  common->driver_feature_select = 1;
+  common->driver_feature = FEATURE_VERSION_1;
+  common->device_status |= STATUS_FEATURES_OK;
+  if (!(common->device_status & STATUS_FEATURES_OK))
+    return -1;
+
+  common->queue_select = CONTROL_QUEUE;
+  notify = (volatile uint16_t *)(uintptr_t)(
+      notify_base + common->queue_notify_off * notify_multiplier);
+  return 0;
+}
+
+// Hand the control queue to the device and go live
+static int8_t setup_queue(void) {
+  uint16_t size = common->queue_size;
+  if (size < 2)
+    return -1;
+  if (size > QUEUE_SIZE)
+    size = QUEUE_SIZE;
+
+  desc = mem_alloc(sizeof(struct virtq_desc) * size, 16);
+  avail = mem_alloc(sizeof(struct virtq_avail), 16);
+  used = mem_alloc(sizeof(struct virtq_used), 16);
+  commands = mem_alloc(sizeof(struct command) * (size / 2), 16);
+  if (desc == 0 || avail == 0 || used == 0 || commands == 0)
+    return -1;
+  memset(avail, 0, sizeof(struct virtq_avail));
+  memset((void *)used, 0, sizeof(struct virtq_used));
+
+  // Fixed chains, request readable by the device and response writable
+  for (uint16_t i = 0; i < size / 2; ++i) {
+    desc[2 * i] = (struct virtq_desc){
+        .addr = (uintptr_t)commands[i].request,
+        .flags = DESC_NEXT,
+        .next = 2 * i + 1,
+    };
+    desc[2 * i + 1] = (struct virtq_desc){
+        .addr = (uintptr_t)&commands[i].response,
+        .len = sizeof(struct gpu_header),
+        .flags = DESC_WRITE,
+    };
+  }
+
+  // Completions are polled
+  avail->flags = AVAIL_NO_INTERRUPT;
+  queue_size = size;
+  next_avail = 0;
+  next_used = 0;
+
+  common->queue_size = size;
+  common->queue_desc[0] = (uintptr_t)desc;
+  common->queue_desc[1] = 0;
+  common->queue_driver[0] = (uintptr_t)avail;
+  common->queue_driver[1] = 0;
+  common->queue_device[0] = (uintptr_t)used;
+  common->queue_device[1] = 0;
+  common->queue_enable = 1;
+  common->device_status |= STATUS_DRIVER_OK;
+  return 0;
+}
+
+// Create the resource, back it with guest RAM and show it
+static int8_t setup_scanout(void) {
+  static struct display_info info;
+  struct gpu_header get = {.type = CMD_GET_DISPLAY_INFO};
+  if (submit(&get, sizeof(get), &info, sizeof(info)) != 0 || sync() != 0 ||
+      info.header.type >= RESP_ERR_FIRST)
+    return -1;
+
+  width = DEFAULT_WIDTH;
+  height = DEFAULT_HEIGHT;
+  if (info.modes[0].enabled && info.modes[0].r.width != 0 &&
+      info.modes[0].r.height != 0 && info.modes[0].r.width <= UINT16_MAX &&
+      info.modes[0].r.height <= UINT16_MAX) {
+    width = info.modes[0].r.width;
+    height = info.modes[0].r.height;
+  }
+
+  uint32_t size = (uint32_t)width * height * 4;
+  framebuffer = mem_alloc(size, 4096);
+  if (framebuffer == 0)
+    return -1;
+  memset(framebuffer, 0, size);
+
+  struct resource_create_2d create = {
+      .header.type = CMD_RESOURCE_CREATE_2D,
+      .resource_id = RESOURCE_ID,
+      .format = FORMAT_B8G8R8X8,
+      .width = width,
+      .height = height,
+  };
+  struct attach_backing attach = {
+      .header.type = CMD_RESOURCE_ATTACH_BACKING,
+      .resource_id = RESOURCE_ID,
+      .entries = 1,
+      .addr = (uintptr_t)framebuffer,
+      .length = size,
+  };
+  struct set_scanout scanout = {
+      .header.type = CMD_SET_SCANOUT,
+      .r = {0, 0, width, height},
+      .scanout_id = 0,
+      .resource_id = RESOURCE_ID,
+  };
+  if (submit(&create, sizeof(create), 0, 0) != 0 ||
+      submit(&attach, sizeof(attach), 0, 0) != 0 ||
+      submit(&scanout, sizeof(scanout), 0, 0) != 0)
+    return -1;
+
+  // The host resource starts out undefined, show the black one
+  if (virtio_gpu_transfer(0, 0, width, height) != 0)
+    return -1;
+  return virtio_gpu_flush(0, 0, width, height);
+}
+
+// Queue a command, its response goes to the command's own buffer unless
+// 'response' is given. A full queue is sent and waited for first
+static int8_t submit(const void *request, uint32_t request_bytes,
+                     void *response, uint32_t response_bytes) {
+  uint16_t slots = queue_size / 2;
+  if (request_bytes > REQUEST_BYTES)
+    return -1;
+  if ((uint16_t)(next_avail - next_used) == slots && sync() != 0)
+    return -1;
+
+  uint16_t slot = next_avail % slots;
+  struct command *cmd = &commands[slot];
+  memcpy(cmd->request, request, request_bytes);
+  desc[2 * slot].len = request_bytes;
+  desc[2 * slot + 1].addr = (uintptr_t)(response ? response : &cmd->response);
+  desc[2 * slot + 1].len =
+      response ? response_bytes : sizeof(struct gpu_header);
+  cmd->response.type = 0;
+
+  avail->ring[next_avail % queue_size] = 2 * slot;
+  barrier();
+  avail->idx = ++next_avail;
+  notified = false;
+  return 0;
+}
+
+// Notify the device and wait until it has processed every queued command
+// Returns: 0 = all succeeded, -1 = an error response or no progress
+static int8_t sync(void) {
+  if (!notified) {
+    barrier();
+    *notify = CONTROL_QUEUE;
+    notified = true;
+  }
+
+  for (uint32_t spins = 0; used->idx != next_avail; ++spins) {
+    if (spins == SYNC_SPINS)
+      return -1;
+  }
+  barrier();
+
+  // Responses written to a caller's buffer are checked by the caller
+  int8_t status = 0;
+  uint16_t slots = queue_size / 2;
+  for (; next_used != next_avail; ++next_used) {
+    struct command *cmd = &commands[next_used % slots];
+    uint32_t type = cmd->response.type;
+    if (desc[2 * (next_used % slots) + 1].addr ==
+            (uintptr_t)&cmd->response &&
+        (type < RESP_OK_FIRST || type >= RESP_ERR_FIRST))
+      status = -1;
+  }
+  return status;
+}
@@ -0,0 +1,168 @@
+#!/usr/bin/env python3
+"""Decode framebuffer captures sent over COM1 into PNG files.
+
+Run the kernel headless with the serial port going to a file, e.g.
+
+    qemu-system-i386 -cdrom CandyCane.iso -display none \
+        -serial file:capture.bin
+
+then send 'D' (dump) or 'C' (CRC) to the serial port, or call
+video_capture_dump() / video_capture_send_crc() from the kernel, and run
+
+    tools/fbdump.py capture.bin [-o prefix]
+
+Every dump becomes <prefix>-<n>.png and every CRC record is printed. Other
+serial output around the records is skipped. The exit code is 1 when a dump
+fails its CRC, or when --expect is given and a CRC differs from it.
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+DUMP_MAGIC = b"CCFB"
+CRC_MAGIC = b"CCCR"
+
+PACKET_LITERAL = 0
+PACKET_RUN = 1
+PACKET_COPY_UP = 2
+PACKET_LONG = 0x3F
+
+
+class Truncated(Exception):
+    pass
+
+
+def read_count(data, pos, header):
+    count = header & PACKET_LONG
+    if count == PACKET_LONG:
+        if pos + 2 > len(data):
+            raise Truncated()
+        count = struct.unpack_from("<H", data, pos)[0]
+        pos += 2
+    return count + 1, pos
+
+
+def decode_dump(data, pos):
+    """Decode a dump whose header starts at pos.
+
+    Returns (x, y, width, height, rgb rows, crc ok, end position)."""
+    if pos + 13 > len(data):
+        raise Truncated()
+    version = data[pos + 4]
+    if version != 1:
+        raise ValueError("unknown dump version %d" % version)
+    x, y, w, h = struct.unpack_from("<4H", data, pos + 5)
+    pos += 13
+
+    rows = []
+    above = None
+    for _ in range(h):
+        row = bytearray()
+        while len(row) < w * 3:
+            if pos >= len(data):
+                raise Truncated()
+            header = data[pos]
+            pos += 1
+            count, pos = read_count(data, pos, header)
+            kind = header >> 6
+
+            if kind == PACKET_LITERAL:
+                if pos + count * 3 > len(data):
+                    raise Truncated()
+                row += data[pos:pos + count * 3]
+                pos += count * 3
+            elif kind == PACKET_RUN:
+                if pos + 3 > len(data):
+                    raise Truncated()
+                row += data[pos:pos + 3] * count
+                pos += 3
+            elif kind == PACKET_COPY_UP and above is not None:
+                start = len(row)
+                row += above[start:start + count * 3]
+            else:
+                raise ValueError("bad packet 0x%02x" % header)
+
+        if len(row) != w * 3:
+            raise ValueError("row overruns the dump width")
+        rows.append(bytes(row))
+        above = row
+
+    if pos + 4 > len(data):
+        raise Truncated()
+    crc = struct.unpack_from("<I", data, pos)[0]
+    pos += 4
+    ok = zlib.crc32(b"".join(rows)) == crc
+    return x, y, w, h, rows, ok, pos
+
+
+def write_png(path, w, h, rows):
+    def chunk(kind, body):
+        return (struct.pack(">I", len(body)) + kind + body +
+                struct.pack(">I", zlib.crc32(kind + body)))
+
+    raw = b"".join(b"\x00" + row for row in rows)
+    with open(path, "wb") as f:
+        f.write(b"\x89PNG\r\n\x1a\n")
+        f.write(chunk(b"IHDR", struct.pack(">IIBBBBB", w, h, 8, 2, 0, 0, 0)))
+        f.write(chunk(b"IDAT", zlib.compress(raw, 9)))
+        f.write(chunk(b"IEND", b""))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", help="serial output captured from COM1")
+    parser.add_argument("-o", "--prefix", default="frame",
+                        help="PNG file name prefix (default: frame)")
+    parser.add_argument("--expect", type=lambda v: int(v, 16),
+                        help="CRC32 in hex that every record must match")
+    args = parser.parse_args()
+
+    with open(args.log, "rb") as f:
+        data = f.read()
+
+    failed = False
+    dumps = 0
+    pos = 0
+    while pos < len(data):
+        dump_at = data.find(DUMP_MAGIC, pos)
+        crc_at = data.find(CRC_MAGIC, pos)
+        found = [p for p in (dump_at, crc_at) if p >= 0]
+        if not found:
+            break
+        pos = min(found)
+
+        try:
+            if pos == crc_at:
+                if pos + 16 > len(data):
+                    raise Truncated()
+                x, y, w, h, crc = struct.unpack_from("<4HI", data, pos + 4)
+                pos += 16
+            else:
+                x, y, w, h, rows, ok, pos = decode_dump(data, pos)
+                crc = zlib.crc32(b"".join(rows))
+                path = "%s-%d.png" % (args.prefix, dumps)
+                dumps += 1
+                write_png(path, w, h, rows)
+                print("%s: %dx%d at %d,%d%s" %
+                      (path, w, h, x, y, "" if ok else " CRC MISMATCH"))
+                failed |= not ok
+        except Truncated:
+            print("truncated record at offset %d" % pos, file=sys.stderr)
+            return 1
+        except ValueError as e:
+            # Not a record after all, look for the next one
+            print("skipping offset %d: %s" % (pos, e), file=sys.stderr)
+            pos += 4
+            continue
+
+        print("crc %08x for %dx%d at %d,%d" % (crc, w, h, x, y))
+        if args.expect is not None and crc != args.expect:
+            failed = True
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Render a TrueType font into an anti-aliased console font module.
+
+Glyphs are rasterized once at build time with Pillow, e.g.
+
+    tools/mkfont.py /usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf 16 \
+        -o mono16.ccf
+    make run FONT=mono16.ccf
+
+The kernel loads the module with font_load_coverage(). Every glyph is a
+cell of width x height coverage bytes (0 - 255), indexed by its Latin-1
+character code. Codes without a printable character stay blank. A
+monospaced font gives the best result, every glyph is drawn into the same
+cell regardless of its own advance.
+"""
+
+import argparse
+import struct
+import sys
+
+try:
+    from PIL import Image, ImageDraw, ImageFont
+except ImportError:
+    sys.exit("mkfont.py needs Pillow (pip install pillow)")
+
+MAGIC = b"CCAF"
+VERSION = 1
+MAX_WIDTH = 64
+MAX_HEIGHT = 128
+
+
+def printable(code):
+    return 0x20 <= code < 0x7F or code >= 0xA0
+
+
+def cell_size(font, count):
+    ascent, descent = font.getmetrics()
+    width = max(int(round(font.getlength(chr(code))))
+                for code in range(count) if printable(code))
+    return max(width, 1), ascent + descent, ascent
+
+
+def render(font, code, width, height, ascent):
+    image = Image.new("L", (width, height), 0)
+    if printable(code):
+        ImageDraw.Draw(image).text((0, ascent), chr(code), fill=255,
+                                   font=font, anchor="ls")
+    return image.tobytes()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("ttf", help="TrueType or OpenType font file")
+    parser.add_argument("size", type=int, help="font size in pixels")
+    parser.add_argument("-o", "--output", required=True,
+                        help="font module to write")
+    parser.add_argument("--glyphs", type=int, default=256, choices=(128, 256),
+                        help="character codes to render (default: 256)")
+    args = parser.parse_args()
+
+    font = ImageFont.truetype(args.ttf, args.size)
+    width, height, ascent = cell_size(font, args.glyphs)
+    if width > MAX_WIDTH or height > MAX_HEIGHT:
+        sys.exit("cell of %dx%d pixels is larger than %dx%d"
+                 % (width, height, MAX_WIDTH, MAX_HEIGHT))
+
+    data = bytearray(MAGIC)
+    data += struct.pack("<BBHHH", VERSION, 0, width, height, args.glyphs)
+    for code in range(args.glyphs):
+        data += render(font, code, width, height, ascent)
+
+    with open(args.output, "wb") as f:
+        f.write(data)
+    print("%s: %d glyphs of %dx%d pixels" % (args.output, args.glyphs, width,
+                                             height))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())